@@ -5,6 +5,8 @@
 #include <assert.h>
 #include <string.h>
 #include <limits.h>
+#include <inttypes.h>
+#include <math.h>
 #include "groupby.h"
 
 /*
@@ -16,58 +18,56 @@ static size_t ll_size(void)
     return sizeof(long long);
 }
 
-static char const *ll_finalize(void *v_)
+static char const *ll_finalize(void *v_, char str[AGGR_STR_SIZE])
 {
     long long *v = v_;
-    static char str[32];
-    snprintf(str, sizeof(str), "%lld", *v);
+    snprintf(str, AGGR_STR_SIZE, "%lld", *v);
     return str;
 }
 
-static long long ll_of_str(char const *str)
+static long long ll_finalize_ll(void const *v_)
 {
-    return strtoll(str, NULL, 0);   // TODO: error check?
+    long long const *v = v_;
+    return *v;
 }
 
-struct str_value {
-    char *str;
-    size_t size;
-};
+static int ll_cmp(void const *a_, void const *b_)
+{
+    long long const *a = a_, *b = b_;
+    return *a < *b ? -1 : *a > *b;
+}
 
+// String values are ids in the global dictionary
 static size_t str_size(void)
 {
-    return sizeof(struct str_value);
+    return sizeof(uint32_t);
 }
 
 static void str_ctor(void *v_)
 {
-    struct str_value *v = v_;
-    v->str = NULL;
-    v->size = 0;
+    uint32_t *v = v_;
+    *v = DICT_NONE;
 }
 
-static char const *str_finalize(void *v_)
+static char const *str_finalize(void *v_, char str[AGGR_STR_SIZE])
 {
-    struct str_value *v = v_;
-    return v->str;
+    (void)str;
+    uint32_t *v = v_;
+    return dict_str(*v);
 }
 
-static void str_value_set(struct str_value *v, char const *str)
+static int str_cmp(void const *a_, void const *b_)
 {
-    unsigned size = strlen(str) + 1;
-    if (size > v->size) {
-        v->size = 4 * size + 1;
-        char *new = malloc(v->size);
-        if (new) {
-            strcpy(new, str);
-            if (v->str) free(v->str);
-            v->str = new;
-        } else {
-            // ?
-        }
-    } else {
-        strcpy(v->str, str);
-    }
+    uint32_t const *a = a_, *b = b_;
+    return dict_cmp(*a, *b);
+}
+
+static int str_set(uint32_t *v, char const *str)
+{
+    uint32_t const id = dict_intern(str);
+    if (id == DICT_NONE) return -1;
+    *v = id;
+    return 0;
 }
 
 /*
@@ -84,14 +84,23 @@ static void rem_ctor(void *v_)
     (void)v_;
 }
 
-static void rem_fold(void *v_, char const *current)
+static int rem_fold(void *v_, char const *current)
 {
     (void)v_;
     (void)current;
+    return 0;
 }
 
-static char const *rem_finalize(void *v_)
+static int rem_merge(void *v_, void const *other_)
 {
+    (void)v_;
+    (void)other_;
+    return 0;
+}
+
+static char const *rem_finalize(void *v_, char str[AGGR_STR_SIZE])
+{
+    (void)str;
     (void)v_;
     return "";
 }
@@ -100,11 +109,6 @@ static char const *rem_finalize(void *v_)
  * Avg
  */
 
-struct avg_value {
-    unsigned nb_values;
-    long long sum;
-};
-
 static size_t avg_size(void)
 {
     return sizeof(struct avg_value);
@@ -117,23 +121,61 @@ static void avg_ctor(void *v_)
     v->sum = 0;
 }
 
-static void avg_fold(void *v_, char const *current)
+static void avg_fold_ll(void *v_, long long current)
+{
+    aggr_avg_ll(v_, current);
+}
+
+static int avg_fold(void *v_, char const *current)
+{
+    avg_fold_ll(v_, ll_of_str(current));
+    return 0;
+}
+
+static void avg_fold_atomic(void *v_, long long current)
 {
     struct avg_value *v = v_;
-    v->nb_values ++;
-    v->sum += ll_of_str(current);
+    __atomic_fetch_add(&v->nb_values, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&v->sum, current, __ATOMIC_RELAXED);
 }
 
-static char const *avg_finalize(void *v_)
+static int avg_merge(void *v_, void const *other_)
+{
+    struct avg_value *v = v_;
+    struct avg_value const *other = other_;
+    v->nb_values += other->nb_values;
+    v->sum += other->sum;
+    return 0;
+}
+
+static long long avg_value(struct avg_value const *v)
+{
+    return (v->sum + v->nb_values/2) / v->nb_values;
+}
+
+static char const *avg_finalize(void *v_, char str[AGGR_STR_SIZE])
 {
     struct avg_value *v = v_;
     assert(v->nb_values > 0);
 
-    static char str[32];
-    snprintf(str, sizeof(str), "%lld", (v->sum + v->nb_values/2) / v->nb_values);
+    snprintf(str, AGGR_STR_SIZE, "%lld", avg_value(v));
     return str;
 }
 
+static long long avg_finalize_ll(void const *v_)
+{
+    struct avg_value const *v = v_;
+    return v->nb_values > 0 ? avg_value(v) : 0;
+}
+
+static int avg_cmp(void const *a_, void const *b_)
+{
+    struct avg_value const *a = a_, *b = b_;
+    if (! a->nb_values || ! b->nb_values) return !!a->nb_values - !!b->nb_values;
+    long long const va = avg_value(a), vb = avg_value(b);
+    return va < vb ? -1 : va > vb;
+}
+
 /*
  * Min
  */
@@ -144,11 +186,28 @@ static void min_ctor(void *v_)
     *v = LLONG_MAX;
 }
 
-static void min_fold(void *v_, char const *current)
+static void min_fold_ll(void *v_, long long current)
+{
+    aggr_min_ll(v_, current);
+}
+
+static int min_fold(void *v_, char const *current)
+{
+    min_fold_ll(v_, ll_of_str(current));
+    return 0;
+}
+
+static void min_fold_atomic(void *v_, long long current)
 {
     long long *v = v_;
-    long long const c = ll_of_str(current);
-    if (c < *v) *v = c;
+    long long old = __atomic_load_n(v, __ATOMIC_RELAXED);
+    while (current < old && ! __atomic_compare_exchange_n(v, &old, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+static int min_merge(void *v_, void const *other_)
+{
+    min_fold_ll(v_, *(long long const *)other_);
+    return 0;
 }
 
 /*
@@ -161,11 +220,28 @@ static void max_ctor(void *v_)
     *v = LLONG_MIN;
 }
 
-static void max_fold(void *v_, char const *current)
+static void max_fold_ll(void *v_, long long current)
+{
+    aggr_max_ll(v_, current);
+}
+
+static int max_fold(void *v_, char const *current)
+{
+    max_fold_ll(v_, ll_of_str(current));
+    return 0;
+}
+
+static void max_fold_atomic(void *v_, long long current)
 {
     long long *v = v_;
-    long long const c = ll_of_str(current);
-    if (c > *v) *v = c;
+    long long old = __atomic_load_n(v, __ATOMIC_RELAXED);
+    while (current > old && ! __atomic_compare_exchange_n(v, &old, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+static int max_merge(void *v_, void const *other_)
+{
+    max_fold_ll(v_, *(long long const *)other_);
+    return 0;
 }
 
 /*
@@ -178,50 +254,357 @@ static void sum_ctor(void *v_)
     *v = 0;
 }
 
-static void sum_fold(void *v_, char const *current)
+static void sum_fold_ll(void *v_, long long current)
+{
+    aggr_sum_ll(v_, current);
+}
+
+static int sum_fold(void *v_, char const *current)
+{
+    sum_fold_ll(v_, ll_of_str(current));
+    return 0;
+}
+
+static void sum_fold_atomic(void *v_, long long current)
 {
     long long *v = v_;
-    *v += ll_of_str(current);
+    __atomic_fetch_add(v, current, __ATOMIC_RELAXED);
+}
+
+static int sum_merge(void *v_, void const *other_)
+{
+    sum_fold_ll(v_, *(long long const *)other_);
+    return 0;
 }
 
 /*
  * First
  */
 
-static void first_fold(void *v_, char const *current)
+static int first_fold(void *v_, char const *current)
 {
-    struct str_value *v = v_;
-    if (! v->str) str_value_set(v, current);
+    uint32_t *v = v_;
+    return *v == DICT_NONE ? str_set(v, current) : 0;
+}
+
+static int first_merge(void *v_, void const *other_)
+{
+    uint32_t *v = v_;
+    uint32_t const *other = other_;
+    if (*v == DICT_NONE) *v = *other;
+    return 0;
 }
 
 /*
  * Last
+ * Only the value of the last row survives, so a value not yet in the
+ * dictionary is kept in a malloced copy of the group rather than interned:
+ * interning every value a group goes through would grow the dictionary with
+ * all the distinct values of the input. The first value of a group is
+ * interned though, as it is the last one of the groups of a single row.
  */
 
-static void last_fold(void *v_, char const *current)
+struct last_value {
+    uint32_t id;        // DICT_NONE while the value is the pending one (if any)
+    uint32_t size;      // of pending
+    char *pending;
+};
+
+static size_t last_size(void)
+{
+    return sizeof(struct last_value);
+}
+
+static void last_ctor(void *v_)
+{
+    struct last_value *v = v_;
+    v->id = DICT_NONE;
+    v->size = 0;
+    v->pending = NULL;
+}
+
+static void last_dtor(void *v_)
+{
+    struct last_value *v = v_;
+    free(v->pending);
+    last_ctor(v);
+}
+
+static char const *last_str(struct last_value const *v)
+{
+    return v->id == DICT_NONE && v->pending ? v->pending : dict_str(v->id);
+}
+
+static int last_set_pending(struct last_value *v, char const *str)
+{
+    size_t const len = strlen(str);
+    if (len >= v->size) {
+        if (len >= UINT32_MAX) {
+            fprintf(stderr, "Value too long for last: %zu bytes\n", len);
+            return -1;
+        }
+        uint32_t const size = len < 32 ? 32 : len + 1;
+        char *pending = malloc(size);
+        if (! pending) {
+            fprintf(stderr, "Cannot malloc %"PRIu32" bytes for a last value\n", size);
+            return -1;
+        }
+        STATS_ADD(alloc_bytes, size);
+        free(v->pending);
+        v->pending = pending;
+        v->size = size;
+    }
+    memcpy(v->pending, str, len + 1);
+    v->id = DICT_NONE;
+    return 0;
+}
+
+static int last_fold(void *v_, char const *current)
 {
-    struct str_value *v = v_;
-    str_value_set(v, current);
+    struct last_value *v = v_;
+    if (v->id == DICT_NONE && ! v->pending) return str_set(&v->id, current);
+    // Runs of the same value need not be looked up again
+    if (0 == strcmp(last_str(v), current)) return 0;
+    uint32_t const id = dict_lookup(current);
+    if (id == DICT_NONE) return last_set_pending(v, current);
+    v->id = id;
+    return 0;
+}
+
+static char const *last_finalize(void *v_, char str[AGGR_STR_SIZE])
+{
+    (void)str;
+    return last_str(v_);
+}
+
+static int last_cmp(void const *a_, void const *b_)
+{
+    struct last_value const *a = a_, *b = b_;
+    // Pending values have no rank
+    if ((a->id == DICT_NONE && a->pending) || (b->id == DICT_NONE && b->pending)) {
+        return strcmp(last_str(a), last_str(b));
+    }
+    return dict_cmp(a->id, b->id);
+}
+
+static int last_merge(void *v_, void const *other_)
+{
+    struct last_value *v = v_;
+    struct last_value const *other = other_;
+    if (other->id != DICT_NONE) v->id = other->id;
+    else if (other->pending) return last_set_pending(v, other->pending);
+    return 0;
 }
 
 /*
  * Smallest
  */
 
-static void smallest_fold(void *v_, char const *current)
+static int smallest_fold(void *v_, char const *current)
 {
-    struct str_value *v = v_;
-    if (! v->str || strcmp(v->str, current) > 0) str_value_set(v, current);
+    uint32_t *v = v_;
+    // The current value has no id, let alone a rank, until it is interned
+    if (*v == DICT_NONE || strcmp(dict_str(*v), current) > 0) return str_set(v, current);
+    return 0;
+}
+
+static int smallest_merge(void *v_, void const *other_)
+{
+    uint32_t *v = v_;
+    uint32_t const *other = other_;
+    if (*other != DICT_NONE && (*v == DICT_NONE || dict_cmp(*v, *other) > 0)) *v = *other;
+    return 0;
 }
 
 /*
  * Greatest
  */
 
-static void greatest_fold(void *v_, char const *current)
+static int greatest_fold(void *v_, char const *current)
+{
+    uint32_t *v = v_;
+    if (*v == DICT_NONE || strcmp(dict_str(*v), current) < 0) return str_set(v, current);
+    return 0;
+}
+
+static int greatest_merge(void *v_, void const *other_)
+{
+    uint32_t *v = v_;
+    uint32_t const *other = other_;
+    if (*other != DICT_NONE && (*v == DICT_NONE || dict_cmp(*v, *other) < 0)) *v = *other;
+    return 0;
+}
+
+/*
+ * Count
+ */
+
+static int count_fold(void *v_, char const *current)
+{
+    (void)current;
+    aggr_count(v_);
+    return 0;
+}
+
+static void count_fold_ll(void *v_, long long current)
+{
+    (void)current;
+    aggr_count(v_);
+}
+
+static void count_fold_atomic(void *v_, long long current)
+{
+    (void)current;
+    long long *v = v_;
+    __atomic_fetch_add(v, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count_nonempty
+ */
+
+static int count_nonempty_fold(void *v_, char const *current)
+{
+    if (*current != '\0') aggr_count(v_);
+    return 0;
+}
+
+/*
+ * Count_distinct
+ * Hashes of the values are kept in an open addressing set (0 marking free
+ * slots) until there are more than DISTINCT_MAX_EXACT of them, and then in a
+ * HyperLogLog. Both are malloced, and freed by the destructor of the group.
+ */
+
+#define DISTINCT_MAX_EXACT 1024
+#define DISTINCT_MIN_SLOTS 8
+
+struct distinct_value {
+    uint32_t nb_hashes;
+    uint32_t nb_slots;  // a power of 2, or 0 when there is no set
+    uint64_t *set;
+    struct hll *sketch; // once there are too many hashes for the set
+};
+
+static size_t distinct_size(void)
+{
+    return sizeof(struct distinct_value);
+}
+
+static void distinct_ctor(void *v_)
+{
+    struct distinct_value *v = v_;
+    v->nb_hashes = v->nb_slots = 0;
+    v->set = NULL;
+    v->sketch = NULL;
+}
+
+// The slot of that hash in a set known to have a free slot, or the free slot where it belongs
+static uint64_t *distinct_set_slot(uint64_t *set, uint32_t nb_slots, uint64_t hash)
+{
+    uint32_t s = hash & (nb_slots - 1);
+    while (set[s] && set[s] != hash) s = (s + 1) & (nb_slots - 1);
+    return set + s;
+}
+
+static void distinct_dtor(void *v_)
+{
+    struct distinct_value *v = v_;
+    free(v->set);
+    free(v->sketch);
+    distinct_ctor(v);
+}
+
+static int distinct_to_sketch(struct distinct_value *v)
+{
+    struct hll *sketch = calloc(1, sizeof(*sketch));
+    if (! sketch) {
+        fprintf(stderr, "Cannot malloc a sketch of distinct values\n");
+        return -1;
+    }
+    STATS_ADD(alloc_bytes, sizeof(*sketch));
+    for (uint32_t s = 0; s < v->nb_slots; s++) {
+        if (v->set[s]) hll_add(sketch, v->set[s]);
+    }
+    free(v->set);
+    v->set = NULL;
+    v->nb_slots = 0;
+    v->sketch = sketch;
+    return 0;
+}
+
+static int distinct_add(struct distinct_value *v, uint64_t hash)
+{
+    if (v->sketch) {
+        hll_add(v->sketch, hash);
+        return 0;
+    }
+    if (! hash) hash = 1;   // 0 marks free slots
+    uint64_t *slot = v->set ? distinct_set_slot(v->set, v->nb_slots, hash) : NULL;
+    if (slot && *slot) return 0;
+    // Keep the set at most half full
+    if (2 * (v->nb_hashes + 1) > v->nb_slots) {
+        if (v->nb_hashes >= DISTINCT_MAX_EXACT) {
+            if (0 != distinct_to_sketch(v)) return -1;
+            hll_add(v->sketch, hash);
+            return 0;
+        }
+        uint32_t const nb_slots = v->nb_slots ? 2 * v->nb_slots : DISTINCT_MIN_SLOTS;
+        uint64_t *set = calloc(nb_slots, sizeof(*set));
+        if (! set) {
+            fprintf(stderr, "Cannot malloc a set of %"PRIu32" distinct values\n", nb_slots);
+            return -1;
+        }
+        STATS_ADD(alloc_bytes, nb_slots * sizeof(*set));
+        for (uint32_t s = 0; s < v->nb_slots; s++) {
+            if (v->set[s]) *distinct_set_slot(set, nb_slots, v->set[s]) = v->set[s];
+        }
+        free(v->set);
+        v->set = set;
+        v->nb_slots = nb_slots;
+        slot = distinct_set_slot(v->set, v->nb_slots, hash);
+    }
+    *slot = hash;
+    v->nb_hashes ++;
+    return 0;
+}
+
+static int distinct_fold(void *v_, char const *current)
+{
+    return distinct_add(v_, hash_fast(current, strlen(current), 0));
+}
+
+static int distinct_merge(void *v_, void const *other_)
+{
+    struct distinct_value *v = v_;
+    struct distinct_value const *other = other_;
+    if (other->sketch) {
+        if (! v->sketch && 0 != distinct_to_sketch(v)) return -1;
+        hll_merge(v->sketch, other->sketch);
+        return 0;
+    }
+    for (uint32_t s = 0; s < other->nb_slots; s++) {
+        if (other->set[s] && 0 != distinct_add(v, other->set[s])) return -1;
+    }
+    return 0;
+}
+
+static long long distinct_finalize_ll(void const *v_)
+{
+    struct distinct_value const *v = v_;
+    return v->sketch ? llround(hll_count(v->sketch)) : v->nb_hashes;
+}
+
+static char const *distinct_finalize(void *v_, char str[AGGR_STR_SIZE])
+{
+    snprintf(str, AGGR_STR_SIZE, "%lld", distinct_finalize_ll(v_));
+    return str;
+}
+
+static int distinct_cmp(void const *a_, void const *b_)
 {
-    struct str_value *v = v_;
-    if (! v->str || strcmp(v->str, current) < 0) str_value_set(v, current);
+    long long const a = distinct_finalize_ll(a_), b = distinct_finalize_ll(b_);
+    return a < b ? -1 : a > b;
 }
 
 /*
@@ -229,15 +612,18 @@ static void greatest_fold(void *v_, char const *current)
  */
 
 struct aggr_func aggr_funcs[] = {
-    { { rem_size, rem_ctor, rem_fold, rem_finalize }, "rem" },
-    { { avg_size, avg_ctor, avg_fold, avg_finalize }, "avg" },
-    { { ll_size, min_ctor, min_fold, ll_finalize }, "min" },
-    { { ll_size, max_ctor, max_fold, ll_finalize }, "max" },
-    { { ll_size, sum_ctor, sum_fold, ll_finalize }, "sum" },
-    { { str_size, str_ctor, first_fold, str_finalize }, "first" },
-    { { str_size, str_ctor, last_fold, str_finalize }, "last" },
-    { { str_size, str_ctor, smallest_fold, str_finalize }, "smallest" },
-    { { str_size, str_ctor, greatest_fold, str_finalize }, "greatest" },
+    { { rem_size, rem_ctor, rem_fold, NULL, rem_finalize, NULL, NULL, rem_merge, NULL, NULL, NULL }, "rem" },
+    { { avg_size, avg_ctor, avg_fold, avg_fold_ll, avg_finalize, avg_finalize_ll, avg_cmp, avg_merge, avg_fold_atomic, NULL, NULL }, "avg" },
+    { { ll_size, min_ctor, min_fold, min_fold_ll, ll_finalize, ll_finalize_ll, ll_cmp, min_merge, min_fold_atomic, NULL, NULL }, "min" },
+    { { ll_size, max_ctor, max_fold, max_fold_ll, ll_finalize, ll_finalize_ll, ll_cmp, max_merge, max_fold_atomic, NULL, NULL }, "max" },
+    { { ll_size, sum_ctor, sum_fold, sum_fold_ll, ll_finalize, ll_finalize_ll, ll_cmp, sum_merge, sum_fold_atomic, NULL, NULL }, "sum" },
+    { { str_size, str_ctor, first_fold, NULL, str_finalize, NULL, str_cmp, first_merge, NULL, NULL, NULL }, "first" },
+    { { last_size, last_ctor, last_fold, NULL, last_finalize, NULL, last_cmp, last_merge, NULL, NULL, last_dtor }, "last" },
+    { { str_size, str_ctor, smallest_fold, NULL, str_finalize, NULL, str_cmp, smallest_merge, NULL, NULL, NULL }, "smallest" },
+    { { str_size, str_ctor, greatest_fold, NULL, str_finalize, NULL, str_cmp, greatest_merge, NULL, NULL, NULL }, "greatest" },
+    { { ll_size, sum_ctor, count_fold, count_fold_ll, ll_finalize, ll_finalize_ll, ll_cmp, sum_merge, count_fold_atomic, aggr_count, NULL }, "count" },
+    { { ll_size, sum_ctor, count_nonempty_fold, NULL, ll_finalize, ll_finalize_ll, ll_cmp, sum_merge, NULL, NULL, NULL }, "count_nonempty" },
+    { { distinct_size, distinct_ctor, distinct_fold, NULL, distinct_finalize, distinct_finalize_ll, distinct_cmp, distinct_merge, NULL, NULL, distinct_dtor }, "count_distinct" },
 };
 
 unsigned nb_aggr_funcs = SIZEOF_ARRAY(aggr_funcs);
@@ -0,0 +1,116 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Arenas, and the large allocations behind them and behind the bucket
+ * arrays and parse buffers. With --huge-pages those are mapped from
+ * reserved 2MB pages (MAP_HUGETLB), or else from 2MB aligned mappings that
+ * the kernel is asked to back with transparent huge pages, sizes being
+ * rounded up to whole huge pages. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "groupby.h"
+
+#define HUGE_PAGE_SIZE (2UL<<20)
+
+bool huge_pages;
+static bool no_hugetlb;  // once a MAP_HUGETLB failed
+
+size_t big_size(size_t size)
+{
+    return huge_pages ? (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1) : size;
+}
+
+void *big_alloc(size_t size)
+{
+    if (! huge_pages) return malloc(size);
+    size = big_size(size);
+    if (! __atomic_load_n(&no_hugetlb, __ATOMIC_RELAXED)) {
+        void *ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            STATS_ADD(hugetlb_pages, size / HUGE_PAGE_SIZE);
+            return ptr;
+        }
+        if (debug) fprintf(stderr, "No reserved huge pages for %zu bytes, asking for transparent ones\n", size);
+        __atomic_store_n(&no_hugetlb, true, __ATOMIC_RELAXED);
+    }
+    // Map one more page to align on a huge page
+    char *map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+    char *ptr = (char *)(((uintptr_t)map + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (ptr > map) munmap(map, ptr - map);
+    munmap(ptr + size, map + HUGE_PAGE_SIZE - ptr);
+    if (0 != madvise(ptr, size, MADV_HUGEPAGE) && debug) perror("madvise");
+    return ptr;
+}
+
+void *big_realloc(void *ptr, size_t old_size, size_t size)
+{
+    if (! huge_pages) return realloc(ptr, size);
+    if (big_size(size) <= big_size(old_size)) return ptr;
+    void *new = big_alloc(size);
+    if (! new) return NULL;
+    memcpy(new, ptr, old_size < size ? old_size : size);
+    big_free(ptr, old_size);
+    return new;
+}
+
+void big_free(void *ptr, size_t size)
+{
+    if (! huge_pages) {
+        free(ptr);
+        return;
+    }
+    if (ptr) munmap(ptr, big_size(size));
+}
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[];
+};
+
+void arena_ctor(struct arena *arena, size_t chunk_size)
+{
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+}
+
+void arena_dtor(struct arena *arena)
+{
+    while (arena->chunks) {
+        struct arena_chunk *next = arena->chunks->next;
+        big_free(arena->chunks, sizeof(*arena->chunks) + arena->chunks->size);
+        arena->chunks = next;
+    }
+}
+
+void arena_foreach_chunk(struct arena const *arena, void (*cb)(void const *, size_t, void *), void *data)
+{
+    for (struct arena_chunk const *chunk = arena->chunks; chunk; chunk = chunk->next) {
+        cb(chunk, sizeof(*chunk) + chunk->used, data);
+    }
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    struct arena_chunk *chunk = arena->chunks;
+    if (! chunk || chunk->used + size > chunk->size) {
+        size_t const chunk_size = big_size(sizeof(*chunk) + (size > arena->chunk_size ? size : arena->chunk_size));
+        chunk = big_alloc(chunk_size);
+        if (! chunk) {
+            fprintf(stderr, "Cannot malloc %zu bytes for arena\n", chunk_size);
+            return NULL;
+        }
+        STATS_ADD(alloc_bytes, chunk_size);
+        chunk->size = chunk_size - sizeof(*chunk);
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
@@ -0,0 +1,384 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Benchmark driver: run the successive phases of groupby on the same input
+ * and report, for each, one JSON object per line.
+ * Each phase includes the previous ones (parse < hash < aggr < full), each
+ * is run in its own process so that the peak RSS is meaningful, and
+ * phase_seconds is the time added by that phase alone.
+ * With -H, times instead each hash function over the keys of the input and
+ * over random keys of a few fixed lengths. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "groupby.h"
+
+enum phase { PHASE_PARSE, PHASE_HASH, PHASE_AGGR, PHASE_FULL, NB_PHASES };
+static char const *const phase_names[NB_PHASES] = { "parse", "hash", "aggr", "full" };
+
+static struct groupby_options opts = { .engine = ENGINE_HASH, .order = { .by = ORDER_NONE } };
+
+struct result {
+    unsigned long rows;
+    double seconds;
+};
+
+static struct bench_state {
+    struct row_conf const *conf;
+    int input;
+    unsigned field_no;
+    unsigned long rows;
+    bool hash;
+    struct hasher hasher;
+    uint64_t hash_acc;  // so that the compiler cannot skip hashing
+    struct key_str key;
+    char const **values;
+    unsigned values_size;
+    // Keys saved for the hash benchmark (-H)
+    bool collect;
+    struct arena keys_arena;
+    struct key_str *keys;
+    size_t nb_keys, max_keys;
+} bench_state;
+
+#define BENCH_MAX_KEYS (1U << 20)
+
+static ssize_t reader(void *dst, size_t dst_size, void *state_)
+{
+    struct bench_state *state = state_;
+    ssize_t const r = read(state->input, dst, dst_size);
+    if (r < 0) perror("read");
+    return r;
+}
+
+static void field_cb(void *field, size_t field_len, void *state_)
+{
+    (void)field_len;
+    struct bench_state *state = state_;
+    if (state->field_no >= state->values_size) {
+        unsigned const size = state->values_size ? 2 * state->values_size : 64;
+        char const **values = realloc(state->values, size * sizeof(*values));
+        if (! values) return;   // ignore the remaining fields
+        state->values = values;
+        state->values_size = size;
+    }
+    state->values[state->field_no++] = field;
+}
+
+static void record_cb(void *state_)
+{
+    struct bench_state *state = state_;
+    if (state->hash) {
+        state->key.len = 0;
+        for (unsigned f = 0; f < state->field_no && f < state->values_size; f++) {
+            if (! row_conf_grouped(state->conf, f)) continue;
+            if (0 != key_str_append(&state->key, state->values[f])) break;
+        }
+        state->hash_acc += hasher_hash(&state->hasher, state->key.str, state->key.len);
+    }
+    if (state->collect && state->nb_keys < state->max_keys) {
+        struct key_str *key = state->keys + state->nb_keys;
+        key->str = arena_alloc(&state->keys_arena, state->key.len);
+        if (key->str) {
+            memcpy(key->str, state->key.str, state->key.len);
+            key->len = state->key.len;
+            state->nb_keys ++;
+        }
+    }
+    state->field_no = 0;
+    state->rows ++;
+}
+
+static int run_parse(struct row_conf const *conf, char delimiter, int input, bool hash, unsigned long *rows)
+{
+    bench_state.conf = conf;
+    bench_state.input = input;
+    bench_state.hash = hash;
+    hasher_ctor(&bench_state.hasher, opts.hash);
+
+    struct csv csv;
+    if (0 != csv_ctor(&csv, delimiter, reader, &bench_state)) return -1;
+    int const err = csv_parse(&csv, field_cb, record_cb);
+    csv_dtor(&csv);
+    if (debug) fprintf(stderr, "hash accumulator: %"PRIu64"\n", bench_state.hash_acc);
+    *rows = bench_state.rows;
+    return err;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Run in the child process
+static int run_phase(enum phase phase, struct row_conf const *conf, char delimiter, char const *file, struct result *res)
+{
+    int const input = open(file, O_RDONLY);
+    if (input < 0) {
+        perror("open");
+        return -1;
+    }
+
+    int err = 0;
+    double const start = now();
+    switch (phase) {
+        case PHASE_PARSE:
+        case PHASE_HASH:
+            err = run_parse(conf, delimiter, input, phase == PHASE_HASH, &res->rows);
+            break;
+        case PHASE_AGGR:
+            err = do_groupby(conf, &opts, input, -1);
+            break;
+        case PHASE_FULL:;
+            int const output = open("/dev/null", O_WRONLY);
+            if (output < 0) {
+                perror("open");
+                err = -1;
+                break;
+            }
+            err = do_groupby(conf, &opts, input, output);
+            break;
+        case NB_PHASES:
+            break;
+    }
+    res->seconds = now() - start;
+    return err;
+}
+
+static int fork_phase(enum phase phase, struct row_conf const *conf, char delimiter, char const *file, struct result *res, struct rusage *usage)
+{
+    int fds[2];
+    if (0 != pipe(fds)) {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t const pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        struct result r = { .rows = 0, .seconds = 0. };
+        if (0 != run_phase(phase, conf, delimiter, file, &r)) _exit(EXIT_FAILURE);
+        if (sizeof(r) != write(fds[1], &r, sizeof(r))) _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    ssize_t const r = read(fds[0], res, sizeof(*res));
+    close(fds[0]);
+    int status;
+    if (pid != wait4(pid, &status, 0, usage)) {
+        perror("wait4");
+        return -1;
+    }
+    if (r != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Phase %s failed\n", phase_names[phase]);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hash benchmark
+ */
+
+static void bench_hashes(char const *label, char const *keys_name, struct key_str const *keys, size_t nb_keys)
+{
+    if (! nb_keys) return;
+    size_t bytes = 0;
+    for (size_t k = 0; k < nb_keys; k++) bytes += keys[k].len;
+
+    for (enum groupby_hash h = HASH_FAST; h <= HASH_LOOKUP3; h++) {
+        struct hasher hasher;
+        hasher_ctor(&hasher, h);
+        // Repeat until it takes long enough to be measured
+        uint64_t acc = 0;
+        unsigned rounds = 0;
+        double const start = now();
+        double seconds;
+        do {
+            for (size_t k = 0; k < nb_keys; k++) acc += hasher_hash(&hasher, keys[k].str, keys[k].len);
+            rounds ++;
+            seconds = now() - start;
+        } while (seconds < 0.2);
+        if (debug) fprintf(stderr, "hash accumulator: %"PRIu64"\n", acc);
+
+        printf("{\"label\":\"%s\",\"keys\":\"%s\",\"hash\":\"%s\",\"nb_keys\":%zu,\"avg_key_len\":%.1f,"
+               "\"ns_per_key\":%.2f,\"gb_per_s\":%.3f}\n",
+               label, keys_name, hasher.name, nb_keys, (double)bytes / nb_keys,
+               seconds * 1e9 / ((double)rounds * nb_keys), (double)rounds * bytes / seconds / 1e9);
+        fflush(stdout);
+    }
+}
+
+static int run_hash_bench(struct row_conf const *conf, char delimiter, char const *file, char const *label)
+{
+    int const input = open(file, O_RDONLY);
+    if (input < 0) {
+        perror("open");
+        return -1;
+    }
+
+    // Keys of the input, as the groupby would hash them
+    bench_state.collect = true;
+    bench_state.max_keys = BENCH_MAX_KEYS;
+    bench_state.keys = malloc(bench_state.max_keys * sizeof(*bench_state.keys));
+    if (! bench_state.keys) {
+        fprintf(stderr, "Cannot malloc %zu keys\n", bench_state.max_keys);
+        return -1;
+    }
+    arena_ctor(&bench_state.keys_arena, 1U<<20);
+    unsigned long rows;
+    int const err = run_parse(conf, delimiter, input, true, &rows);
+    close(input);
+    if (err) return -1;
+    bench_hashes(label, "input", bench_state.keys, bench_state.nb_keys);
+
+    // Random keys of fixed lengths
+    static unsigned const lengths[] = { 4, 8, 16, 32, 64, 256 };
+    size_t const nb_keys = 1U << 16;
+    uint64_t rnd = 0x9e3779b97f4a7c15ULL;
+    for (unsigned l = 0; l < SIZEOF_ARRAY(lengths); l++) {
+        struct arena arena;
+        arena_ctor(&arena, 1U<<20);
+        for (size_t k = 0; k < nb_keys; k++) {
+            struct key_str *key = bench_state.keys + k;
+            key->len = lengths[l];
+            key->str = arena_alloc(&arena, key->len);
+            if (! key->str) return -1;
+            for (unsigned i = 0; i < key->len; i++) {
+                rnd ^= rnd << 13; rnd ^= rnd >> 7; rnd ^= rnd << 17;
+                key->str[i] = 'a' + rnd % 26;
+            }
+        }
+        char name[16];
+        snprintf(name, sizeof(name), "len=%u", lengths[l]);
+        bench_hashes(label, name, bench_state.keys, nb_keys);
+        arena_dtor(&arena);
+    }
+
+    arena_dtor(&bench_state.keys_arena);
+    free(bench_state.keys);
+    return 0;
+}
+
+static void syntax(void)
+{
+    printf("groupby-bench -i input [-a field_spec:function ... | -g field_spec] [-d char] [-m max-fields] [-e hash|sort] [-x fast|seeded|crc32c|lookup3] [-r repeat] [-l label] [-H]\n"
+           "\n"
+           "Outputs one JSON object per phase (parse, hash, aggr, full) on stdout.\n"
+           "The best of the repeated runs is retained for each phase.\n"
+           "With -H, outputs instead one JSON object per hash function and set of keys.\n");
+}
+
+int main(int nb_args, char **args)
+{
+    struct row_conf *row_conf = row_conf_new(0);
+    char delimiter = ',';
+    char const *file = NULL;
+    char const *label = "";
+    unsigned repeat = 1;
+    bool hash_bench = false;
+
+    for (int a = 1; a < nb_args; a++) {
+        if (strcmp(args[a], "-H") == 0) {
+            hash_bench = true;
+        } else if (strcmp(args[a], "-h") == 0 || strcasecmp(args[a], "--help") == 0) {
+            syntax();
+            return EXIT_SUCCESS;
+        } else if (strcasecmp(args[a], "-v") == 0) {
+            debug = true;
+
+        } else if (a == nb_args-1) {
+            fprintf(stderr, "Missing value for '%s'\n", args[a]);
+            return EXIT_FAILURE;
+        } else if (strcasecmp(args[a], "-a") == 0) {
+            if (0 != row_conf_aggr(row_conf, args[++a])) return EXIT_FAILURE;
+        } else if (strcasecmp(args[a], "-g") == 0) {
+            if (0 != row_conf_group(row_conf, args[++a])) return EXIT_FAILURE;
+        } else if (strcasecmp(args[a], "-m") == 0) {
+            nb_max_fields = strtoul(args[++a], NULL, 0);
+        } else if (strcasecmp(args[a], "-d") == 0) {
+            delimiter = args[++a][0];
+        } else if (strcasecmp(args[a], "-i") == 0) {
+            file = args[++a];
+        } else if (strcasecmp(args[a], "-r") == 0) {
+            repeat = strtoul(args[++a], NULL, 0);
+        } else if (strcasecmp(args[a], "-e") == 0) {
+            a ++;
+            if (strcasecmp(args[a], "hash") == 0) {
+                opts.engine = ENGINE_HASH;
+            } else if (strcasecmp(args[a], "sort") == 0) {
+                opts.engine = ENGINE_SORT;
+            } else {
+                fprintf(stderr, "Unknown engine '%s'\n", args[a]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcasecmp(args[a], "-x") == 0) {
+            if (0 != hash_of_str(&opts.hash, args[++a])) return EXIT_FAILURE;
+        } else if (strcasecmp(args[a], "-l") == 0) {
+            label = args[++a];
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", args[a]);
+            syntax();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (! file) {
+        syntax();
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (0 != stat(file, &st)) {
+        perror("stat");
+        return EXIT_FAILURE;
+    }
+
+    if (0 != row_conf_finalize(nb_max_fields, row_conf)) return EXIT_FAILURE;
+    opts.delimiter = delimiter;
+
+    if (hash_bench) {
+        return 0 == run_hash_bench(row_conf, delimiter, file, label) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    unsigned long rows = 0;
+    double prev_seconds = 0.;
+    for (enum phase phase = 0; phase < NB_PHASES; phase++) {
+        struct result best = { .rows = 0, .seconds = 0. };
+        long max_rss = 0;
+        for (unsigned r = 0; r < (repeat ? repeat : 1); r++) {
+            struct result res;
+            struct rusage usage;
+            if (0 != fork_phase(phase, row_conf, delimiter, file, &res, &usage)) return EXIT_FAILURE;
+            if (r == 0 || res.seconds < best.seconds) best = res;
+            if (usage.ru_maxrss > max_rss) max_rss = usage.ru_maxrss;
+        }
+        if (phase == PHASE_PARSE) rows = best.rows; // other phases do not count them
+
+        printf("{\"label\":\"%s\",\"phase\":\"%s\",\"rows\":%lu,\"bytes\":%lld,"
+               "\"seconds\":%.6f,\"phase_seconds\":%.6f,"
+               "\"rows_per_s\":%.0f,\"gb_per_s\":%.4f,\"max_rss_kb\":%ld}\n",
+               label, phase_names[phase], rows, (long long)st.st_size,
+               best.seconds, best.seconds - prev_seconds,
+               rows / best.seconds, st.st_size / best.seconds / 1e9, max_rss);
+        fflush(stdout);
+        prev_seconds = best.seconds;
+    }
+
+    return EXIT_SUCCESS;
+}
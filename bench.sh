@@ -0,0 +1,37 @@
+#!/bin/sh
+# Usage: sh bench.sh [extra groupby-bench options]
+# Generates synthetic inputs (cached in $BENCH_DIR) and runs groupby-bench on
+# each of them, one JSON object per line and per phase on stdout.
+# Tune with BENCH_ROWS, BENCH_COLS, BENCH_KEYS (list of cardinalities),
+# BENCH_SKEW, BENCH_KEY_WIDTH, BENCH_VALUE_WIDTH, BENCH_QUOTE, BENCH_REPEAT
+# BENCH_AGGR (the -a option given to groupby) and BENCH_ENGINES.
+
+set -e
+
+bindir=${BENCH_BINDIR:-.}
+dir=${BENCH_DIR:-bench-data}
+rows=${BENCH_ROWS:-1000000}
+cols=${BENCH_COLS:-4}
+keys=${BENCH_KEYS:-"10 1000 100000 1000000"}
+skew=${BENCH_SKEW:-0}
+key_width=${BENCH_KEY_WIDTH:-10}
+value_width=${BENCH_VALUE_WIDTH:-6}
+quote=${BENCH_QUOTE:-0}
+repeat=${BENCH_REPEAT:-3}
+aggr=${BENCH_AGGR:-"2-:sum"}
+engines=${BENCH_ENGINES:-"hash sort"}
+
+mkdir -p "$dir"
+for k in $keys; do
+    params="n=$rows c=$cols k=$k s=$skew w=$key_width W=$value_width q=$quote"
+    file="$dir/$(echo "$params" | tr ' =' '_-').csv"
+    if ! test -f "$file"; then
+        "$bindir/gencsv" -n "$rows" -c "$cols" -k "$k" -s "$skew" \
+            -w "$key_width" -W "$value_width" -q "$quote" > "$file.tmp"
+        mv "$file.tmp" "$file"
+    fi
+    cat "$file" > /dev/null  # warm the page cache
+    for e in $engines; do
+        "$bindir/groupby-bench" -i "$file" -a "$aggr" -r "$repeat" -e "$e" -l "$params e=$e" "$@"
+    done
+done
@@ -0,0 +1,369 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include "groupby.h"
+
+#define OPEN_RANGE UINT_MAX // last field of "n-"
+#define TAIL_FIELD UINT_MAX // field of the aggregates of all fields past nb_fields
+
+bool debug = false;
+unsigned nb_max_fields = NB_MAX_FIELDS;
+
+static int aggr_of_str(char const *str, size_t len, struct aggr_func const **aggr)
+{
+    for (unsigned f = 0; f < nb_aggr_funcs; f++) {
+        if (strlen(aggr_funcs[f].name) == len && strncasecmp(str, aggr_funcs[f].name, len) == 0) {
+            *aggr = aggr_funcs+f;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown function '%.*s'\n", (int)len, str);
+    return -1;
+}
+
+static int add_aggr(struct row_conf *row_conf, unsigned f, struct aggr_func const *aggr, unsigned option)
+{
+    if (row_conf->nb_aggrs >= row_conf->max_aggrs) {
+        unsigned const max = row_conf->max_aggrs ? 2 * row_conf->max_aggrs : 16;
+        struct row_aggr *aggrs = realloc(row_conf->aggrs, max * sizeof(*aggrs));
+        if (! aggrs) {
+            fprintf(stderr, "Cannot realloc %u aggregates\n", max);
+            return -1;
+        }
+        row_conf->aggrs = aggrs;
+        size_t *cumul_size = realloc(row_conf->aggr_cumul_size, max * sizeof(*cumul_size));
+        if (! cumul_size) {
+            fprintf(stderr, "Cannot realloc %u aggregates\n", max);
+            return -1;
+        }
+        row_conf->aggr_cumul_size = cumul_size;
+        row_conf->max_aggrs = max;
+    }
+    row_conf->aggrs[row_conf->nb_aggrs++] = (struct row_aggr){
+        .func = aggr, .field = f, .option = option,
+    };
+    return 0;
+}
+
+int row_conf_grow(struct row_conf *conf, unsigned nb_fields)
+{
+    if (nb_fields <= conf->nb_fields) return 0;
+    if (nb_fields > conf->fields_size) {
+        unsigned size = conf->fields_size ? conf->fields_size : 16;
+        while (size < nb_fields) size = size > UINT_MAX/2 ? nb_fields : 2 * size;
+        struct field_conf *fields = realloc(conf->fields, size * sizeof(*fields));
+        if (! fields) {
+            fprintf(stderr, "Cannot realloc %u fields\n", size);
+            return -1;
+        }
+        conf->fields = fields;
+        conf->fields_size = size;
+    }
+
+    // New fields get what was set for all fields past the configured ones
+    unsigned const first = conf->nb_fields;
+    for (unsigned f = first; f < nb_fields; f++) {
+        conf->fields[f] = (struct field_conf){ .option = conf->tail_option, .first_aggr = 0, .nb_aggrs = 0, .first_pred = 0, .nb_preds = 0 };
+    }
+    conf->nb_fields = nb_fields;
+    unsigned const nb_aggrs = conf->nb_aggrs;
+    for (unsigned a = 0; a < nb_aggrs; a++) {
+        struct row_aggr const aggr = conf->aggrs[a];
+        if (aggr.field != TAIL_FIELD || aggr.option != conf->tail_option) continue;
+        for (unsigned f = first; f < nb_fields; f++) {
+            if (0 != add_aggr(conf, f, aggr.func, aggr.option)) return -1;
+        }
+    }
+    return 0;
+}
+
+// A later option replaces what previous ones set for a field, while an
+// option can give several functions to the same field.
+// Fields past the last one named are configured all at once, as the tail.
+static int set_range(struct row_conf *row_conf, unsigned first, unsigned last, struct aggr_func const *aggr, bool inv)
+{
+    if (last < first) {
+        unsigned tmp = first;
+        first = last; last = tmp;
+    }
+
+    bool const open = last == OPEN_RANGE;
+    if (0 != row_conf_grow(row_conf, open ? first : last+1)) return -1;
+
+    for (unsigned f = 0; f < row_conf->nb_fields; f++) {
+        bool const in_between = f >= first && f <= last;
+        if ((!inv && in_between) || (inv && !in_between)) {
+            row_conf->fields[f].option = row_conf->nb_options;
+            if (aggr) {
+                if (debug) fprintf(stderr, "field %u uses aggr function %s\n", f, aggr->name);
+                if (0 != add_aggr(row_conf, f, aggr, row_conf->nb_options)) return -1;
+            } else {
+                if (debug) fprintf(stderr, "field %u is groupped\n", f);
+            }
+        }
+    }
+
+    if (open != inv) {
+        row_conf->tail_option = row_conf->nb_options;
+        if (aggr) {
+            if (debug) fprintf(stderr, "fields from %u use aggr function %s\n", row_conf->nb_fields, aggr->name);
+            if (0 != add_aggr(row_conf, TAIL_FIELD, aggr, row_conf->nb_options)) return -1;
+        } else {
+            if (debug) fprintf(stderr, "fields from %u are groupped\n", row_conf->nb_fields);
+        }
+    }
+    return 0;
+}
+
+static int set_fieldspec_conf(struct row_conf *row_conf, char const *start, char const *stop, struct aggr_func const *aggr, bool inv)
+{
+    char const *const spec = start;
+    int const spec_len = stop - start;
+    if (start >= stop) return 0;
+    if (*start == '!') return set_fieldspec_conf(row_conf, start+1, stop, aggr, inv);
+
+    unsigned first = 0, last = 0;   // invalid field numbers
+    char *eoi;
+    // read first
+    first = strtoul(start, &eoi, 0);
+    if (eoi == start) {
+        first = 1;
+    } else {
+        start = eoi;
+    }
+
+    if (*start == '-') {
+        start ++;
+        last = strtoul(start, &eoi, 0);
+        if (eoi == start) {
+            last = OPEN_RANGE;
+        } else {
+            start = eoi;
+        }
+    } else {
+        last = first;
+    }
+
+    if (start < stop && *start != ',') {
+        fprintf(stderr, "Bad field spec: '%.*s'\n", spec_len, spec);
+        return -1;
+    }
+
+    if (first == 0 || last == 0) {
+        fprintf(stderr, "Fields are numbered from 1\n");
+        return -1;
+    }
+
+    if (0 != set_range(row_conf, first-1, last == OPEN_RANGE ? OPEN_RANGE : last-1, aggr, inv)) return -1;
+
+    if (start >= stop) return 0;
+
+    return set_fieldspec_conf(row_conf, start+1, stop, aggr, inv);
+}
+
+/* The option is a list of field_spec[:func], such as "1,3:sum,5:min,5:max":
+ * each function applies to all the fields listed since the previous one. */
+int row_conf_aggr(struct row_conf *row_conf, char const *opt)
+{
+    row_conf->nb_options ++;
+    char const *spec = opt;
+    for (char const *item = opt; *item; ) {
+        char const *const end = strchrnul(item, ',');
+        char const *const colon = memchr(item, ':', end - item);
+        if (colon) {
+            // First look for the function to set
+            struct aggr_func const *aggr;
+            if (0 != aggr_of_str(colon+1, end - (colon+1), &aggr)) return -1;
+            // Now set this aggr function for each specified field
+            if (0 != set_fieldspec_conf(row_conf, spec, colon, aggr, false)) return -1;
+            spec = *end ? end+1 : end;
+        }
+        item = *end ? end+1 : end;
+    }
+
+    // Fields without a function are removed
+    if (*spec) {
+        struct aggr_func const *aggr;
+        aggr_of_str("rem", 3, &aggr);
+        return set_fieldspec_conf(row_conf, spec, rawmemchr(spec, '\0'), aggr, false);
+    }
+    return 0;
+}
+
+int row_conf_group(struct row_conf *row_conf, char const *opt)
+{
+    row_conf->nb_options ++;
+    return set_fieldspec_conf(row_conf, opt, opt + strlen(opt), NULL, false);
+}
+
+struct row_conf *row_conf_new(unsigned nb_fields_hint)
+{
+    struct row_conf *conf = malloc(sizeof(*conf));
+    struct field_conf *fields = nb_fields_hint ? malloc(nb_fields_hint * sizeof(*fields)) : NULL;
+    if (! conf || (nb_fields_hint && ! fields)) {
+        fprintf(stderr, "Cannot malloc row conf for %u fields\n", nb_fields_hint);
+        free(conf);
+        free(fields);
+        return NULL;
+    }
+
+    conf->nb_fields = 0;
+    conf->max_fields = UINT_MAX;
+    conf->fields_size = nb_fields_hint;
+    conf->fields = fields;
+    conf->tail_option = 0;
+    conf->nb_aggr_fields = 0;
+    conf->nb_options = 0;
+    conf->nb_aggrs = conf->max_aggrs = 0;
+    conf->aggrs = NULL;
+    conf->aggr_cumul_size = NULL;
+    conf->aggr_tot_size = 0;
+    conf->aggr_dtors = false;
+    conf->nb_preds = conf->max_preds = 0;
+    conf->preds = NULL;
+    conf->nb_pred_fields = 0;
+    conf->nb_grouped_fields = 0;
+    conf->kernel.name = NULL;
+
+    return conf;
+}
+
+static size_t aggr_align(size_t offset, size_t size)
+{
+    size_t const align = size % 8 == 0 ? 8 : size % 4 == 0 ? 4 : 1;
+    return (offset + align - 1) & ~(align - 1);
+}
+
+int row_conf_finalize(unsigned nb_max_fields, struct row_conf *conf)
+{
+    // Fields past the configured ones are grouped, however many there are,
+    // unless a function was given for them: then there are that many at most
+    conf->max_fields = UINT_MAX;
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        if (conf->aggrs[a].field == TAIL_FIELD && conf->aggrs[a].option == conf->tail_option) {
+            if (0 != row_conf_grow(conf, nb_max_fields)) return -1;
+            conf->max_fields = conf->nb_fields;
+            break;
+        }
+    }
+
+    // Forget the aggregates that were overridden by a later option, and
+    // order the others by field (keeping the order of the options)
+    unsigned nb_aggrs = 0;
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        struct row_aggr const aggr = conf->aggrs[a];
+        if (aggr.field >= conf->nb_fields || aggr.option != conf->fields[aggr.field].option) continue;
+        unsigned i = nb_aggrs++;
+        for (; i > 0 && conf->aggrs[i-1].field > aggr.field; i--) conf->aggrs[i] = conf->aggrs[i-1];
+        conf->aggrs[i] = aggr;
+    }
+    conf->nb_aggrs = nb_aggrs;
+
+    // Lay out all values of a group one after the other
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        struct field_conf *field = conf->fields + conf->aggrs[a].field;
+        if (field->nb_aggrs ++ == 0) {
+            field->first_aggr = a;
+            conf->nb_aggr_fields ++;
+        }
+        size_t const size = conf->aggrs[a].func->ops.size();
+        conf->aggr_cumul_size[a] = aggr_align(conf->aggr_tot_size, size);
+        conf->aggr_tot_size = conf->aggr_cumul_size[a] + size;
+        if (conf->aggrs[a].func->ops.dtor) conf->aggr_dtors = true;
+    }
+
+    // Same for predicates
+    unsigned nb_preds = 0;
+    for (unsigned p = 0; p < conf->nb_preds; p++) {
+        struct row_pred const pred = conf->preds[p];
+        if (pred.field >= conf->nb_fields) {
+            free(pred.values);
+            continue;
+        }
+        unsigned i = nb_preds++;
+        for (; i > 0 && conf->preds[i-1].field > pred.field; i--) conf->preds[i] = conf->preds[i-1];
+        conf->preds[i] = pred;
+    }
+    conf->nb_preds = nb_preds;
+    for (unsigned p = 0; p < conf->nb_preds; p++) {
+        struct field_conf *field = conf->fields + conf->preds[p].field;
+        if (field->nb_preds ++ == 0) field->first_pred = p;
+        conf->nb_pred_fields = conf->preds[p].field + 1;
+    }
+
+    // Fields that binary inputs can give as integers
+    for (unsigned f = 0; f < conf->nb_fields; f++) {
+        struct field_conf *field = conf->fields + f;
+        if (! field->nb_aggrs) conf->nb_grouped_fields ++;
+        field->integers = field->nb_aggrs > 0 && ! field->nb_preds;
+        for (unsigned a = field->first_aggr; a < field->first_aggr + field->nb_aggrs; a++) {
+            if (! conf->aggrs[a].func->ops.fold_ll) field->integers = false;
+        }
+    }
+
+    fold_kernel_select(&conf->kernel, conf);
+    return 0;
+}
+
+int output_order_parse(struct output_order *order, char const *opt, struct row_conf const *conf)
+{
+    char const *colon = strchr(opt, ':');
+    size_t const len = colon ? (size_t)(colon - opt) : strlen(opt);
+    order->desc = false;
+    if (colon) {
+        if (strcasecmp(colon+1, "desc") == 0) {
+            order->desc = true;
+        } else if (strcasecmp(colon+1, "asc") != 0) {
+            fprintf(stderr, "Bad sort direction '%s'\n", colon+1);
+            return -1;
+        }
+    }
+
+    if (len == 3 && strncasecmp(opt, "key", 3) == 0) {
+        order->by = ORDER_KEY;
+        return 0;
+    }
+
+    char *eoi;
+    unsigned long const column = strtoul(opt, &eoi, 10);
+    if (eoi != opt + len || column == 0) {
+        fprintf(stderr, "Bad sort spec '%s' (key or column number expected)\n", opt);
+        return -1;
+    }
+
+    // Look for the aggregate output in this column
+    unsigned long c = 0;
+    for (unsigned f = 0; f < conf->nb_fields && c < column; f++) {
+        struct field_conf const *field = conf->fields + f;
+        if (! field->nb_aggrs) {
+            c ++;
+            continue;
+        }
+        if (column - c > field->nb_aggrs) {
+            c += field->nb_aggrs;
+            continue;
+        }
+        unsigned const a = field->first_aggr + (column - c - 1);
+        if (! conf->aggrs[a].func->ops.cmp) break;
+        order->by = ORDER_FIELD;
+        order->aggr = a;
+        return 0;
+    }
+    fprintf(stderr, "Cannot sort by column %lu: not a sortable aggregate (sort by key instead?)\n", column);
+    return -1;
+}
+
+void row_conf_del(struct row_conf *conf)
+{
+    free(conf->fields);
+    free(conf->aggrs);
+    free(conf->aggr_cumul_size);
+    for (unsigned p = 0; p < conf->nb_preds; p++) free(conf->preds[p].values);
+    free(conf->preds);
+    free(conf);
+}
@@ -6,23 +6,28 @@
 #include <string.h>
 #include "groupby.h"
 
-int csv_ctor(struct csv *csv, size_t max_row_size, char delimiter, ssize_t (*reader)(void *, size_t, void *), void *user_data)
+int csv_ctor(struct csv *csv, char delimiter, ssize_t (*reader)(void *, size_t, void *), void *user_data)
 {
     csv->delimiter = delimiter;
-    csv->max_row_size = max_row_size;
-    csv->buf_size = 3*max_row_size;
-    if (debug) fprintf(stderr, "new csv with max_row_len = %zu and buf_size = %zu\n", max_row_size, csv->buf_size);
-    csv->buffer = malloc(csv->buf_size+1);
+    csv->buf_size = big_size(CSV_BLOCK_SIZE+1) - 1;
+    csv->buffer = big_alloc(csv->buf_size+1);
     csv->datalen = 0;
     csv->upto = 0;
     csv->cursor = 0;
     csv->eof = false;
+    csv->lineno = 1;
+    csv->scanned = 0;
+    csv->complete = 0;
+    csv->scan_state = SCAN_FIELD_START;
+    csv->skip_record = false;
+    csv->quiet = false;
     csv->user_data = user_data;
     csv->reader = reader;
     if (! csv->buffer) {
         fprintf(stderr, "Cannot malloc for row buffer\n");
         return -1;
     }
+    STATS_ADD(alloc_bytes, csv->buf_size+1);
     csv->buffer[csv->buf_size] = '\0';  // so that we can use strchr and friends
 
     return 0;
@@ -30,43 +35,54 @@ int csv_ctor(struct csv *csv, size_t max_row_size, char delimiter, ssize_t (*rea
 
 void csv_dtor(struct csv *csv)
 {
-    free(csv->buffer);
+    big_free(csv->buffer, csv->buf_size+1);
 }
 
-static void csv_discard(struct csv *csv)
+void csv_reset(struct csv *csv)
 {
-    if (csv->upto < csv->datalen) {
-        if (debug) fprintf(stderr, "discarding from %u to %u\n", csv->upto, csv->datalen);
-        memmove(csv->buffer, csv->buffer + csv->upto, csv->datalen - csv->upto);
-        csv->datalen -= csv->upto;
-        csv->cursor -= csv->upto;
-    } else {
-        csv->datalen = 0;
-        csv->cursor = 0;
-    }
-    csv->upto = 0;
+    csv->datalen = csv->upto = csv->cursor = 0;
+    csv->scanned = csv->complete = 0;
+    csv->scan_state = SCAN_FIELD_START;
+    csv->skip_record = false;
+    csv->eof = false;
 }
 
-static void csv_feed(struct csv *csv)
+/* Once the buffer is full, keep only the record that straddles its end (what
+ * follows the last parsed record) by moving it at the start. A record longer
+ * than the buffer doubles its size. */
+static int csv_make_room(struct csv *csv)
 {
-    if (csv->eof) return;
-
-    csv_discard(csv);
+    if (csv->datalen < csv->buf_size) return 0;
 
-    unsigned const rem_size = csv->buf_size - csv->datalen;
-    if (rem_size <= 0) return;
-    if (debug) fprintf(stderr, "feeding csv while cursor=%u, datalen=%u, upto=%u\n", csv->cursor, csv->datalen, csv->upto);
-    ssize_t r = csv->reader(csv->buffer + csv->datalen, rem_size, csv->user_data);
-    if (r < 0) return;
-    if (r == 0) {
-        if (debug) fprintf(stderr, "hit end of file\n");
-        csv->eof = true;
-    } else if (r > 0) {
-        if (debug) fprintf(stderr, "read %zd new bytes\n", r);
-        csv->datalen += r;
+    if (csv->upto > 0) {
+        size_t const tail = csv->datalen - csv->upto;
+        if (debug) fprintf(stderr, "discarding %zu bytes, keeping %zu\n", csv->upto, tail);
+        if (tail > 0) {
+            memmove(csv->buffer, csv->buffer + csv->upto, tail);
+            STATS_ADD(memmoves, 1);
+            STATS_ADD(memmove_bytes, tail);
+        }
+        csv->datalen = tail;
+        csv->cursor -= csv->upto;
+        csv->scanned -= csv->upto;
+        csv->complete -= csv->upto;
+        csv->upto = 0;
     }
 
-    if (debug) fprintf(stderr, "now cursor=%u, datalen=%u, upto=%u\n", csv->cursor, csv->datalen, csv->upto);
+    if (csv->datalen >= csv->buf_size) {
+        size_t const size = 2 * csv->buf_size;
+        char *buffer = big_realloc(csv->buffer, csv->buf_size+1, size+1);
+        if (! buffer) {
+            fprintf(stderr, "Cannot realloc row buffer to %zu bytes for record %u\n", size, csv->lineno);
+            return -1;
+        }
+        if (debug) fprintf(stderr, "record %u does not fit in %zu bytes, growing the buffer\n", csv->lineno, csv->buf_size);
+        STATS_ADD(alloc_bytes, size - csv->buf_size);
+        csv->buffer = buffer;
+        csv->buf_size = size;
+        csv->buffer[csv->buf_size] = '\0';
+    }
+    return 0;
 }
 
 static int csv_find(struct csv *csv, char const *chars)
@@ -81,71 +97,239 @@ static int csv_find(struct csv *csv, char const *chars)
     return -1;
 }
 
-int csv_parse(struct csv *csv, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *))
+// The state after char c. A newline that leaves it at SCAN_FIELD_START ends a record.
+static inline enum scan_state scan_step(enum scan_state state, char c, char delimiter)
+{
+    switch (state) {
+        case SCAN_QUOTED:
+            return c == '"' ? SCAN_QUOTE_IN_QUOTED : SCAN_QUOTED;
+        case SCAN_QUOTE_IN_QUOTED:
+            if (c == '"') return SCAN_QUOTED;
+            break;
+        case SCAN_FIELD_START:
+            if (c == '"') return SCAN_QUOTED;
+            break;
+        case SCAN_UNQUOTED:
+            break;
+    }
+    return c == '\n' || c == delimiter ? SCAN_FIELD_START : SCAN_UNQUOTED;
+}
+
+// Move the cursor, at the start of a field, after the end of the current
+// record without tokenizing. csv_scan found that record complete.
+static int csv_skip_record(struct csv *csv)
+{
+    size_t const end = csv_record_end(SCAN_FIELD_START, csv->buffer + csv->cursor, csv->complete - csv->cursor, csv->delimiter);
+    if (! end) {
+        if (! csv->quiet) fprintf(stderr, "Line too long (%u)\n", csv->lineno);
+        return -1;
+    }
+    csv->cursor += end;
+    return 0;
+}
+
+// Tokenize the field at cursor and give it to field_cb. Return the char ending it ('\n' or the delimiter) or -1 on error.
+static int csv_next_field(struct csv *csv, void (*field_cb)(void *, size_t, void *))
 {
     char any_delimiter[3] = { csv->delimiter, '\n', 0 };
-    unsigned lineno = 1;
-    unsigned fieldno = 0;
-
-    csv_feed(csv);
-    while (! csv->eof || csv->upto < csv->datalen) {
-        bool quoted = false;
-            
-        // Look for field start and end
-        if (csv->cursor >= csv->datalen) csv_feed(csv);
-
-        if (csv->buffer[csv->cursor] == '"') {
-            quoted = true;
-            csv->cursor ++;
-        }
+    bool quoted = false;
 
-        unsigned start = csv->cursor;
-        if (quoted) {
-            while (1) {
-                if (0 != csv_find(csv, "\"")) {
-                    fprintf(stderr, "No terminating quote\n");
-                    return -1;
-                }
-                if (csv->buffer[csv->cursor+1] == '"') {  // a quoted quote
-                    csv->cursor += 2;
-                } else if (csv->buffer[csv->cursor+1] != csv->delimiter && csv->buffer[csv->cursor+1] != '\n') {
-                    fprintf(stderr, "Unquoted quote in quoted field\n");
-                    return -1;
-                } else break;
+    if (csv->buffer[csv->cursor] == '"') {
+        quoted = true;
+        csv->cursor ++;
+    }
+
+    size_t start = csv->cursor;
+    if (quoted) {
+        while (1) {
+            if (0 != csv_find(csv, "\"")) {
+                if (! csv->quiet) fprintf(stderr, "No terminating quote\n");
+                return -1;
             }
-        } else {    // unquoted
-            // Check that no quotes are present in the field (by adding quote to any_delimiter?)
-            if (0 != csv_find(csv, any_delimiter)) {    // assuming the file is properly terminated by '\n'...
-                fprintf(stderr, "Line too long (%u)\n", lineno);
+            if (csv->buffer[csv->cursor+1] == '"') {  // a quoted quote
+                csv->cursor += 2;
+            } else if (csv->buffer[csv->cursor+1] != csv->delimiter && csv->buffer[csv->cursor+1] != '\n') {
+                if (! csv->quiet) fprintf(stderr, "Unquoted quote in quoted field\n");
                 return -1;
+            } else break;
+        }
+    } else {    // unquoted
+        // Check that no quotes are present in the field (by adding quote to any_delimiter?)
+        if (0 != csv_find(csv, any_delimiter)) {    // assuming the file is properly terminated by '\n'...
+            if (! csv->quiet) fprintf(stderr, "Line too long (%u)\n", csv->lineno);
+            return -1;
+        }
+    }
+
+    char supp = csv->buffer[csv->cursor];
+    csv->buffer[csv->cursor] = '\0';
+    field_cb(csv->buffer + start, csv->cursor - start, csv->user_data);
+
+    if (quoted) {
+        assert(supp == '"');
+        csv->cursor ++;
+        supp = csv->buffer[csv->cursor];
+    }
+    csv->cursor ++;
+
+    if (csv->skip_record) {
+        csv->skip_record = false;
+        if (supp != '\n' && 0 != csv_skip_record(csv)) return -1;
+        supp = '\n';
+    }
+    return supp;
+}
+
+/*
+ * Both pull and push modes append bytes to the buffer, scan them once with the
+ * same quoting rules as the tokenizer to know where the last complete record
+ * ends, and tokenize only complete records; what's left waits for more bytes.
+ */
+
+static void csv_scan(struct csv *csv)
+{
+    enum scan_state state = csv->scan_state;
+    // Without any quote to follow, only the last newline matters
+    if (state == SCAN_FIELD_START || state == SCAN_UNQUOTED) {
+        size_t const len = csv->datalen - csv->scanned;
+        char const *const start = csv->buffer + csv->scanned;
+        if (len > 0 && ! memchr(start, '"', len)) {
+            char const *const nl = memrchr(start, '\n', len);
+            if (nl) csv->complete = nl - csv->buffer + 1;
+            char const last = start[len-1];
+            csv->scan_state = last == '\n' || last == csv->delimiter ? SCAN_FIELD_START : SCAN_UNQUOTED;
+            csv->scanned = csv->datalen;
+            return;
+        }
+    }
+
+    for (; csv->scanned < csv->datalen; csv->scanned ++) {
+        char const c = csv->buffer[csv->scanned];
+        state = scan_step(state, c, csv->delimiter);
+        if (c == '\n' && state == SCAN_FIELD_START) csv->complete = csv->scanned + 1;
+    }
+    csv->scan_state = state;
+}
+
+enum scan_state csv_scan_state(enum scan_state state, char const *c, size_t len, char delimiter)
+{
+    char const *const end = c + len;
+    while (c < end) {
+        // Only the next quote matters, and outside of quotes the char before it
+        if (state != SCAN_QUOTE_IN_QUOTED) {
+            char const *const quote = memchr(c, '"', end - c);
+            char const *const stop = quote ? quote : end;
+            if (state != SCAN_QUOTED && stop > c) {
+                state = stop[-1] == '\n' || stop[-1] == delimiter ? SCAN_FIELD_START : SCAN_UNQUOTED;
             }
+            if (! quote) break;
+            c = quote;
         }
+        state = scan_step(state, *c++, delimiter);
+    }
+    return state;
+}
 
-        char supp = csv->buffer[csv->cursor];
-        csv->buffer[csv->cursor] = '\0';
-        field_cb(csv->buffer + start, csv->cursor - start, csv->user_data);
-        fieldno ++;
+size_t csv_record_end(enum scan_state state, char const *buf, size_t len, char delimiter)
+{
+    if (state == SCAN_FIELD_START || state == SCAN_UNQUOTED) {
+        char const *nl = memchr(buf, '\n', len);
+        if (nl && ! memchr(buf, '"', nl - buf)) return nl - buf + 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        state = scan_step(state, buf[i], delimiter);
+        if (buf[i] == '\n' && state == SCAN_FIELD_START) return i + 1;
+    }
+    return 0;
+}
 
-        if (quoted) {
-            assert(supp == '"');
-            csv->cursor ++;
-            supp = csv->buffer[csv->cursor];
+#define RESYNC_WINDOW (1U << 16)
+
+size_t csv_resync(char const *buf, size_t len, char delimiter)
+{
+    // From every state at once, until they agree. Without quotes they never
+    // do, as the quoted state never ends.
+    size_t const window = len < RESYNC_WINDOW ? len : RESYNC_WINDOW;
+    if (memchr(buf, '"', window)) {
+        enum scan_state states[SCAN_NB_STATES] = { SCAN_FIELD_START, SCAN_UNQUOTED, SCAN_QUOTED, SCAN_QUOTE_IN_QUOTED };
+        for (size_t i = 0; i < window; i++) {
+            bool agree = true;
+            for (unsigned s = 0; s < SCAN_NB_STATES; s++) {
+                states[s] = scan_step(states[s], buf[i], delimiter);
+                agree &= states[s] == SCAN_FIELD_START;
+            }
+            if (buf[i] == '\n' && agree) return i + 1;
         }
-        if (supp == '\n') {
+    }
+    // Most likely the start was not within quotes
+    return csv_record_end(SCAN_UNQUOTED, buf, len, delimiter);
+}
+
+static int csv_parse_complete(struct csv *csv, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *))
+{
+    while (csv->cursor < csv->complete) {
+        int const end = csv_next_field(csv, field_cb);
+        if (end < 0) return -1;
+        if (end == '\n') {
             record_cb(csv->user_data);
-            lineno ++;
-            fieldno = 0;
-            csv->cursor ++;
+            csv->lineno ++;
             csv->upto = csv->cursor;
-            if (debug) fprintf(stderr, "eol, cursor=%u, datalen=%u, upto=%u\n", csv->cursor, csv->datalen, csv->upto);
-            if (csv->datalen < csv->max_row_size || csv->upto > csv->datalen - csv->max_row_size) {
-                csv_feed(csv);
-            }
-        } else {
-            assert(supp == csv->delimiter);
-            csv->cursor ++;
         }
     }
+    return 0;
+}
 
-    return csv->eof ? 0 : -1;
+int csv_parse(struct csv *csv, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *))
+{
+    while (! csv->eof) {
+        if (0 != csv_make_room(csv)) return -1;
+        if (debug) fprintf(stderr, "feeding csv while cursor=%zu, datalen=%zu, upto=%zu\n", csv->cursor, csv->datalen, csv->upto);
+        STATS_START(STATS_READ);
+        ssize_t const r = csv->reader(csv->buffer + csv->datalen, csv->buf_size - csv->datalen, csv->user_data);
+        STATS_STOP(STATS_READ);
+        STATS_ADD(refills, 1);
+        if (r < 0) return -1;
+        if (r == 0) {
+            if (debug) fprintf(stderr, "hit end of file\n");
+            return csv_push_end(csv, field_cb, record_cb);
+        }
+        csv->datalen += r;
+        STATS_ADD(bytes_read, r);
+
+        csv_scan(csv);
+        if (0 != csv_parse_complete(csv, field_cb, record_cb)) return -1;
+    }
+    return 0;
+}
+
+int csv_push(struct csv *csv, void const *data, size_t len, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *))
+{
+    while (len > 0) {
+        if (0 != csv_make_room(csv)) return -1;
+        size_t const rem_size = csv->buf_size - csv->datalen;
+        size_t const sz = len < rem_size ? len : rem_size;
+        memcpy(csv->buffer + csv->datalen, data, sz);
+        csv->datalen += sz;
+        STATS_ADD(bytes_read, sz);
+        data = (char const *)data + sz;
+        len -= sz;
+
+        csv_scan(csv);
+        if (0 != csv_parse_complete(csv, field_cb, record_cb)) return -1;
+    }
+    return 0;
+}
+
+int csv_push_end(struct csv *csv, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *))
+{
+    if (csv->upto < csv->datalen) {
+        // Terminate the last record
+        if (csv->scan_state == SCAN_QUOTED) {
+            if (! csv->quiet) fprintf(stderr, "No terminating quote\n");
+            return -1;
+        }
+        if (0 != csv_push(csv, "\n", 1, field_cb, record_cb)) return -1;
+    }
+    csv->eof = true;
+    return 0;
 }
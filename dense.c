@@ -0,0 +1,294 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Dense folding, while there are few groups.
+ * Each row is given the index of its group among the first DENSE_MAX_GROUPS
+ * ones, found in a small table that stays in L1, and its numeric fields are
+ * converted into a batch of columns. Once the batch is full, each aggregate
+ * runs over its column with no call nor lookup per row, accumulating into
+ * DENSE_LANES arrays indexed by group: consecutive rows go to different
+ * lanes, so that rows of the same group do not wait for each other's
+ * update. Lanes are added up into the groups when the batch mode ends, which
+ * is at the end of the input or when one group too many shows up.
+ * Only layouts of sum, min, max, avg and count qualify (plus rem, that folds
+ * nothing), since the order in which rows are folded must not matter.
+ *
+ * Short keys (such as a status code, a country or an HTTP method) are not
+ * even hashed: their bytes and length fit in an integer, that a multiply
+ * maps to a slot of a direct-mapped table four times larger than needed, so
+ * that finding the group is a load, a multiply and an integer compare, and
+ * rarely a second one. A key missing from that table goes through the hashed
+ * slots, and joins the table once its group is created. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "groupby.h"
+
+#define DENSE_MAX_GROUPS 256
+#define DENSE_NB_SLOTS (2 * DENSE_MAX_GROUPS)   // a power of 2
+#define DENSE_BATCH 1024
+#define DENSE_LANES 4
+#define SHORT_MAX_LEN 7    // longest key (with its final nul) to be looked up without hashing
+#define SHORT_BITS 10       // 4 slots per group
+#define SHORT_MUL 0x9e3779b97f4a7c15ULL
+
+enum dense_op { DENSE_SUM, DENSE_MIN, DENSE_MAX, DENSE_AVG, DENSE_COUNT };
+
+struct dense {
+    struct row_conf const *conf;
+    struct groups *groups;  // where the groups are created
+    unsigned nb_groups;
+    struct group *group[DENSE_MAX_GROUPS];
+    struct dense_slot {
+        uint64_t hash;
+        unsigned idx;   // in group, plus one (0 for a free slot)
+    } slots[DENSE_NB_SLOTS];
+    // Direct-mapped short keys
+    uint64_t short_key[1U << SHORT_BITS];  // 0 for a free slot
+    uint8_t short_idx[1U << SHORT_BITS];
+    unsigned nb_fields;     // rows with fewer fields are folded one by one
+    unsigned nb_inputs;
+    unsigned field[KERNEL_MAX_INPUTS];
+    unsigned nb_aggrs;
+    struct dense_aggr {
+        enum dense_op op;
+        unsigned input;     // none for DENSE_COUNT
+        size_t offset;
+    } aggr[KERNEL_MAX_AGGRS];
+    bool counted;       // whether rows are counted per group, for avg and count
+    // The batch
+    unsigned nb_rows;
+    uint8_t idx[DENSE_BATCH];
+    long long in[KERNEL_MAX_INPUTS][DENSE_BATCH];
+    // The accumulators
+    long long acc[KERNEL_MAX_AGGRS][DENSE_LANES][DENSE_MAX_GROUPS];
+    uint64_t count[DENSE_LANES][DENSE_MAX_GROUPS];
+};
+
+static bool dense_op_of_name(enum dense_op *op, char const *name)
+{
+    static char const *const names[] = {
+        [DENSE_SUM] = "sum", [DENSE_MIN] = "min", [DENSE_MAX] = "max", [DENSE_AVG] = "avg", [DENSE_COUNT] = "count",
+    };
+    for (unsigned o = 0; o < SIZEOF_ARRAY(names); o++) {
+        if (0 == strcmp(name, names[o])) {
+            *op = o;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void dense_reset(struct dense *dense)
+{
+    for (unsigned a = 0; a < dense->nb_aggrs; a++) {
+        long long const init = dense->aggr[a].op == DENSE_MIN ? LLONG_MAX : dense->aggr[a].op == DENSE_MAX ? LLONG_MIN : 0;
+        for (unsigned l = 0; l < DENSE_LANES; l++) {
+            for (unsigned g = 0; g < DENSE_MAX_GROUPS; g++) dense->acc[a][l][g] = init;
+        }
+    }
+    memset(dense->count, 0, sizeof(dense->count));
+}
+
+struct dense *dense_new(struct row_conf const *conf, struct groups *groups)
+{
+    struct dense *dense = malloc(sizeof(*dense));
+    if (! dense) {
+        if (debug) fprintf(stderr, "Cannot malloc %zu bytes for dense folding\n", sizeof(*dense));
+        return NULL;
+    }
+    dense->conf = conf;
+    dense->groups = groups;
+    dense->nb_groups = 0;
+    memset(dense->slots, 0, sizeof(dense->slots));
+    memset(dense->short_key, 0, sizeof(dense->short_key));
+    dense->nb_fields = dense->nb_inputs = dense->nb_aggrs = 0;
+    dense->counted = false;
+    dense->nb_rows = 0;
+
+    unsigned last_field = UINT_MAX;
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        struct aggr_func const *func = conf->aggrs[a].func;
+        unsigned const field = conf->aggrs[a].field;
+        if (0 == strcmp(func->name, "rem")) continue;
+        enum dense_op op;
+        if (! dense_op_of_name(&op, func->name) || dense->nb_aggrs >= KERNEL_MAX_AGGRS) goto unfit;
+        dense->nb_fields = field + 1;
+        if (op == DENSE_COUNT) {
+            dense->aggr[dense->nb_aggrs++] = (struct dense_aggr){ .op = op, .offset = conf->aggr_cumul_size[a] };
+            dense->counted = true;
+            continue;
+        }
+        if (field != last_field) {  // aggrs are ordered by field
+            if (dense->nb_inputs >= KERNEL_MAX_INPUTS) goto unfit;
+            dense->field[dense->nb_inputs++] = last_field = field;
+        }
+        dense->aggr[dense->nb_aggrs++] = (struct dense_aggr){ .op = op, .input = dense->nb_inputs-1, .offset = conf->aggr_cumul_size[a] };
+        if (op == DENSE_AVG) dense->counted = true;
+    }
+    if (! dense->nb_aggrs) goto unfit;
+
+    STATS_ADD(alloc_bytes, sizeof(*dense));
+    dense_reset(dense);
+    if (debug) fprintf(stderr, "Folding in batches of %u rows while there are at most %u groups\n", DENSE_BATCH, DENSE_MAX_GROUPS);
+    return dense;
+unfit:
+    free(dense);
+    return NULL;
+}
+
+void dense_del(struct dense *dense)
+{
+    free(dense);
+}
+
+// Fold a whole column into the lanes of one aggregate
+#define DENSE_COLUMN(update) do {                                             \
+    unsigned i = 0;                                                           \
+    for (; i + DENSE_LANES <= nb_rows; i += DENSE_LANES) {                    \
+        for (unsigned l = 0; l < DENSE_LANES; l++) {                          \
+            long long *const acc_ = &acc[l][idx[i+l]];                        \
+            long long const v_ = in[i+l];                                     \
+            update;                                                           \
+        }                                                                     \
+    }                                                                         \
+    for (unsigned l = 0; i < nb_rows; i++, l++) {                             \
+        long long *const acc_ = &acc[l][idx[i]];                              \
+        long long const v_ = in[i];                                           \
+        update;                                                               \
+    }                                                                         \
+} while (0)
+
+static void dense_run(struct dense *dense)
+{
+    unsigned const nb_rows = dense->nb_rows;
+    uint8_t const *const idx = dense->idx;
+    for (unsigned a = 0; a < dense->nb_aggrs; a++) {
+        long long (*const acc)[DENSE_MAX_GROUPS] = dense->acc[a];
+        long long const *const in = dense->in[dense->aggr[a].input];
+        switch (dense->aggr[a].op) {
+            case DENSE_SUM:
+            case DENSE_AVG:
+                DENSE_COLUMN(*acc_ += v_);
+                break;
+            case DENSE_MIN:
+                DENSE_COLUMN(if (v_ < *acc_) *acc_ = v_);
+                break;
+            case DENSE_MAX:
+                DENSE_COLUMN(if (v_ > *acc_) *acc_ = v_);
+                break;
+            case DENSE_COUNT:   // from the row counts below
+                break;
+        }
+    }
+    if (dense->counted) {
+        unsigned i = 0;
+        for (; i + DENSE_LANES <= nb_rows; i += DENSE_LANES) {
+            for (unsigned l = 0; l < DENSE_LANES; l++) dense->count[l][idx[i+l]] ++;
+        }
+        for (unsigned l = 0; i < nb_rows; i++, l++) dense->count[l][idx[i]] ++;
+    }
+    STATS_ADD(dense_rows, nb_rows);
+    dense->nb_rows = 0;
+}
+
+void dense_flush(struct dense *dense)
+{
+    dense_run(dense);
+    for (unsigned g = 0; g < dense->nb_groups; g++) {
+        struct group *group = dense->group[g];
+        uint64_t count = 0;
+        for (unsigned l = 0; l < DENSE_LANES; l++) count += dense->count[l][g];
+        for (unsigned a = 0; a < dense->nb_aggrs; a++) {
+            long long (*const acc)[DENSE_MAX_GROUPS] = dense->acc[a];
+            void *const value = group->values + dense->aggr[a].offset;
+            for (unsigned l = 0; l < DENSE_LANES; l++) {
+                switch (dense->aggr[a].op) {
+                    case DENSE_SUM:
+                        aggr_sum_ll(value, acc[l][g]);
+                        break;
+                    case DENSE_MIN:
+                        aggr_min_ll(value, acc[l][g]);
+                        break;
+                    case DENSE_MAX:
+                        aggr_max_ll(value, acc[l][g]);
+                        break;
+                    case DENSE_AVG:
+                        ((struct avg_value *)value)->sum += acc[l][g];
+                        break;
+                    case DENSE_COUNT:
+                        break;
+                }
+            }
+            if (dense->aggr[a].op == DENSE_AVG) ((struct avg_value *)value)->nb_values += count;
+            if (dense->aggr[a].op == DENSE_COUNT) *(long long *)value += count;
+        }
+    }
+    dense_reset(dense);
+}
+
+// Fold the row of group number g, that is looked up already
+static int dense_fold_group(struct dense *dense, unsigned g, char const *const *values, long long const *ints, unsigned nb_values)
+{
+    struct group *group = dense->group[g];
+    if (nb_values < dense->nb_fields) return group_fold(group, dense->conf, values, ints, nb_values);
+    group_widen(group, dense->conf, nb_values);
+
+    unsigned const r = dense->nb_rows;
+    dense->idx[r] = g;
+    for (unsigned i = 0; i < dense->nb_inputs; i++) dense->in[i][r] = field_ll(values, ints, dense->field[i]);
+    if (++dense->nb_rows >= DENSE_BATCH) dense_run(dense);
+    return 0;
+}
+
+// The bytes of a short key and its length, never 0
+static inline uint64_t short_key(struct key_str const *key)
+{
+    uint64_t v = 0;
+    memcpy(&v, key->str, key->len);
+    return v | (uint64_t)key->len << 56;
+}
+
+static inline unsigned short_slot(uint64_t v)
+{
+    return (v * SHORT_MUL) >> (64 - SHORT_BITS);
+}
+
+int dense_fold(struct dense *dense, struct key_str *key, char const *const *values, long long const *ints, unsigned nb_values)
+{
+    uint64_t const v = key->len <= SHORT_MAX_LEN ? short_key(key) : 0;
+    if (v) {
+        for (unsigned s = short_slot(v); dense->short_key[s]; s = (s + 1) & ((1U << SHORT_BITS) - 1)) {
+            if (dense->short_key[s] == v) {
+                STATS_ADD(short_rows, 1);
+                return dense_fold_group(dense, dense->short_idx[s], values, ints, nb_values);
+            }
+        }
+    }
+
+    uint64_t const hash = hasher_hash(&dense->groups->hasher, key->str, key->len);
+    unsigned s = hash & (DENSE_NB_SLOTS - 1);
+    for (; dense->slots[s].idx; s = (s + 1) & (DENSE_NB_SLOTS - 1)) {
+        if (dense->slots[s].hash == hash && group_key_eq(dense->group[dense->slots[s].idx - 1], key, dense->conf)) break;
+    }
+    if (! dense->slots[s].idx) {
+        if (dense->nb_groups >= DENSE_MAX_GROUPS) {
+            if (debug) fprintf(stderr, "More than %u groups, folding rows one by one\n", DENSE_MAX_GROUPS);
+            dense_flush(dense);
+            return 1;
+        }
+        struct group *group = group_find_or_create(dense->groups, key, dense->conf, nb_values);
+        if (! group) return -1;
+        dense->group[dense->nb_groups++] = group;
+        dense->slots[s].hash = hash;
+        dense->slots[s].idx = dense->nb_groups;
+        if (v) {
+            unsigned t = short_slot(v);
+            while (dense->short_key[t]) t = (t + 1) & ((1U << SHORT_BITS) - 1);
+            dense->short_key[t] = v;
+            dense->short_idx[t] = dense->nb_groups - 1;
+        }
+    }
+
+    return dense_fold_group(dense, dense->slots[s].idx - 1, values, ints, nb_values);
+}
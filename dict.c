@@ -0,0 +1,252 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Global dictionary of interned strings, so that string aggregates store a
+ * 32 bits id instead of their own copy of the string.
+ * Strings already interned are found without locking; new ones are added
+ * under a mutex. Strings are stored by id in fixed blocks that never move so
+ * that dict_str needs no lock, and replaced hash tables are kept for the
+ * readers that may still be probing them.
+ * Every groupby holds a reference, and the last one frees it all. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "groupby.h"
+
+#define DICT_BLOCK_BITS 16
+#define DICT_BLOCK_SIZE (1U << DICT_BLOCK_BITS)
+#define DICT_MAX_BLOCKS (1U << (32 - DICT_BLOCK_BITS))
+
+// Rank of each id below nb in string order
+struct dict_ranks {
+    struct dict_ranks *prev;    // older ranks, that may still be in use
+    uint32_t nb;
+    uint32_t rank[];
+};
+
+// Open addressing table of hash<<32 | id (0 for empty slots)
+struct dict_table {
+    struct dict_table *prev;    // smaller tables, that may still be probed
+    uint32_t nb_slots;  // a power of 2
+    uint64_t slots[];
+};
+
+static struct dict {
+    pthread_mutex_t lock;
+    unsigned nb_refs;
+    struct arena strings;
+    char const **blocks[DICT_MAX_BLOCKS];   // strings by id
+    uint32_t nb_strs;
+    struct dict_table *table;
+    struct dict_ranks *ranks;
+} dict = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static char const **dict_slot_of_id(uint32_t id)
+{
+    return dict.blocks[id >> DICT_BLOCK_BITS] + (id & (DICT_BLOCK_SIZE-1));
+}
+
+static struct dict_table *dict_table_new(uint32_t nb_slots)
+{
+    struct dict_table *table = calloc(1, sizeof(*table) + nb_slots * sizeof(table->slots[0]));
+    if (! table) {
+        fprintf(stderr, "Cannot grow string dictionary to %"PRIu32" slots\n", nb_slots);
+        return NULL;
+    }
+    STATS_ADD(alloc_bytes, nb_slots * sizeof(table->slots[0]));
+    table->nb_slots = nb_slots;
+    return table;
+}
+
+static int dict_init(void)
+{
+    arena_ctor(&dict.strings, 1U<<20);
+    dict.nb_strs = 1;   // for DICT_NONE
+    struct dict_table *table = dict_table_new(2048);
+    if (! table) return -1;
+    __atomic_store_n(&dict.table, table, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void dict_ref(void)
+{
+    pthread_mutex_lock(&dict.lock);
+    dict.nb_refs ++;
+    pthread_mutex_unlock(&dict.lock);
+}
+
+void dict_unref(void)
+{
+    pthread_mutex_lock(&dict.lock);
+    assert(dict.nb_refs > 0);
+    if (--dict.nb_refs == 0 && dict.table) {
+        arena_dtor(&dict.strings);
+        for (unsigned b = 0; b < DICT_MAX_BLOCKS && dict.blocks[b]; b++) {
+            free(dict.blocks[b]);
+            dict.blocks[b] = NULL;
+        }
+        dict.nb_strs = 0;
+        while (dict.table) {
+            struct dict_table *prev = dict.table->prev;
+            free(dict.table);
+            dict.table = prev;
+        }
+        while (dict.ranks) {
+            struct dict_ranks *prev = dict.ranks->prev;
+            free(dict.ranks);
+            dict.ranks = prev;
+        }
+    }
+    pthread_mutex_unlock(&dict.lock);
+}
+
+static int dict_rehash(void)
+{
+    struct dict_table *old = dict.table;
+    struct dict_table *table = dict_table_new(2 * old->nb_slots);
+    if (! table) return -1;
+
+    uint32_t const mask = table->nb_slots - 1;
+    for (uint32_t s = 0; s < old->nb_slots; s++) {
+        if (! old->slots[s]) continue;
+        uint32_t i = (old->slots[s] >> 32) & mask;
+        while (table->slots[i]) i = (i+1) & mask;
+        table->slots[i] = old->slots[s];
+    }
+    table->prev = old;
+    __atomic_store_n(&dict.table, table, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// The id of that string if it is in the table, or DICT_NONE
+static uint32_t dict_find(struct dict_table const *table, char const *str, uint32_t h, uint32_t *slot)
+{
+    uint32_t const mask = table->nb_slots - 1;
+    uint32_t i = h & mask;
+    for (;; i = (i+1) & mask) {
+        // The string of an id is set before the id is stored
+        uint64_t const entry = __atomic_load_n(table->slots + i, __ATOMIC_ACQUIRE);
+        if (! entry) break;
+        uint32_t const id = entry;
+        if ((entry >> 32) == h && 0 == strcmp(*dict_slot_of_id(id), str)) return id;
+    }
+    if (slot) *slot = i;
+    return DICT_NONE;
+}
+
+static uint32_t dict_intern_locked(char const *str, size_t len, uint32_t h)
+{
+    if (! dict.table && 0 != dict_init()) return DICT_NONE;
+
+    uint32_t i;
+    uint32_t id = dict_find(dict.table, str, h, &i);
+    if (id != DICT_NONE) return id;
+
+    // A new string
+    id = dict.nb_strs;
+    if (id == UINT32_MAX) {
+        fprintf(stderr, "Too many distinct strings\n");
+        return DICT_NONE;
+    }
+    if (! dict.blocks[id >> DICT_BLOCK_BITS]) {
+        dict.blocks[id >> DICT_BLOCK_BITS] = malloc(DICT_BLOCK_SIZE * sizeof(char const *));
+        if (! dict.blocks[id >> DICT_BLOCK_BITS]) {
+            fprintf(stderr, "Cannot malloc string dictionary block\n");
+            return DICT_NONE;
+        }
+        STATS_ADD(alloc_bytes, DICT_BLOCK_SIZE * sizeof(char const *));
+    }
+    char *copy = arena_alloc(&dict.strings, len+1);
+    if (! copy) return DICT_NONE;
+    memcpy(copy, str, len+1);
+    *dict_slot_of_id(id) = copy;
+    dict.nb_strs ++;
+    __atomic_store_n(dict.table->slots + i, ((uint64_t)h << 32) | id, __ATOMIC_RELEASE);
+    if (2 * dict.nb_strs >= dict.table->nb_slots && 0 != dict_rehash()) return DICT_NONE;
+    return id;
+}
+
+static uint32_t dict_hash(char const *str, size_t len)
+{
+    return hash_fast(str, len, 0x12345678);
+}
+
+uint32_t dict_lookup(char const *str)
+{
+    struct dict_table const *table = __atomic_load_n(&dict.table, __ATOMIC_ACQUIRE);
+    if (! table) return DICT_NONE;
+    return dict_find(table, str, dict_hash(str, strlen(str)), NULL);
+}
+
+uint32_t dict_intern(char const *str)
+{
+    size_t const len = strlen(str);
+    uint32_t const h = dict_hash(str, len);
+    // Most values are interned already
+    struct dict_table const *table = __atomic_load_n(&dict.table, __ATOMIC_ACQUIRE);
+    if (table) {
+        uint32_t const id = dict_find(table, str, h, NULL);
+        if (id != DICT_NONE) return id;
+    }
+
+    pthread_mutex_lock(&dict.lock);
+    uint32_t const id = dict_intern_locked(str, len, h);
+    pthread_mutex_unlock(&dict.lock);
+    return id;
+}
+
+char const *dict_str(uint32_t id)
+{
+    return id == DICT_NONE ? "" : *dict_slot_of_id(id);
+}
+
+void dict_freeze(void)
+{
+    pthread_mutex_lock(&dict.lock);
+    uint32_t const nb_strs = dict.nb_strs;
+    pthread_mutex_unlock(&dict.lock);
+
+    struct dict_ranks *prev = __atomic_load_n(&dict.ranks, __ATOMIC_ACQUIRE);
+    if (nb_strs <= 1 || (prev && prev->nb == nb_strs)) return;
+
+    size_t const nb = nb_strs - 1;
+    struct sort_entry *entries = malloc(2 * nb * sizeof(*entries));
+    struct dict_ranks *ranks = malloc(sizeof(*ranks) + nb_strs * sizeof(ranks->rank[0]));
+    if (! entries || ! ranks) {
+        // dict_cmp will just use strcmp
+        free(entries);
+        free(ranks);
+        return;
+    }
+    for (uint32_t id = 1; id < nb_strs; id++) {
+        struct sort_entry *e = entries + id - 1;
+        e->key = dict_str(id);
+        e->key_len = strlen(e->key);
+        e->prefix = sort_key_prefix(e->key, e->key_len);
+        e->data = (void *)(uintptr_t)id;
+    }
+    sort_entries(entries, entries + nb, nb, 0);
+    ranks->nb = nb_strs;
+    ranks->rank[DICT_NONE] = 0;
+    for (size_t r = 0; r < nb; r++) ranks->rank[(uintptr_t)entries[r].data] = r + 1;
+    free(entries);
+
+    // Older ranks are kept since another thread may be comparing with them
+    ranks->prev = prev;
+    if (! __atomic_compare_exchange_n(&dict.ranks, &prev, ranks, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        free(ranks);    // another thread froze it meanwhile
+    }
+}
+
+int dict_cmp(uint32_t a, uint32_t b)
+{
+    if (a == b) return 0;
+    struct dict_ranks const *ranks = __atomic_load_n(&dict.ranks, __ATOMIC_ACQUIRE);
+    if (ranks && a < ranks->nb && b < ranks->nb) return ranks->rank[a] < ranks->rank[b] ? -1 : 1;
+    if (a == DICT_NONE || b == DICT_NONE) return a == DICT_NONE ? -1 : 1;
+    return strcmp(dict_str(a), dict_str(b));
+}
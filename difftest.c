@@ -0,0 +1,767 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Differential test (make check): random inputs are aggregated with every
+ * engine, parser, input format and number of threads, and the groups compared,
+ * in any order, with those of a naive aggregation that sorts the rows.
+ * Binary outputs are read back by groupby itself, with all fields grouped.
+ * Inputs have quoted fields with delimiters, doubled quotes and newlines in
+ * them, unquoted fields with quotes, empty fields and a last record that may
+ * lack its newline. One input has long keys that are prefixes of each other.
+ * Some aggregates filter the rows on their first field. The naive
+ * aggregation works from the values the generator meant, so that the parser
+ * is checked as well.
+ * Usage: groupby-difftest [seed [rounds]]
+ * On failure the input is left in difftest-<seed>-<round>.csv. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include "groupby.h"
+
+#define NB_FIELDS 6
+#define MAX_FUNCS 3
+#define SEP '\x01'      // between values of a group, when compared
+
+static uint64_t rnd(uint64_t *state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned rnd_below(uint64_t *state, unsigned n)
+{
+    return rnd(state) % n;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size ? size : 1);
+    if (! ptr) {
+        fprintf(stderr, "Cannot alloc %zu bytes\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/*
+ * Growing buffers
+ */
+
+struct buf {
+    char *str;
+    size_t len, size;
+};
+
+static void buf_append(struct buf *b, void const *src, size_t len)
+{
+    if (b->len + len + 1 > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        while (size < b->len + len + 1) size *= 2;
+        b->str = xrealloc(b->str, size);
+        b->size = size;
+    }
+    memcpy(b->str + b->len, src, len);
+    b->len += len;
+    b->str[b->len] = '\0';
+}
+
+static void buf_puts(struct buf *b, char const *str)
+{
+    buf_append(b, str, strlen(str));
+}
+
+static void buf_pad8(struct buf *b)
+{
+    static char const zeros[8];
+    buf_append(b, zeros, ((b->len + 7) & ~(size_t)7) - b->len);
+}
+
+/*
+ * What is tested
+ */
+
+struct shape {
+    unsigned nb_rows;
+    unsigned nb_keys, nb_keys2;     // of the first and third fields, both grouped
+    char delimiter;
+    bool nested;    // first and fifth fields are runs of a single letter, prefixes of each other
+};
+
+static struct shape const shapes[] = {
+    { 20000, 20, 3, ',', false },           // few groups: folded in batches
+    { 150000, 1500000, 2, ',', false },     // mostly unique keys: threads bypass their tables
+    { 3000, 400, 5, '\t', false },
+    { 4000, 4000, 2, ',', true },           // as many radix sort levels as key lengths
+    { 1, 1, 1, ',', false },
+    { 0, 1, 1, ',', false },
+};
+
+// Fields are: key, number, key, number, string, string
+static bool const numeric_field[NB_FIELDS] = { false, true, false, true, false, false };
+
+struct test_conf {
+    char const *name;
+    char const *funcs[NB_FIELDS][MAX_FUNCS];    // none for grouped fields
+    bool ordered;   // uses first or last
+    char const *prefix; // if set, only rows whose first field starts with it are aggregated (--where 1^=prefix)
+};
+
+static struct test_conf const test_confs[] = {
+    { "all", { {NULL}, {"sum","min","max"}, {NULL}, {"avg"}, {"first","last"}, {"smallest","greatest"} }, true, NULL },
+    { "numeric", { {NULL}, {"sum","max"}, {NULL}, {"min","avg"}, {"rem"}, {"rem"} }, false, "a" },
+    { "count", { {NULL}, {"count"}, {NULL}, {"sum"}, {"rem"}, {"rem"} }, false, NULL },
+    { "counts", { {NULL}, {"count_distinct","count","min"}, {NULL}, {"count_nonempty"}, {"count_distinct"}, {"count_nonempty"} }, false, NULL },
+};
+
+enum feed { FEED_READ, FEED_PUSH, FEED_RECORDS };
+
+struct variant {
+    char const *name;
+    enum feed feed;
+    struct groupby_options opts;
+};
+
+static struct variant const variants[] = {
+    { "hash", FEED_READ, { .engine = ENGINE_HASH } },
+    { "hash --no-dense", FEED_READ, { .no_dense = true } },
+    { "hash --hash=seeded", FEED_READ, { .hash = HASH_SEEDED } },
+    { "hash --hash=crc32c", FEED_READ, { .hash = HASH_CRC32C } },
+    { "hash --hash=lookup3", FEED_READ, { .hash = HASH_LOOKUP3 } },
+    { "hash --sort-by=key", FEED_READ, { .order = { .by = ORDER_KEY } } },
+    { "hash --sort-by=2", FEED_READ, { .order = { .by = ORDER_FIELD, .aggr = 0 } } },
+    { "hash --readahead=2", FEED_READ, { .readahead = 2 } },
+    { "hash --estimate", FEED_READ, { .sample_size = 1U<<20 } },
+    { "hash --estimate --max-memory (spilled)", FEED_READ, { .sample_size = 1U<<20, .max_memory = 1 } },
+    { "hash pushed", FEED_PUSH, { .engine = ENGINE_HASH } },
+    { "hash records", FEED_RECORDS, { .engine = ENGINE_HASH } },
+    { "sort", FEED_READ, { .engine = ENGINE_SORT } },
+    { "sort pushed", FEED_PUSH, { .engine = ENGINE_SORT } },
+    { "sort records", FEED_RECORDS, { .engine = ENGINE_SORT } },
+    { "-j 2", FEED_READ, { .nb_threads = 2 } },
+    { "-j 3", FEED_READ, { .nb_threads = 3 } },
+    { "-j 4 --no-dense", FEED_READ, { .nb_threads = 4, .no_dense = true } },
+    { "-j 4 --estimate", FEED_READ, { .nb_threads = 4, .sample_size = 1U<<20 } },
+    { "-j 3 --parallel=shared", FEED_READ, { .nb_threads = 3, .parallel = PARALLEL_SHARED } },
+    { "-j 4 --parallel=shared --estimate", FEED_READ, { .nb_threads = 4, .parallel = PARALLEL_SHARED, .sample_size = 1U<<20 } },
+    { "--input-format=rows", FEED_READ, { .input_format = FORMAT_ROWS } },
+    { "--input-format=columns", FEED_READ, { .input_format = FORMAT_COLUMNS } },
+    { "--input-format=columns --no-dense", FEED_READ, { .input_format = FORMAT_COLUMNS, .no_dense = true } },
+    { "sort --input-format=rows", FEED_READ, { .engine = ENGINE_SORT, .input_format = FORMAT_ROWS } },
+    { "--output-format=rows", FEED_READ, { .output_format = FORMAT_ROWS } },
+    { "--output-format=columns", FEED_READ, { .output_format = FORMAT_COLUMNS } },
+    { "sort --output-format=columns", FEED_READ, { .engine = ENGINE_SORT, .output_format = FORMAT_COLUMNS } },
+    { "-j 3 --output-format=rows", FEED_READ, { .nb_threads = 3, .output_format = FORMAT_ROWS } },
+    { "--input-format=columns --output-format=columns", FEED_READ, { .input_format = FORMAT_COLUMNS, .output_format = FORMAT_COLUMNS } },
+};
+
+/*
+ * Inputs
+ */
+
+struct input {
+    struct shape const *shape;
+    unsigned nb_rows;
+    char **values;  // of each field of each row, as the parser gives them (quotes still doubled)
+    struct buf csv, rows, columns;
+};
+
+static char const value_chars[] = "ab Z09,;\t\n\"";
+
+static char *xstrdup(char const *str)
+{
+    size_t const len = strlen(str) + 1;
+    return memcpy(xrealloc(NULL, len), str, len);
+}
+
+// A value as the parser gives it, quotes still doubled
+static char *random_str(uint64_t *state, unsigned max_len)
+{
+    char str[2 * max_len + 1];
+    unsigned const len = rnd_below(state, max_len + 1);
+    unsigned l = 0;
+    for (unsigned i = 0; i < len; i++) {
+        char const c = value_chars[rnd_below(state, sizeof(value_chars) - 1)];
+        str[l++] = c;
+        if (c == '"') str[l++] = c;
+    }
+    str[l] = '\0';
+    return xstrdup(str);
+}
+
+// A value with lone quotes, that are literal in an unquoted field
+static char *random_literal(uint64_t *state, unsigned max_len)
+{
+    static char const chars[] = "ab Z09\"";
+    char str[max_len + 2];
+    unsigned const len = rnd_below(state, max_len + 1);
+    str[0] = 'a';
+    for (unsigned i = 1; i <= len; i++) str[i] = chars[rnd_below(state, sizeof(chars) - 1)];
+    str[len + 1] = '\0';
+    return xstrdup(str);
+}
+
+// k + 1 times the same letter
+static char *nested_str(char letter, unsigned k)
+{
+    char *str = xrealloc(NULL, k + 2);
+    memset(str, letter, k + 1);
+    str[k + 1] = '\0';
+    return str;
+}
+
+// The same key for the same k, distinct for most others
+static char *random_key(unsigned k, uint64_t salt)
+{
+    uint64_t state = (k + 1) * 0x9e3779b97f4a7c15ULL ^ salt;
+    for (unsigned i = 0; i < 4; i++) rnd(&state);
+    char *prefix = random_str(&state, 4), *suffix = random_str(&state, 4);
+    char str[64];
+    snprintf(str, sizeof(str), "%s%x%s", prefix, k, suffix);
+    free(prefix);
+    free(suffix);
+    return xstrdup(str);
+}
+
+static char *random_number(uint64_t *state)
+{
+    if (rnd_below(state, 10) == 0) return random_str(state, 0);   // empty, which is 0
+    char str[32];
+    snprintf(str, sizeof(str), "%lld", (long long)rnd_below(state, 2000001) - 1000000);
+    return xstrdup(str);
+}
+
+// Whether the value can be quoted as is
+static bool quotes_doubled(char const *value)
+{
+    for (char const *c = value; (c = strchr(c, '"')); c += 2) {
+        if (c[1] != '"') return false;
+    }
+    return true;
+}
+
+static void csv_append_value(struct buf *csv, char const *value, char delimiter, uint64_t *state)
+{
+    // Quotes past the start of an unquoted field are taken literally
+    bool const quote =
+        strchr(value, delimiter) || strchr(value, '\n') || value[0] == '"' ||
+        (quotes_doubled(value) && rnd_below(state, 5) == 0);
+    if (quote) buf_puts(csv, "\"");
+    buf_puts(csv, value);
+    if (quote) buf_puts(csv, "\"");
+}
+
+static bool is_integer(char const *const *values, unsigned f)
+{
+    return numeric_field[f] && values[f][0] != '\0';
+}
+
+static void rows_append(struct buf *rows, char const *const *values)
+{
+    uint32_t lens[NB_FIELDS];
+    size_t size = 2 * sizeof(uint32_t) + ((sizeof(lens) + 7) & ~(size_t)7);
+    for (unsigned f = 0; f < NB_FIELDS; f++) {
+        if (is_integer(values, f)) {
+            lens[f] = ROWS_INTEGER;
+            size += sizeof(int64_t);
+        } else {
+            lens[f] = strlen(values[f]);
+            size += (lens[f] + 1 + 7) & ~(size_t)7;
+        }
+    }
+    uint32_t const header[2] = { size, NB_FIELDS };
+    buf_append(rows, header, sizeof(header));
+    buf_append(rows, lens, sizeof(lens));
+    buf_pad8(rows);
+    for (unsigned f = 0; f < NB_FIELDS; f++) {
+        if (lens[f] == ROWS_INTEGER) {
+            int64_t const i = strtoll(values[f], NULL, 10);
+            buf_append(rows, &i, sizeof(i));
+        } else {
+            buf_append(rows, values[f], lens[f] + 1);
+            buf_pad8(rows);
+        }
+    }
+}
+
+static void columns_append(struct buf *columns, char *const *values, uint64_t nb_rows)
+{
+    uint32_t const nb_columns = NB_FIELDS;
+    buf_append(columns, COLUMNS_MAGIC, 4);
+    buf_append(columns, &nb_columns, sizeof(nb_columns));
+    buf_append(columns, &nb_rows, sizeof(nb_rows));
+    struct buf data[NB_FIELDS] = { { .len = 0 } };
+    for (unsigned f = 0; f < NB_FIELDS; f++) {
+        bool integers = numeric_field[f];
+        for (uint64_t r = 0; r < nb_rows && integers; r++) integers = is_integer((char const *const *)values + r * NB_FIELDS, f);
+        if (integers) {
+            for (uint64_t r = 0; r < nb_rows; r++) {
+                int64_t const i = strtoll(values[r * NB_FIELDS + f], NULL, 10);
+                buf_append(data + f, &i, sizeof(i));
+            }
+        } else {
+            uint64_t offset = 0;
+            buf_append(data + f, &offset, sizeof(offset));
+            for (uint64_t r = 0; r < nb_rows; r++) {
+                offset += strlen(values[r * NB_FIELDS + f]) + 1;
+                buf_append(data + f, &offset, sizeof(offset));
+            }
+            for (uint64_t r = 0; r < nb_rows; r++) {
+                buf_append(data + f, values[r * NB_FIELDS + f], strlen(values[r * NB_FIELDS + f]) + 1);
+            }
+            buf_pad8(data + f);
+        }
+        uint32_t const type[2] = { integers ? COLUMN_INTEGER : COLUMN_STRING, 0 };
+        uint64_t const size = data[f].len;
+        buf_append(columns, type, sizeof(type));
+        buf_append(columns, &size, sizeof(size));
+    }
+    for (unsigned f = 0; f < NB_FIELDS; f++) {
+        buf_append(columns, data[f].str, data[f].len);
+        free(data[f].str);
+    }
+}
+
+static void input_ctor(struct input *in, struct shape const *shape, uint64_t *state)
+{
+    memset(in, 0, sizeof(*in));
+    in->shape = shape;
+    in->nb_rows = shape->nb_rows;
+    in->values = xrealloc(NULL, in->nb_rows * NB_FIELDS * sizeof(*in->values));
+    uint64_t const salt = rnd(state);
+    for (unsigned r = 0; r < in->nb_rows; r++) {
+        char **values = in->values + r * NB_FIELDS;
+        unsigned const k = rnd_below(state, shape->nb_keys);
+        values[0] = shape->nested ? nested_str('a', k) : random_key(k, salt);
+        values[1] = random_number(state);
+        values[2] = random_key(rnd_below(state, shape->nb_keys2), ~salt);
+        values[3] = random_number(state);
+        values[4] = shape->nested ? nested_str('b', k) : random_str(state, 6);
+        values[5] = rnd_below(state, 4) ? random_str(state, 6) : random_literal(state, 6);
+        for (unsigned f = 0; f < NB_FIELDS; f++) {
+            if (f > 0) buf_append(&in->csv, &shape->delimiter, 1);
+            csv_append_value(&in->csv, values[f], shape->delimiter, state);
+        }
+        if (r < in->nb_rows - 1 || rnd_below(state, 2)) buf_puts(&in->csv, "\n");
+        rows_append(&in->rows, (char const *const *)values);
+    }
+    for (unsigned r = 0; r < in->nb_rows; ) {
+        unsigned nb = 1 + rnd_below(state, 3000);
+        if (nb > in->nb_rows - r) nb = in->nb_rows - r;
+        columns_append(&in->columns, in->values + r * NB_FIELDS, nb);
+        r += nb;
+    }
+}
+
+static void input_dtor(struct input *in)
+{
+    for (unsigned v = 0; v < in->nb_rows * NB_FIELDS; v++) free(in->values[v]);
+    free(in->values);
+    free(in->csv.str);
+    free(in->rows.str);
+    free(in->columns.str);
+}
+
+/*
+ * Groups, as sorted lines of values separated by SEP
+ */
+
+struct lines {
+    char **lines;
+    size_t nb, size;
+};
+
+static void lines_add(struct lines *lines, struct buf *line)
+{
+    if (lines->nb >= lines->size) {
+        lines->size = lines->size ? 2 * lines->size : 1024;
+        lines->lines = xrealloc(lines->lines, lines->size * sizeof(*lines->lines));
+    }
+    buf_append(line, "", 0);
+    lines->lines[lines->nb++] = xstrdup(line->str);
+    line->len = 0;
+}
+
+static int str_cmp(void const *a, void const *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void lines_sort(struct lines *lines)
+{
+    if (lines->nb > 0) qsort(lines->lines, lines->nb, sizeof(*lines->lines), str_cmp);
+}
+
+static void lines_dtor(struct lines *lines)
+{
+    for (size_t l = 0; l < lines->nb; l++) free(lines->lines[l]);
+    free(lines->lines);
+    memset(lines, 0, sizeof(*lines));
+}
+
+// Parse the CSV output of groupby as simply as possible, with its quoting rules
+static int lines_of_csv(struct lines *lines, char const *csv, size_t len, char delimiter)
+{
+    struct buf line = { .len = 0 };
+    unsigned nb_fields = 0;     // in line
+    size_t i = 0;
+    while (i < len) {
+        if (nb_fields++ > 0) buf_append(&line, (char[]){ SEP }, 1);
+        if (csv[i] == '"') {
+            size_t const start = ++i;
+            while (i < len && ! (csv[i] == '"' && (i + 1 >= len || csv[i+1] != '"'))) i += csv[i] == '"' ? 2 : 1;
+            if (i >= len) goto err;
+            buf_append(&line, csv + start, i - start);
+            i ++;
+        } else {
+            size_t const start = i;
+            while (i < len && csv[i] != delimiter && csv[i] != '\n') i ++;
+            buf_append(&line, csv + start, i - start);
+        }
+        if (i >= len) goto err;
+        if (csv[i] == '\n') {
+            lines_add(lines, &line);
+            nb_fields = 0;
+        } else if (csv[i] != delimiter) goto err;
+        i ++;
+    }
+    if (nb_fields == 0) {
+        free(line.str);
+        return 0;
+    }
+err:
+    fprintf(stderr, "Cannot parse the output at byte %zu\n", i);
+    free(line.str);
+    return -1;
+}
+
+/*
+ * Naive aggregation
+ */
+
+static char *const *sorted_values;  // for row_cmp
+
+static int row_cmp(void const *a_, void const *b_)
+{
+    unsigned const a = *(unsigned const *)a_, b = *(unsigned const *)b_;
+    char *const *va = sorted_values + a * NB_FIELDS, *const *vb = sorted_values + b * NB_FIELDS;
+    int c = strcmp(va[0], vb[0]);
+    if (! c) c = strcmp(va[2], vb[2]);
+    if (! c) c = a < b ? -1 : a > b;    // stable, for first and last
+    return c;
+}
+
+static int str_ptr_cmp(void const *a_, void const *b_)
+{
+    char const *const *a = a_, *const *b = b_;
+    return strcmp(*a, *b);
+}
+
+static void aggregate(struct buf *line, char const *func, char *const *values, unsigned const *rows, unsigned nb, unsigned f)
+{
+    char str[32];
+    long long sum = 0, min = LLONG_MAX, max = LLONG_MIN, nonempty = 0, distinct = 0;
+    char const *smallest = values[rows[0] * NB_FIELDS + f], *greatest = smallest;
+    for (unsigned r = 0; r < nb; r++) {
+        char const *v = values[rows[r] * NB_FIELDS + f];
+        if (numeric_field[f]) {
+            long long const ll = strtoll(v, NULL, 0);
+            sum += ll;
+            if (ll < min) min = ll;
+            if (ll > max) max = ll;
+        }
+        if (strcmp(v, smallest) < 0) smallest = v;
+        if (strcmp(v, greatest) > 0) greatest = v;
+        if (v[0] != '\0') nonempty ++;
+    }
+    if (0 == strcmp(func, "count_distinct")) {
+        char const **sorted = xrealloc(NULL, nb * sizeof(*sorted));
+        for (unsigned r = 0; r < nb; r++) sorted[r] = values[rows[r] * NB_FIELDS + f];
+        qsort(sorted, nb, sizeof(*sorted), str_ptr_cmp);
+        for (unsigned r = 0; r < nb; r++) distinct += r == 0 || strcmp(sorted[r-1], sorted[r]);
+        free(sorted);
+    }
+    char const *res = str;
+    if (0 == strcmp(func, "sum")) snprintf(str, sizeof(str), "%lld", sum);
+    else if (0 == strcmp(func, "min")) snprintf(str, sizeof(str), "%lld", min);
+    else if (0 == strcmp(func, "max")) snprintf(str, sizeof(str), "%lld", max);
+    else if (0 == strcmp(func, "avg")) snprintf(str, sizeof(str), "%lld", (sum + nb/2) / (long long)nb);
+    else if (0 == strcmp(func, "first")) res = values[rows[0] * NB_FIELDS + f];
+    else if (0 == strcmp(func, "last")) res = values[rows[nb-1] * NB_FIELDS + f];
+    else if (0 == strcmp(func, "smallest")) res = smallest;
+    else if (0 == strcmp(func, "greatest")) res = greatest;
+    else if (0 == strcmp(func, "count")) snprintf(str, sizeof(str), "%u", nb);
+    else if (0 == strcmp(func, "count_nonempty")) snprintf(str, sizeof(str), "%lld", nonempty);
+    else if (0 == strcmp(func, "count_distinct")) snprintf(str, sizeof(str), "%lld", distinct);
+    else res = "";  // rem
+    buf_puts(line, res);
+}
+
+static void naive_groupby(struct lines *lines, struct input const *in, struct test_conf const *conf)
+{
+    unsigned *rows = xrealloc(NULL, in->nb_rows * sizeof(*rows));
+    unsigned nb_rows = 0;
+    for (unsigned r = 0; r < in->nb_rows; r++) {
+        char const *key = in->values[r * NB_FIELDS];
+        if (! conf->prefix || 0 == strncmp(key, conf->prefix, strlen(conf->prefix))) rows[nb_rows++] = r;
+    }
+    sorted_values = in->values;
+    if (nb_rows > 0) qsort(rows, nb_rows, sizeof(*rows), row_cmp);
+
+    struct buf line = { .len = 0 };
+    for (unsigned start = 0; start < nb_rows; ) {
+        char *const *first = in->values + rows[start] * NB_FIELDS;
+        unsigned stop = start + 1;
+        while (stop < nb_rows) {
+            char *const *other = in->values + rows[stop] * NB_FIELDS;
+            if (strcmp(first[0], other[0]) || strcmp(first[2], other[2])) break;
+            stop ++;
+        }
+        for (unsigned f = 0; f < NB_FIELDS; f++) {
+            if (f > 0) buf_append(&line, (char[]){ SEP }, 1);
+            if (! conf->funcs[f][0]) {
+                buf_puts(&line, first[f]);
+                continue;
+            }
+            for (unsigned a = 0; a < MAX_FUNCS && conf->funcs[f][a]; a++) {
+                if (a > 0) buf_append(&line, (char[]){ SEP }, 1);
+                aggregate(&line, conf->funcs[f][a], in->values, rows + start, stop - start, f);
+            }
+        }
+        lines_add(lines, &line);
+        start = stop;
+    }
+    free(line.str);
+    free(rows);
+    lines_sort(lines);
+}
+
+/*
+ * Runs of groupby
+ */
+
+static int write_all(FILE *file, struct buf const *b)
+{
+    rewind(file);
+    if (0 != ftruncate(fileno(file), 0) ||
+        (b->len > 0 && b->len != fwrite(b->str, 1, b->len, file)) ||
+        0 != fflush(file)) {
+        perror("Cannot write input");
+        return -1;
+    }
+    return 0;
+}
+
+static int read_all(struct buf *b, int fd)
+{
+    if (0 != lseek(fd, 0, SEEK_SET)) return -1;
+    char tmp[65536];
+    ssize_t r;
+    while ((r = read(fd, tmp, sizeof(tmp))) > 0) buf_append(b, tmp, r);
+    buf_append(b, "", 0);
+    return r < 0 ? -1 : 0;
+}
+
+static int feed(struct groupby *groupby, struct variant const *variant, struct input const *in, uint64_t *state)
+{
+    if (variant->feed == FEED_PUSH) {
+        // Cut anywhere, down to single bytes
+        for (size_t off = 0; off < in->csv.len; ) {
+            size_t len = rnd_below(state, 4) == 0 ? 1 : rnd_below(state, 100000);
+            if (len > in->csv.len - off) len = in->csv.len - off;
+            if (0 != groupby_push(groupby, in->csv.str + off, len)) return -1;
+            off += len;
+        }
+        return 0;
+    }
+    for (unsigned r = 0; r < in->nb_rows; r++) {
+        char const *const *fields = (char const *const *)in->values + r * NB_FIELDS;
+        size_t lens[NB_FIELDS];
+        for (unsigned f = 0; f < NB_FIELDS; f++) lens[f] = strlen(fields[f]);
+        if (0 != groupby_push_record(groupby, fields, lens, NB_FIELDS)) return -1;
+    }
+    return 0;
+}
+
+static int rewind_file(FILE *file, bool truncate)
+{
+    rewind(file);
+    if ((truncate && 0 != ftruncate(fileno(file), 0)) || 0 != lseek(fileno(file), 0, SEEK_SET)) {
+        perror("Cannot rewind");
+        return -1;
+    }
+    return 0;
+}
+
+// Turn groupby's binary output back into CSV, each group being a distinct row
+static int read_back(enum groupby_format format, char delimiter, FILE *binary, FILE *output)
+{
+    struct row_conf *row_conf = row_conf_new(NB_FIELDS);
+    if (! row_conf) return -1;
+    int err = row_conf_finalize(0, row_conf);
+    if (! err) err = do_groupby(row_conf, &(struct groupby_options){ .delimiter = delimiter, .input_format = format }, fileno(binary), fileno(output));
+    row_conf_del(row_conf);
+    return err;
+}
+
+static int run(struct row_conf const *row_conf, struct variant const *variant, struct input const *in, FILE *input, FILE *binary, FILE *output, uint64_t *state)
+{
+    struct groupby_options opts = variant->opts;
+    opts.delimiter = in->shape->delimiter;
+    // Binary outputs go to their own file, to be read back into the output
+    FILE *const first_output = opts.output_format == FORMAT_CSV ? output : binary;
+    if (0 != rewind_file(output, true) || 0 != rewind_file(binary, true) || 0 != rewind_file(input, false)) return -1;
+
+    int err;
+    if (variant->feed == FEED_READ) {
+        err = do_groupby(row_conf, &opts, fileno(input), fileno(first_output));
+    } else {
+        struct groupby *groupby = groupby_new(row_conf, &opts);
+        if (! groupby) return -1;
+        err = feed(groupby, variant, in, state);
+        if (! err) err = groupby_finish(groupby);
+        if (! err) err = groupby_write(groupby, fileno(first_output));
+        groupby_del(groupby);
+    }
+    if (! err && first_output != output) {
+        err = rewind_file(binary, false) || read_back(opts.output_format, opts.delimiter, binary, output) ? -1 : 0;
+    }
+    return err;
+}
+
+static void print_line(char const *line)
+{
+    for (char const *c = line; *c; c++) {
+        if (*c == SEP) fputs(" | ", stderr);
+        else if (*c == '\n') fputs("\\n", stderr);
+        else if (*c == '\t') fputs("\\t", stderr);
+        else fputc(*c, stderr);
+    }
+    fputc('\n', stderr);
+}
+
+static int compare(struct lines const *expected, struct lines const *actual)
+{
+    size_t l = 0;
+    while (l < expected->nb && l < actual->nb && 0 == strcmp(expected->lines[l], actual->lines[l])) l ++;
+    if (l == expected->nb && l == actual->nb) return 0;
+    fprintf(stderr, "%zu groups expected, %zu output, first difference:\n", expected->nb, actual->nb);
+    fputs("  expected: ", stderr);
+    if (l < expected->nb) print_line(expected->lines[l]);
+    else fputs("(none)\n", stderr);
+    fputs("  output:   ", stderr);
+    if (l < actual->nb) print_line(actual->lines[l]);
+    else fputs("(none)\n", stderr);
+    return -1;
+}
+
+static struct row_conf *row_conf_of_test(struct test_conf const *conf)
+{
+    struct row_conf *row_conf = row_conf_new(NB_FIELDS);
+    if (! row_conf) return NULL;
+    for (unsigned f = 0; f < NB_FIELDS; f++) {
+        struct buf spec = { .len = 0 };
+        for (unsigned a = 0; a < MAX_FUNCS && conf->funcs[f][a]; a++) {
+            char str[32];
+            snprintf(str, sizeof(str), "%s%u:%s", a > 0 ? "," : "", f + 1, conf->funcs[f][a]);
+            buf_puts(&spec, str);
+        }
+        int const err = spec.len > 0 ? row_conf_aggr(row_conf, spec.str) : 0;
+        free(spec.str);
+        if (err) {
+            row_conf_del(row_conf);
+            return NULL;
+        }
+    }
+    if (conf->prefix) {
+        char pred[32];
+        snprintf(pred, sizeof(pred), "1^=%s", conf->prefix);
+        if (0 != row_conf_where(row_conf, pred)) {
+            row_conf_del(row_conf);
+            return NULL;
+        }
+    }
+    if (0 != row_conf_finalize(NB_FIELDS, row_conf)) {
+        row_conf_del(row_conf);
+        return NULL;
+    }
+    return row_conf;
+}
+
+static int test_round(uint64_t seed, unsigned round, uint64_t *state)
+{
+    struct shape const *shape = shapes + round % SIZEOF_ARRAY(shapes);
+    struct input in;
+    input_ctor(&in, shape, state);
+    printf("Round %u: %u rows of up to %u keys, %zu bytes\n", round, in.nb_rows, shape->nb_keys * shape->nb_keys2, in.csv.len);
+
+    FILE *inputs[3] = { tmpfile(), tmpfile(), tmpfile() };  // for each input format
+    FILE *binary = tmpfile(), *output = tmpfile();
+    int err = 0;
+    if (! inputs[0] || ! inputs[1] || ! inputs[2] || ! binary || ! output) {
+        perror("tmpfile");
+        err = -1;
+    }
+    if (! err) err =
+        write_all(inputs[FORMAT_CSV], &in.csv) ||
+        write_all(inputs[FORMAT_ROWS], &in.rows) ||
+        write_all(inputs[FORMAT_COLUMNS], &in.columns) ? -1 : 0;
+
+    for (unsigned c = 0; ! err && c < SIZEOF_ARRAY(test_confs); c++) {
+        struct test_conf const *conf = test_confs + c;
+        struct lines expected = { .nb = 0 };
+        naive_groupby(&expected, &in, conf);
+        struct row_conf *row_conf = row_conf_of_test(conf);
+        if (! row_conf) err = -1;
+
+        for (unsigned v = 0; ! err && v < SIZEOF_ARRAY(variants); v++) {
+            struct variant const *variant = variants + v;
+            // These would only fall back to partitioned tables
+            if (conf->ordered && variant->opts.parallel == PARALLEL_SHARED) continue;
+            FILE *input = inputs[variant->opts.input_format];
+            struct lines actual = { .nb = 0 };
+            struct buf out = { .len = 0 };
+            err = run(row_conf, variant, &in, input, binary, output, state) ||
+                  read_all(&out, fileno(output)) ||
+                  lines_of_csv(&actual, out.str, out.len, shape->delimiter) ? -1 : 0;
+            if (! err) {
+                lines_sort(&actual);
+                err = compare(&expected, &actual);
+            }
+            if (err) fprintf(stderr, "FAILED: %s with the %s aggregates (seed %"PRIu64", round %u)\n", variant->name, conf->name, seed, round);
+            free(out.str);
+            lines_dtor(&actual);
+        }
+        if (row_conf) row_conf_del(row_conf);
+        lines_dtor(&expected);
+    }
+
+    if (err) {
+        char name[64];
+        snprintf(name, sizeof(name), "difftest-%"PRIu64"-%u.csv", seed, round);
+        FILE *keep = fopen(name, "w");
+        if (keep && in.csv.len == fwrite(in.csv.str, 1, in.csv.len, keep)) fprintf(stderr, "Input left in %s\n", name);
+        if (keep) fclose(keep);
+    }
+    for (unsigned i = 0; i < SIZEOF_ARRAY(inputs); i++) if (inputs[i]) fclose(inputs[i]);
+    if (binary) fclose(binary);
+    if (output) fclose(output);
+    input_dtor(&in);
+    return err;
+}
+
+int main(int nb_args, char **args)
+{
+    uint64_t const seed = nb_args > 1 ? strtoull(args[1], NULL, 0) : 1;
+    unsigned const nb_rounds = nb_args > 2 ? strtoul(args[2], NULL, 0) : SIZEOF_ARRAY(shapes);
+    uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    for (unsigned round = 0; round < nb_rounds; round++) {
+        if (0 != test_round(seed, round, &state)) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
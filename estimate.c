@@ -0,0 +1,200 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Estimation of the number of groups before the actual run (--estimate).
+ * A few slices spread over the input are parsed, keys are built and hashed as
+ * for the real run and counted with a HyperLogLog. Distinct keys are counted
+ * after half the slices and after all of them; how fast the count still grows
+ * tells how many more keys the rest of the input should bring, assuming the
+ * number of distinct keys grows like a power of the number of rows.
+ * Slices but the first start at the first record boundary past their start
+ * (see csv_resync), and only whole records are parsed, so that none spans two
+ * slices. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "groupby.h"
+
+#define NB_SLICES 16
+
+void hll_add(struct hll *hll, uint64_t hash)
+{
+    unsigned const idx = hash >> (64 - HLL_BITS);
+    uint64_t const rest = (hash << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+    uint8_t const rank = __builtin_clzll(rest) + 1;
+    if (rank > hll->reg[idx]) hll->reg[idx] = rank;
+}
+
+void hll_merge(struct hll *hll, struct hll const *other)
+{
+    for (unsigned i = 0; i < HLL_SIZE; i++) {
+        if (other->reg[i] > hll->reg[i]) hll->reg[i] = other->reg[i];
+    }
+}
+
+double hll_count(struct hll const *hll)
+{
+    double sum = 0.;
+    unsigned zeros = 0;
+    for (unsigned i = 0; i < HLL_SIZE; i++) {
+        sum += ldexp(1., -hll->reg[i]);
+        if (! hll->reg[i]) zeros ++;
+    }
+    double const m = HLL_SIZE;
+    double const est = 0.7213 / (1. + 1.079 / m) * m * m / sum;
+    // Linear counting is more accurate for small cardinalities
+    if (est <= 2.5 * m && zeros) return m * log(m / zeros);
+    return est;
+}
+
+struct sampler {
+    struct row_conf const *conf;
+    struct hasher const *hasher;
+    struct key_str key;
+    unsigned field_no;
+    bool filtered, error;
+    uint64_t nb_rows, key_bytes;
+    struct hll hll;
+};
+
+static void sample_field_cb(void *field, size_t field_len, void *sampler_)
+{
+    struct sampler *sampler = sampler_;
+    struct row_conf const *conf = sampler->conf;
+    if (sampler->filtered || sampler->error) return;
+
+    unsigned const f = sampler->field_no++;
+    if (f < conf->nb_fields) {
+        struct field_conf const *fc = conf->fields + f;
+        for (unsigned p = fc->first_pred; p < fc->first_pred + fc->nb_preds; p++) {
+            if (! pred_eval(conf->preds + p, field, field_len)) sampler->filtered = true;
+        }
+    }
+    if (row_conf_grouped(conf, f) && 0 != key_str_append(&sampler->key, field)) sampler->error = true;
+}
+
+// Forget the current record
+static void sampler_reset(struct sampler *sampler)
+{
+    sampler->key.len = 0;
+    sampler->field_no = 0;
+    sampler->filtered = sampler->error = false;
+}
+
+static void sample_record_cb(void *sampler_)
+{
+    struct sampler *sampler = sampler_;
+    if (! sampler->filtered && ! sampler->error && sampler->field_no >= sampler->conf->nb_pred_fields) {
+        sampler->nb_rows ++;
+        sampler->key_bytes += sampler->key.len;
+        hll_add(&sampler->hll, hasher_hash(sampler->hasher, sampler->key.str, sampler->key.len));
+    }
+    sampler_reset(sampler);
+}
+
+/* Parse the records from *start that end before stop, and set *start after
+ * the last one. Records are pushed one by one so that a malformed one (the
+ * slice may have started within quotes) is dropped alone, and silently: the
+ * actual run reports errors. Return how many bytes were parsed. */
+static size_t sample_records(struct csv *csv, struct sampler *sampler, char const **start, char const *stop)
+{
+    char const *const begin = *start;
+    char const *c = begin;
+    size_t len;
+    while (c < stop && 0 != (len = csv_record_end(SCAN_FIELD_START, c, stop - c, csv->delimiter))) {
+        if (0 != csv_push(csv, c, len, sample_field_cb, sample_record_cb)) {
+            csv_reset(csv);
+            sampler_reset(sampler);
+        }
+        c += len;
+    }
+    *start = c;
+    return c - begin;
+}
+
+void estimate_groups(struct estimate *est, struct row_conf const *conf, char delimiter, struct hasher const *hasher, char const *buf, size_t len, uint64_t input_size, size_t sample_size)
+{
+    memset(est, 0, sizeof(*est));
+    uint64_t const bytes_read = stats.bytes_read;   // sampled bytes are not read yet
+
+    struct sampler *sampler = calloc(1, sizeof(*sampler));
+    struct csv csv;
+    if (! sampler || 0 != csv_ctor(&csv, delimiter, NULL, sampler)) {
+        free(sampler);
+        return;
+    }
+    sampler->conf = conf;
+    sampler->hasher = hasher;
+    csv.quiet = true;
+
+    // Slices are spread over the buffer, unless it can be sampled whole
+    bool const whole = len <= sample_size;
+    unsigned const nb_slices = whole ? 2 : NB_SLICES;
+    size_t const step = len / nb_slices;
+    size_t sampled = 0;
+    double half_count = 0.;
+    char const *next = buf;
+    for (unsigned s = 0; s < nb_slices; s++) {
+        char const *stop;
+        if (whole) {
+            stop = s == nb_slices-1 ? buf + len : buf + (s+1) * step;
+        } else {
+            next = buf + s * step;
+            stop = next + sample_size / NB_SLICES;
+            // Slices that do not follow each other start anywhere in a record
+            if (s > 0) {
+                size_t const skip = csv_resync(next, stop - next, delimiter);
+                next = skip ? next + skip : stop;
+            }
+        }
+        sampled += sample_records(&csv, sampler, &next, stop);
+        if (s == nb_slices/2 - 1) half_count = hll_count(&sampler->hll);
+    }
+    if (whole && next < buf + len) {   // a last record without newline
+        if (0 == csv_push(&csv, next, buf + len - next, sample_field_cb, sample_record_cb) &&
+            0 == csv_push_end(&csv, sample_field_cb, sample_record_cb)) {
+            sampled += buf + len - next;
+        }
+    }
+    stats.bytes_read = bytes_read;
+    if (! sampled || ! sampler->nb_rows) goto quit;
+
+    double const count = hll_count(&sampler->hll);
+    est->sampled_rows = sampler->nb_rows;
+    if (! input_size || input_size <= sampled) {
+        est->nb_rows = sampler->nb_rows;
+        est->nb_groups = count;
+    } else {
+        est->nb_rows = (double)sampler->nb_rows * input_size / sampled;
+        double growth = half_count > 0. ? log2(count / half_count) : 1.;
+        if (growth < 0.) growth = 0.;
+        if (growth > 1.) growth = 1.;
+        double const groups = count * pow((double)est->nb_rows / sampler->nb_rows, growth);
+        est->nb_groups = groups < est->nb_rows ? groups : est->nb_rows;
+    }
+    if (est->nb_groups < 1) est->nb_groups = 1;
+
+    // What group_alloc and the table will use per group
+    size_t const key_len = sampler->key_bytes / sampler->nb_rows;
+    est->group_size = ((sizeof(struct group) + conf->aggr_tot_size + key_len + 7) & ~(size_t)7)
+                      + sizeof(struct group *) /* bucket */ + sizeof(struct group *) /* results */;
+    est->mem_size = est->nb_groups * est->group_size;
+
+    if (debug) {
+        fprintf(stderr, "Sampled %"PRIu64" rows out of %zu bytes: %.0f then %.0f distinct keys, projecting %"PRIu64" groups out of %"PRIu64" rows, %"PRIu64" bytes\n",
+                sampler->nb_rows, sampled, half_count, count, est->nb_groups, est->nb_rows, est->mem_size);
+    }
+quit:
+    csv_dtor(&csv);
+    free(sampler->key.str);
+    free(sampler);
+}
+
+uint64_t estimate_ram(void)
+{
+    long const pages = sysconf(_SC_PHYS_PAGES);
+    long const page_size = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page_size > 0 ? (uint64_t)pages * page_size : UINT64_MAX;
+}
@@ -0,0 +1,247 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* libFuzzer target for the CSV parser (make csv-fuzzer). The first byte of
+ * the input picks the delimiter and how the rest is cut: it is parsed once
+ * pulled by csv_parse from a reader giving it in pieces, and once pushed to
+ * csv_push in other pieces. Both must give the same fields and records, and
+ * fail alike. The same bytes are then parsed as binary rows and columns
+ * (--input-format), which must only fail on invalid ones.
+ * Built with -DFUZZ_STANDALONE (make check) it rather runs the target on
+ * the files given, or else on random mutations of a few tricky inputs. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "groupby.h"
+
+struct parsed {
+    uint64_t digest;    // of all fields and records, in order
+    unsigned nb_fields, nb_records;
+};
+
+static void digest(struct parsed *parsed, void const *data, size_t len)
+{
+    // FNV-1a
+    unsigned char const *c = data;
+    for (size_t i = 0; i < len; i++) parsed->digest = (parsed->digest ^ c[i]) * 0x100000001b3ULL;
+}
+
+static void field_cb(void *field, size_t len, void *parsed_)
+{
+    struct parsed *parsed = parsed_;
+    // Fields are given nul terminated
+    if (((char const *)field)[len] != '\0') abort();
+    digest(parsed, &len, sizeof(len));
+    digest(parsed, field, len);
+    parsed->nb_fields ++;
+}
+
+static void int_cb(long long value, void *parsed_)
+{
+    struct parsed *parsed = parsed_;
+    digest(parsed, &value, sizeof(value));
+    parsed->nb_fields ++;
+}
+
+static void record_cb(void *parsed_)
+{
+    struct parsed *parsed = parsed_;
+    digest(parsed, "\n", 1);
+    parsed->nb_records ++;
+}
+
+// What csv_parse reads from, given to the callbacks as well
+struct source {
+    struct parsed parsed;   // first, for them
+    uint8_t const *data;
+    size_t len, off;
+    unsigned cut;
+};
+
+static size_t piece_len(unsigned cut, size_t off)
+{
+    // From single bytes to whole buffers
+    return cut == 0 ? 1 : 1 + (off * 2654435761U >> (cut % 16)) % (1U << (cut % 16 + 1));
+}
+
+static ssize_t reader(void *dst, size_t dst_size, void *source_)
+{
+    struct source *src = source_;
+    size_t len = piece_len(src->cut, src->off);
+    if (len > dst_size) len = dst_size;
+    if (len > src->len - src->off) len = src->len - src->off;
+    memcpy(dst, src->data + src->off, len);
+    src->off += len;
+    return len;
+}
+
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t len);
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t len)
+{
+    if (len < 1) return 0;
+    static char const delimiters[] = ",;\t|";
+    char const delimiter = delimiters[data[0] & 3];
+    unsigned const cut = data[0] >> 2;
+    data ++;
+    len --;
+
+    struct source pulled = { .data = data, .len = len, .cut = cut };
+    struct csv csv;
+    if (0 != csv_ctor(&csv, delimiter, reader, &pulled)) return 0;
+    int const pull_err = csv_parse(&csv, field_cb, record_cb);
+    csv_dtor(&csv);
+
+    struct parsed pushed = { .digest = 0 };
+    if (0 != csv_ctor(&csv, delimiter, NULL, &pushed)) return 0;
+    int push_err = 0;
+    for (size_t off = 0; off < len && ! push_err; ) {
+        size_t l = piece_len(cut + 7, off);
+        if (l > len - off) l = len - off;
+        push_err = csv_push(&csv, data + off, l, field_cb, record_cb);
+        off += l;
+    }
+    if (! push_err) push_err = csv_push_end(&csv, field_cb, record_cb);
+    csv_dtor(&csv);
+
+    if (pull_err != push_err ||
+        pulled.parsed.digest != pushed.digest ||
+        pulled.parsed.nb_fields != pushed.nb_fields ||
+        pulled.parsed.nb_records != pushed.nb_records) {
+        fprintf(stderr, "Pulled and pushed parses differ: %d/%d errors, %u/%u fields, %u/%u records\n",
+                pull_err, push_err, pulled.parsed.nb_fields, pushed.nb_fields, pulled.parsed.nb_records, pushed.nb_records);
+        abort();
+    }
+
+    // Nothing to compare these with, but they must not read past the input
+    for (enum groupby_format format = FORMAT_ROWS; format <= FORMAT_COLUMNS; format++) {
+        struct source binary = { .data = data, .len = len, .cut = cut };
+        (void)binary_parse(format, reader, &binary, field_cb, int_cb, record_cb);
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+#define NB_MUTATIONS 10000
+#define MAX_INPUT 4096
+
+struct seed {
+    char const *data;
+    size_t len;
+    bool binary;    // mutated with any byte
+};
+
+#define SEED(str, binary) { str, sizeof(str) - 1, binary }
+
+static struct seed const seeds[] = {
+    SEED("1997,Ford,E350,2.34,\"Super, luxurious truck\"\n"
+         "2000,Mercury,Cougar,2.38,\"Not so \"\"super\"\"\"\n", false),
+    SEED("a,\"b\nc\",\"\"\n,,\n\"\"\"\",x\n", false),
+    SEED("key;1;\"multi\nline\n\";\"\"\"quoted\"\"\"\nkey;2;;\n", false),
+    SEED("\"unterminated,1\nx,2\n", false),
+    SEED("a,b\"c,d\n\"e\"f,g\n", false),
+    SEED("no newline at the end,\"\"", false),
+    // Two rows of an int64 and a string
+    SEED("\x20\0\0\0\x02\0\0\0\xff\xff\xff\xff\x02\0\0\0\x05\0\0\0\0\0\0\0ab\0\0\0\0\0\0"
+         "\x20\0\0\0\x02\0\0\0\xff\xff\xff\xff\x01\0\0\0\xfb\xff\xff\xff\xff\xff\xff\xff" "c\0\0\0\0\0\0\0", true),
+    // A batch of the same two rows as columns
+    SEED("GBYC\x02\0\0\0\x02\0\0\0\0\0\0\0"
+         "\x01\0\0\0\0\0\0\0\x10\0\0\0\0\0\0\0" "\0\0\0\0\0\0\0\0\x20\0\0\0\0\0\0\0"
+         "\x05\0\0\0\0\0\0\0\xfb\xff\xff\xff\xff\xff\xff\xff"
+         "\0\0\0\0\0\0\0\0\x03\0\0\0\0\0\0\0\x05\0\0\0\0\0\0\0ab\0c\0\0\0\0", true),
+    // 2^61 rows announced for an empty integer column
+    SEED("GBYC\x01\0\0\0\0\0\0\0\0\0\0\x20" "\x01\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", true),
+};
+
+// Run the target with stderr silenced, as most mutations are invalid CSV
+static void run_silently(uint8_t const *data, size_t len)
+{
+    fflush(stderr);
+    int const saved = dup(2);
+    int const null = open("/dev/null", O_WRONLY);
+    if (null >= 0) dup2(null, 2);
+    LLVMFuzzerTestOneInput(data, len);
+    if (saved >= 0) dup2(saved, 2);
+    if (null >= 0) close(null);
+    if (saved >= 0) close(saved);
+}
+
+static int run_file(char const *path)
+{
+    FILE *file = fopen(path, "r");
+    if (! file) {
+        perror(path);
+        return -1;
+    }
+    uint8_t *data = NULL;
+    size_t len = 0, size = 0;
+    while (! feof(file) && ! ferror(file)) {
+        if (len == size) {
+            size = size ? 2 * size : 65536;
+            uint8_t *d = realloc(data, size);
+            if (! d) break;
+            data = d;
+        }
+        len += fread(data + len, 1, size - len, file);
+    }
+    fclose(file);
+    LLVMFuzzerTestOneInput(data, len);
+    free(data);
+    return 0;
+}
+
+int main(int nb_args, char **args)
+{
+    if (nb_args > 1) {
+        for (int a = 1; a < nb_args; a++) {
+            if (0 != run_file(args[a])) return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    static char const bytes[] = "\",\n;\t|ab \r";
+    uint64_t state = 1;
+    uint8_t data[MAX_INPUT];
+    for (unsigned m = 0; m < NB_MUTATIONS; m++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t r = state >> 16;
+        struct seed const *seed = seeds + r % SIZEOF_ARRAY(seeds);
+        size_t len = seed->len;
+        data[0] = r >> 8;
+        memcpy(data + 1, seed->data, len);
+        len ++;
+        // A few random edits: replace, insert or delete a byte
+        unsigned const nb_edits = 1 + (r >> 16) % 8;
+        for (unsigned e = 0; e < nb_edits; e++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            r = state >> 16;
+            size_t const pos = 1 + (r % len);
+            char const c = seed->binary ? (char)(r >> 24) : bytes[(r >> 24) % (sizeof(bytes) - 1)];
+            switch ((r >> 32) % 3) {
+                case 0:
+                    if (pos < len) data[pos] = c;
+                    break;
+                case 1:
+                    if (len < MAX_INPUT) {
+                        memmove(data + pos + 1, data + pos, len - pos);
+                        data[pos] = c;
+                        len ++;
+                    }
+                    break;
+                case 2:
+                    if (pos < len) {
+                        memmove(data + pos, data + pos + 1, len - pos - 1);
+                        len --;
+                    }
+                    break;
+            }
+        }
+        run_silently(data, len);
+    }
+    printf("%u mutated inputs parsed alike pulled and pushed\n", NB_MUTATIONS);
+    return EXIT_SUCCESS;
+}
+
+#endif  /* FUZZ_STANDALONE */
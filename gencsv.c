@@ -0,0 +1,185 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Deterministic generator of synthetic CSV input for benchmarking.
+ * Field 1 is the key, all other fields are numeric values.
+ * The same parameters (and seed) always give the same bytes. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+static uint64_t rnd_state;
+
+static uint64_t rnd(void)   // splitmix64
+{
+    uint64_t z = (rnd_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double rnd_unit(void)
+{
+    return (rnd() >> 11) * (1. / 9007199254740992.);
+}
+
+// Cumulative distribution of key ranks, only used when skew > 0
+static double *zipf_cdf;
+
+static int zipf_init(unsigned long nb_keys, double skew)
+{
+    zipf_cdf = malloc(nb_keys * sizeof(*zipf_cdf));
+    if (! zipf_cdf) {
+        fprintf(stderr, "Cannot malloc zipf table for %lu keys\n", nb_keys);
+        return -1;
+    }
+    double sum = 0.;
+    for (unsigned long k = 0; k < nb_keys; k++) {
+        sum += 1. / pow(k+1, skew);
+        zipf_cdf[k] = sum;
+    }
+    for (unsigned long k = 0; k < nb_keys; k++) zipf_cdf[k] /= sum;
+    return 0;
+}
+
+static unsigned long pick_key(unsigned long nb_keys, double skew)
+{
+    if (skew <= 0.) return rnd() % nb_keys;
+
+    double const u = rnd_unit();
+    unsigned long lo = 0, hi = nb_keys-1;
+    while (lo < hi) {
+        unsigned long const mid = lo + (hi-lo)/2;
+        if (zipf_cdf[mid] < u) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static char const alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+#define ALPHABET_SIZE (sizeof(alphabet)-1)
+
+// How many keys of that width key_of_rank can make distinct (0 for no limit)
+static uint64_t max_keys_of_width(unsigned width)
+{
+    if (width >= 10) return 0;
+    uint64_t max = 1;
+    for (unsigned c = 0; c < width; c++) max *= ALPHABET_SIZE;
+    return max;
+}
+
+// Keys are scrambled so that the most frequent ones are not also the smallest
+static void key_of_rank(char *dst, unsigned width, unsigned long rank)
+{
+    if (width < 10) {
+        // Too short for the decimal rank: write it in base 36 instead, once
+        // multiplied modulo the number of keys by a constant prime to 36
+        uint64_t x = (rank * 9973ULL + 1) % max_keys_of_width(width);
+        for (unsigned c = 0; c < width; c++) {
+            dst[c] = alphabet[x % ALPHABET_SIZE];
+            x /= ALPHABET_SIZE;
+        }
+        dst[width] = '\0';
+        return;
+    }
+    uint64_t x = rank * 0x9e3779b97f4a7c15ULL + 1;
+    for (unsigned c = 0; c < width; c++) {
+        if (c > 0 && c % 12 == 0) x = x * 0xbf58476d1ce4e5b9ULL + rank;
+        dst[c] = alphabet[x % ALPHABET_SIZE];
+        x /= ALPHABET_SIZE;
+    }
+    // Make sure distinct ranks always give distinct keys
+    snprintf(dst + (width > 10 ? width-10 : 0), 11, "%010lu", rank);
+    dst[width] = '\0';
+}
+
+static void put_field(char const *str, bool first, double quote_ratio)
+{
+    if (! first) putchar(',');
+    if (quote_ratio > 0. && rnd_unit() < quote_ratio) {
+        printf("\"%s\"", str);
+    } else {
+        fputs(str, stdout);
+    }
+}
+
+static void syntax(void)
+{
+    printf("gencsv [-n rows] [-c columns] [-k key-cardinality] [-s zipf-skew] [-w key-width] [-W value-width] [-q quote-ratio] [-S seed]\n"
+           "\n"
+           "Writes rows to stdout; field 1 is the key, others are integers of value-width digits.\n"
+           "Keys shorter than 10 characters are limited to 36^key-width distinct keys.\n");
+}
+
+int main(int nb_args, char **args)
+{
+    unsigned long nb_rows = 1000000, nb_keys = 1000;
+    unsigned nb_cols = 4, key_width = 10, value_width = 6;
+    double skew = 0., quote_ratio = 0.;
+    rnd_state = 42;
+
+    for (int a = 1; a < nb_args; a++) {
+        if (strcasecmp(args[a], "-h") == 0 || strcasecmp(args[a], "--help") == 0) {
+            syntax();
+            return EXIT_SUCCESS;
+        } else if (a == nb_args-1) {
+            fprintf(stderr, "Missing value for '%s'\n", args[a]);
+            return EXIT_FAILURE;
+        } else if (strcmp(args[a], "-n") == 0) {
+            nb_rows = strtoul(args[++a], NULL, 0);
+        } else if (strcmp(args[a], "-c") == 0) {
+            nb_cols = strtoul(args[++a], NULL, 0);
+        } else if (strcmp(args[a], "-k") == 0) {
+            nb_keys = strtoul(args[++a], NULL, 0);
+        } else if (strcmp(args[a], "-s") == 0) {
+            skew = strtod(args[++a], NULL);
+        } else if (strcmp(args[a], "-w") == 0) {
+            key_width = strtoul(args[++a], NULL, 0);
+        } else if (strcmp(args[a], "-W") == 0) {
+            value_width = strtoul(args[++a], NULL, 0);
+        } else if (strcmp(args[a], "-q") == 0) {
+            quote_ratio = strtod(args[++a], NULL);
+        } else if (strcmp(args[a], "-S") == 0) {
+            rnd_state = strtoull(args[++a], NULL, 0);
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", args[a]);
+            syntax();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (nb_cols < 1 || nb_keys < 1 || key_width < 1 || key_width > 1000 || value_width < 1 || value_width > 18) {
+        fprintf(stderr, "Need at least one column and one key, key-width in 1..1000 and value-width in 1..18\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t const max_keys = max_keys_of_width(key_width);
+    if (max_keys && nb_keys > max_keys) {
+        fprintf(stderr, "Keys of %u characters cannot make %lu distinct keys (%"PRIu64" at most)\n", key_width, nb_keys, max_keys);
+        return EXIT_FAILURE;
+    }
+    if (skew > 0. && 0 != zipf_init(nb_keys, skew)) return EXIT_FAILURE;
+
+    unsigned long long value_mod = 1;
+    for (unsigned w = 0; w < value_width; w++) value_mod *= 10;
+
+    static char out_buf[1<<20];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+    char key[1001], value[24];
+    for (unsigned long r = 0; r < nb_rows; r++) {
+        key_of_rank(key, key_width, pick_key(nb_keys, skew));
+        put_field(key, true, quote_ratio);
+        for (unsigned c = 1; c < nb_cols; c++) {
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)(rnd() % value_mod));
+            put_field(value, false, quote_ratio);
+        }
+        putchar('\n');
+    }
+
+    free(zipf_cdf);
+    return fflush(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -4,33 +4,112 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include "groupby.h"
-#include "jhash.h"
 
-int groups_ctor(struct groups *groups)
+#define GROUPS_CHUNK_SIZE (1U<<20)
+#define GROUPS_MAX_CHUNK_SIZE (1U<<28)
+#define GROUPS_MAX_BUCKETS (1U<<30)
+
+static struct group_list *buckets_new(unsigned nb_buckets)
 {
-    for (unsigned h = 0; h < SIZEOF_ARRAY(groups->hash); h++) {
-        SLIST_INIT(groups->hash + h);
+    struct group_list *hash = big_alloc(nb_buckets * sizeof(*hash));
+    if (! hash) {
+        fprintf(stderr, "Cannot malloc %u buckets\n", nb_buckets);
+        return NULL;
+    }
+    STATS_ADD(alloc_bytes, nb_buckets * sizeof(*hash));
+    for (unsigned h = 0; h < nb_buckets; h++) {
+        SLIST_INIT(hash + h);
     }
+    return hash;
+}
+
+int groups_ctor(struct groups *groups, enum groupby_hash hash)
+{
+    hasher_ctor(&groups->hasher, hash);
+    if (debug) fprintf(stderr, "Hashing keys with %s\n", groups->hasher.name);
+    groups->nb_buckets = GROUP_HASH_SIZE;
+    groups->hash = buckets_new(groups->nb_buckets);
+    if (! groups->hash) return -1;
     groups->length = 0;
+    groups->nb_lookups = 0;
+    arena_ctor(&groups->mem, GROUPS_CHUNK_SIZE);
     return 0;
 }
 
-void groups_dtor(struct groups *groups)
+void groups_dtor(struct groups *groups, struct row_conf const *conf)
 {
-    (void)groups;
-    // free all groups ?
+    if (groups->hash && conf->aggr_dtors) {
+        for (unsigned h = 0; h < groups->nb_buckets; h++) {
+            struct group *group;
+            SLIST_FOREACH(group, groups->hash + h, entry) group_dtor(group, conf);
+        }
+    }
+    arena_dtor(&groups->mem);
+    big_free(groups->hash, groups->nb_buckets * sizeof(*groups->hash));
+    groups->hash = NULL;
 }
 
-void key_str_append(struct key_str *key, char const *v)
+// Move all groups into nb_buckets new buckets
+static int groups_rehash(struct groups *groups, unsigned nb_buckets, struct row_conf const *conf)
+{
+    struct group_list *hash = buckets_new(nb_buckets);
+    if (! hash) return -1;
+    if (debug) fprintf(stderr, "Rehashing %u groups into %u buckets\n", groups->length, nb_buckets);
+
+    for (unsigned h = 0; h < groups->nb_buckets; h++) {
+        struct group *group;
+        while (NULL != (group = SLIST_FIRST(groups->hash + h))) {
+            SLIST_REMOVE_HEAD(groups->hash + h, entry);
+            uint64_t const hash_ = hasher_hash(&groups->hasher, group_key_str(group, conf), group_key_len(group));
+            SLIST_INSERT_HEAD(hash + (hash_ & (nb_buckets - 1)), group, entry);
+        }
+    }
+    big_free(groups->hash, groups->nb_buckets * sizeof(*groups->hash));
+    groups->hash = hash;
+    groups->nb_buckets = nb_buckets;
+    return 0;
+}
+
+int groups_presize(struct groups *groups, uint64_t nb_groups, size_t group_size)
+{
+    assert(groups->length == 0);
+
+    unsigned nb_buckets = GROUP_HASH_SIZE;
+    while (nb_buckets < nb_groups && nb_buckets < GROUPS_MAX_BUCKETS) nb_buckets *= 2;
+    if (nb_buckets != groups->nb_buckets && 0 != groups_rehash(groups, nb_buckets, NULL)) return -1;   // no group to move yet
+
+    // A few large chunks rather than many small ones
+    uint64_t chunk_size = nb_groups * group_size;
+    if (chunk_size < GROUPS_CHUNK_SIZE) chunk_size = GROUPS_CHUNK_SIZE;
+    if (chunk_size > GROUPS_MAX_CHUNK_SIZE) chunk_size = GROUPS_MAX_CHUNK_SIZE;
+    groups->mem.chunk_size = chunk_size;
+
+    if (debug) fprintf(stderr, "Presized groups for %"PRIu64" groups: %u buckets, chunks of %"PRIu64" bytes\n", nb_groups, nb_buckets, chunk_size);
+    return 0;
+}
+
+int key_str_append(struct key_str *key, char const *v)
 {
     unsigned l = strlen(v);
+    if (key->len + l+1 > key->size) {
+        unsigned size = key->size ? key->size : 256;
+        while (size < key->len + l+1) size *= 2;
+        char *str = realloc(key->str, size);
+        if (! str) {
+            fprintf(stderr, "Cannot realloc key to %u bytes\n", size);
+            return -1;
+        }
+        key->str = str;
+        key->size = size;
+    }
     memcpy(key->str+key->len, v, l+1);
     key->len += l+1;
-    assert(key->len < MAX_RECORD_LENGTH);
+    return 0;
 }
 
-unsigned key_str_extract(struct key_str const *key, char const *res[NB_MAX_FIELDS])
+unsigned key_str_extract(struct key_str const *key, char const **res)
 {
     unsigned r = 0;
     unsigned len = key->len;
@@ -49,70 +128,207 @@ bool key_str_eq(struct key_str const *a, struct key_str const *b)
     return a->len == b->len && 0 == memcmp(a->str, b->str, a->len);
 }
 
-static struct group *group_new(struct groups *groups, struct key_str *key, struct row_conf const *conf, unsigned h)
+struct group *group_alloc(struct arena *arena, struct key_str const *key, struct row_conf const *conf, unsigned nb_values)
 {
     if (debug) fprintf(stderr, "Building new group for key of len %u\n", key->len);
+    if (key->len & GROUP_WIDTH) {
+        fprintf(stderr, "Key of %u bytes is too long\n", key->len);
+        return NULL;
+    }
 
+    bool const short_row = nb_values < conf->nb_fields;
     struct group *group;
-    size_t const size = sizeof(*group) + conf->aggr_tot_size;
-    group = malloc(size);
-    if (! group) {
-        fprintf(stderr, "Cannot malloc %zu bytes for a group\n", size);
-        goto err1;
+    group = arena_alloc(arena, sizeof(*group) + conf->aggr_tot_size + (short_row ? sizeof(uint32_t) : 0) + key->len);
+    if (! group) return NULL;
+
+    group->key_len = key->len | (short_row ? GROUP_WIDTH : 0);
+    if (short_row) *group_width(group, conf) = nb_values;
+    memcpy(group_key_str(group, conf), key->str, key->len);
+    STATS_ADD(groups, 1);
+
+    group->tag = 0;
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        conf->aggrs[a].func->ops.ctor(group->values + conf->aggr_cumul_size[a]);
     }
 
-    group->grouped_values.len = key->len;
-    group->grouped_values.str = malloc(key->len);
-    if (! group->grouped_values.str) {
-        fprintf(stderr, "Cannot malloc for key of length %u\n", key->len);
-        goto err2;
+    return group;
+}
+
+int group_fold(struct group *group, struct row_conf const *conf, char const *const *values, long long const *ints, unsigned nb_values)
+{
+    int err = 0;
+    if (conf->kernel.name && nb_values >= conf->kernel.nb_fields) {
+        conf->kernel.fold(&conf->kernel, group->values, values, ints);
+        goto done;
     }
-    memcpy(group->grouped_values.str, key->str, key->len);
+    // Fields past the configured ones are all grouped
+    unsigned const nb_folded = nb_values < conf->nb_fields ? nb_values : conf->nb_fields;
+    for (unsigned f = 0; f < nb_folded; f++) {
+        struct field_conf const *field = conf->fields + f;
+        if (! field->nb_aggrs) continue;
+        // aggregate this value
+        unsigned const a = field->first_aggr;
+        if (field->nb_aggrs == 1) {
+            if (values[f]) {
+                if (0 != conf->aggrs[a].func->ops.fold(group->values + conf->aggr_cumul_size[a], values[f])) err = -1;
+            } else {
+                conf->aggrs[a].func->ops.fold_ll(group->values + conf->aggr_cumul_size[a], ints[f]);
+            }
+            continue;
+        }
+        // Several aggregates of the same value: convert it only once
+        bool converted = false;
+        long long ll = 0;
+        for (unsigned i = a; i < a + field->nb_aggrs; i++) {
+            struct aggr_ops const *ops = &conf->aggrs[i].func->ops;
+            if (ops->fold_row) {
+                ops->fold_row(group->values + conf->aggr_cumul_size[i]);
+            } else if (ops->fold_ll) {
+                if (! converted) {
+                    ll = field_ll(values, ints, f);
+                    converted = true;
+                }
+                ops->fold_ll(group->values + conf->aggr_cumul_size[i], ll);
+            } else if (0 != ops->fold(group->values + conf->aggr_cumul_size[i], values[f])) {
+                err = -1;
+            }
+        }
+    }
+done:
+    group_widen(group, conf, nb_values);
+    return err;
+}
+
+unsigned group_nb_fields(struct group const *group, struct row_conf const *conf)
+{
+    uint32_t const *width = group_width(group, conf);
+    if (width) return *width;
+    // Count the grouped values past the configured fields
+    char const *key = group_key_str(group, conf);
+    unsigned nb_values = 0;
+    for (char const *c = key; c < key + group_key_len(group); c = rawmemchr(c, '\0') + 1) nb_values ++;
+    return conf->nb_fields + nb_values - conf->nb_grouped_fields;
+}
+
+void group_dtor(struct group *group, struct row_conf const *conf)
+{
+    if (! conf->aggr_dtors) return;
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        void (*dtor)(void *) = conf->aggrs[a].func->ops.dtor;
+        if (dtor) dtor(group->values + conf->aggr_cumul_size[a]);
+    }
+}
+
+int group_merge(struct group *group, struct group const *other, struct row_conf const *conf)
+{
+    int err = 0;
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        size_t const offset = conf->aggr_cumul_size[a];
+        if (0 != conf->aggrs[a].func->ops.merge(group->values + offset, other->values + offset)) err = -1;
+    }
+    if (group_width(group, conf)) group_widen(group, conf, group_nb_fields(other, conf));
+    return err;
+}
 
-    group->nb_fields = 0;  // will be incremented when we actually see the fields
-    for (unsigned f = 0; f < conf->nb_fields; f++) {
-        if (! conf->fields[f]) continue;
-        conf->fields[f]->ops.ctor(group->values + conf->aggr_cumul_size[f]);
+int group_fold_shared(struct group *group, struct row_conf const *conf, char const *const *values, unsigned nb_values, pthread_mutex_t *lock)
+{
+    int err = 0;
+    unsigned const nb_folded = nb_values < conf->nb_fields ? nb_values : conf->nb_fields;
+    bool locked = false;
+    for (unsigned f = 0; f < nb_folded; f++) {
+        struct field_conf const *field = conf->fields + f;
+        bool converted = false;
+        long long ll = 0;
+        for (unsigned a = field->first_aggr; a < field->first_aggr + field->nb_aggrs; a++) {
+            struct aggr_ops const *ops = &conf->aggrs[a].func->ops;
+            if (ops->fold_atomic) {
+                if (! converted && ! ops->fold_row) {
+                    ll = ll_of_str(values[f]);
+                    converted = true;
+                }
+                ops->fold_atomic(group->values + conf->aggr_cumul_size[a], ll);
+            } else {
+                if (! locked) {
+                    pthread_mutex_lock(lock);
+                    locked = true;
+                }
+                if (0 != ops->fold(group->values + conf->aggr_cumul_size[a], values[f])) err = -1;
+            }
+        }
     }
+    if (locked) pthread_mutex_unlock(lock);
+
+    uint32_t *width = group_width(group, conf);
+    if (! width) return err;
+    uint32_t nb_fields = __atomic_load_n(width, __ATOMIC_RELAXED);
+    while (nb_values > nb_fields && ! __atomic_compare_exchange_n(width, &nb_fields, nb_values, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+    return err;
+}
 
+static void groups_link(struct groups *groups, struct group *group, unsigned h, struct row_conf const *conf)
+{
     SLIST_INSERT_HEAD(groups->hash + h, group, entry);
     groups->length ++;
     if (debug && 0 == (groups->length & 0xfff)) {
         fprintf(stderr, "%u groups\n", groups->length);
     }
 
-    return group;
+    // Keep chains short; if that fails they just get longer
+    if (groups->length > groups->nb_buckets && groups->nb_buckets < GROUPS_MAX_BUCKETS) {
+        STATS_ADD(rehashes, 1);
+        (void)groups_rehash(groups, 2 * groups->nb_buckets, conf);
+    }
+}
 
-err2:
-    free(group);
-err1:
-    return NULL;
+static struct group *group_new(struct groups *groups, struct key_str const *key, struct row_conf const *conf, unsigned nb_values, unsigned h, uint32_t tag)
+{
+    struct group *group = group_alloc(&groups->mem, key, conf, nb_values);
+    if (! group) return NULL;
+    group->tag = tag;
+    groups_link(groups, group, h, conf);
+    return group;
 }
 
-static unsigned hash_values(char const *value, unsigned len, unsigned hash_size)
+void groups_insert(struct groups *groups, struct group *group, struct row_conf const *conf)
 {
-    return hashlittle(value, len, 0x12345678) % hash_size;
+    uint64_t const hash = hasher_hash(&groups->hasher, group_key_str(group, conf), group_key_len(group));
+    group->tag = hash >> 32;
+    groups_link(groups, group, hash & (groups->nb_buckets - 1), conf);
 }
 
-struct group *group_find_or_create(struct groups *groups, struct key_str *key, struct row_conf const *conf)
+struct group *group_find_or_create(struct groups *groups, struct key_str const *key, struct row_conf const *conf, unsigned nb_values)
 {
-    unsigned h = hash_values(key->str, key->len, SIZEOF_ARRAY(groups->hash));
+    uint64_t const hash = hasher_hash(&groups->hasher, key->str, key->len);
+    unsigned const h = hash & (groups->nb_buckets - 1);
+    uint32_t const tag = hash >> 32;
+    groups->nb_lookups ++;
 
     struct group *group;
     SLIST_FOREACH(group, groups->hash + h, entry) {
-        if (key_str_eq(&group->grouped_values, key)) break;
+        if (group->tag == tag && group_key_eq(group, key, conf)) break;
     }
 
     if (! group) {
-        group = group_new(groups, key, conf, h);
+        group = group_new(groups, key, conf, nb_values, h, tag);
     }
 
     return group;
 }
 
+struct group *group_find(struct groups *groups, struct key_str const *key, struct row_conf const *conf)
+{
+    uint64_t const hash = hasher_hash(&groups->hasher, key->str, key->len);
+    uint32_t const tag = hash >> 32;
+    struct group *group;
+    SLIST_FOREACH(group, groups->hash + (hash & (groups->nb_buckets - 1)), entry) {
+        if (group->tag == tag && group_key_eq(group, key, conf)) return group;
+    }
+    return NULL;
+}
+
 void groups_foreach(struct groups *groups, void (*cb)(struct group *, void *), void *data)
 {
-    for (unsigned h = 0; h < SIZEOF_ARRAY(groups->hash); h++) {
+    for (unsigned h = 0; h < groups->nb_buckets; h++) {
         struct group *group;
         SLIST_FOREACH(group, groups->hash + h, entry) {
             cb(group, data);
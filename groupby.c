@@ -5,181 +5,933 @@
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "groupby.h"
 
-struct row_conf *row_conf_new(unsigned nb_fields_max)
+struct spill;
+
+/* The groups of the last rows, most recent first, that a row is compared to
+ * field by field before its key is even built: inputs where runs of rows
+ * share their key find their group with no copy, hash nor bucket walk. It is
+ * skipped while the rows of the last window seldom hit it; the groups the
+ * table finds meanwhile still go there, telling when rows would hit again. */
+#define MRU_SIZE 4
+#define MRU_WINDOW (1U<<16)     // rows looked up before deciding again whether to use it
+#define MRU_MIN_HITS (MRU_WINDOW / 16)
+
+struct mru {
+    bool on;    // rows are compared to its groups first
+    unsigned nb_groups;
+    struct group *groups[MRU_SIZE];
+    uint64_t lookups, hits;
+};
+
+struct groupby {
+    struct row_conf const *conf;
+    struct groupby_options opts;
+    unsigned field_no, record_no;
+    bool error;     // set by the parser callbacks
+    bool filtered;  // current record failed a predicate
+    bool finished;
+    int input;      // for groupby_read
+    struct csv csv;
+    struct groups groups;   // for ENGINE_HASH
+    struct groups *parts;   // or these, from parallel_read
+    unsigned nb_parts;
+    struct shared_groups *shared;   // folding first into that table, if set
+    struct bypass *bypass;  // sending rows to the thread merging their key, if set
+    struct readahead *readahead;    // for groupby_read, if set
+    struct dense *dense;    // folding in batches while there are few groups, if set
+    struct mru mru;         // for ENGINE_HASH without a shared table, once dense is over
+    struct sorter sorter;   // for ENGINE_SORT
+    struct key_str key;     // where keys are built
+    char *record_buf;       // copy of the fields given to groupby_push_record
+    size_t record_buf_size;
+    struct group **results; // once finished
+    size_t nb_results;
+    struct estimate estimate;   // from groupby_estimate
+    char *prefix;           // input read by groupby_estimate, not parsed yet
+    size_t prefix_len, prefix_off;
+    struct spill *spill;    // while partitioning the input
+    char const **values;    // fields of the current record
+    long long *ints;        // where values are NULL, the integers given by a binary input
+    char (*int_strs)[AGGR_STR_SIZE];    // or those integers as text, for fields that need it
+    unsigned values_size;   // room in values (and ints and int_strs if set)
+};
+
+static ssize_t reader(void *dst, size_t dst_size, void *groupby_)
+{
+    struct groupby *groupby = groupby_;
+    if (groupby->prefix_off < groupby->prefix_len) {
+        size_t const rem = groupby->prefix_len - groupby->prefix_off;
+        size_t const sz = rem < dst_size ? rem : dst_size;
+        memcpy(dst, groupby->prefix + groupby->prefix_off, sz);
+        groupby->prefix_off += sz;
+        return sz;
+    }
+    if (groupby->readahead) return readahead_read(groupby->readahead, dst, dst_size);
+    ssize_t const r = read(groupby->input, dst, dst_size);
+    if (r < 0) perror("read");
+    return r;
+}
+
+struct groupby *groupby_new(struct row_conf const *conf, struct groupby_options const *opts)
 {
-    struct row_conf *conf;
-    size_t const size = sizeof(*conf) + nb_fields_max * sizeof(conf->fields[0]);
-    conf = malloc(size);
-    if (! conf) {
-        fprintf(stderr, "Cannot malloc %zu bytes for row conf\n", size);
-        return NULL;
+    struct groupby *groupby = malloc(sizeof(*groupby));
+    if (! groupby) {
+        fprintf(stderr, "Cannot alloc %zu bytes for parse state\n", sizeof(*groupby));
+        goto err0;
     }
+    STATS_ADD(alloc_bytes, sizeof(*groupby));
+
+    groupby->conf = conf;
+    groupby->opts = *opts;
+    groupby->field_no = groupby->record_no = 0;
+    groupby->error = groupby->finished = groupby->filtered = false;
+    groupby->input = -1;
+    groupby->record_buf = NULL;
+    groupby->record_buf_size = 0;
+    groupby->results = NULL;
+    groupby->nb_results = 0;
+    memset(&groupby->estimate, 0, sizeof(groupby->estimate));
+    groupby->prefix = NULL;
+    groupby->prefix_len = groupby->prefix_off = 0;
+    groupby->spill = NULL;
+    groupby->parts = NULL;
+    groupby->nb_parts = 0;
+    groupby->shared = NULL;
+    groupby->bypass = NULL;
+    groupby->readahead = NULL;
+    groupby->mru = (struct mru){ .on = opts->engine == ENGINE_HASH, .nb_groups = 0 };
 
-    conf->nb_fields = nb_fields_max;
-    conf->nb_aggr_fields = 0;
-    conf->aggr_tot_size = 0;
-    for (unsigned f = 0; f < conf->nb_fields; f++) {
-        conf->fields[f] = NULL;
+    // Both grow with the records
+    groupby->key.len = groupby->key.size = 0;
+    groupby->key.str = NULL;
+    groupby->ints = NULL;
+    groupby->int_strs = NULL;
+    groupby->values_size = conf->nb_fields < 16 ? 16 : conf->nb_fields;
+    groupby->values = malloc(groupby->values_size * sizeof(*groupby->values));
+    if (! groupby->values) {
+        fprintf(stderr, "Cannot alloc %u values\n", groupby->values_size);
+        goto err1;
+    }
+    if (0 != csv_ctor(&groupby->csv, opts->delimiter, reader, groupby)) {
+        goto err2;
     }
+    if (0 != groups_ctor(&groupby->groups, opts->hash)) goto err3;
+    sorter_ctor(&groupby->sorter);
+    groupby->dense = opts->engine == ENGINE_HASH && ! opts->no_dense ? dense_new(conf, &groupby->groups) : NULL;
+    dict_ref();
 
-    return conf;
+    return groupby;
+err3:
+    csv_dtor(&groupby->csv);
+err2:
+    free(groupby->values);
+err1:
+    free(groupby);
+err0:
+    return NULL;
 }
 
-void row_conf_finalize(unsigned nb_max_fields, struct row_conf *conf)
+void groupby_del(struct groupby *groupby)
 {
-    conf->nb_fields = nb_max_fields;
-    for (unsigned f = 0; f < conf->nb_fields; f++) {
-        if (! conf->fields[f]) continue;
-        conf->nb_aggr_fields ++;
-        conf->aggr_cumul_size[f] = conf->aggr_tot_size;
-        conf->aggr_tot_size += conf->fields[f]->ops.size();
+    groups_dtor(&groupby->groups, groupby->conf);
+    for (unsigned p = 0; p < groupby->nb_parts; p++) groups_dtor(groupby->parts + p, groupby->conf);
+    free(groupby->parts);
+    // The sort engine allocated its results; the others point into the tables
+    if (groupby->opts.engine == ENGINE_SORT) {
+        for (size_t r = 0; r < groupby->nb_results; r++) group_dtor(groupby->results[r], groupby->conf);
     }
+    sorter_dtor(&groupby->sorter);
+    csv_dtor(&groupby->csv);
+    free(groupby->key.str);
+    free(groupby->values);
+    free(groupby->ints);
+    free(groupby->int_strs);
+    free(groupby->record_buf);
+    free(groupby->results);
+    free(groupby->prefix);
+    if (groupby->readahead) (void)readahead_del(groupby->readahead);  // after an error, already reported
+    if (groupby->dense) dense_del(groupby->dense);
+    free(groupby);
+    dict_unref();
 }
 
-static struct state {
-    struct row_conf const *conf;
-    unsigned field_no, record_no;
-    int input, output;
-    struct groups groups;
-    char delimiter;
-    char const *values[];    // as many values as conf->nb_fields
-} *state;
+// Make room for the value of the current field
+static int values_reserve(struct groupby *groupby)
+{
+    if (groupby->field_no < groupby->values_size) return 0;
+    unsigned const size = 2 * groupby->values_size;
+    char const **values = realloc(groupby->values, size * sizeof(*values));
+    if (values) groupby->values = values;
+    long long *ints = groupby->ints ? realloc(groupby->ints, size * sizeof(*ints)) : NULL;
+    if (ints) groupby->ints = ints;
+    char (*int_strs)[AGGR_STR_SIZE] = groupby->int_strs ? realloc(groupby->int_strs, size * sizeof(*int_strs)) : NULL;
+    if (int_strs) groupby->int_strs = int_strs;
+    if (! values || (groupby->ints && ! ints) || (groupby->int_strs && ! int_strs)) {
+        if (! groupby->error) fprintf(stderr, "Cannot realloc %u values\n", size);
+        groupby->error = true;
+        return -1;
+    }
+    groupby->values_size = size;
+    return 0;
+}
 
-static struct state *state_new(struct row_conf const *conf, int input, int output, char delimiter)
+static void field_cb(void *field, size_t field_len, void *groupby_)
 {
-    struct state *state;
-    size_t size = sizeof(*state) + conf->nb_fields * sizeof(state->values[0]);
-    state = malloc(size);
-    if (! state) {
-        fprintf(stderr, "Cannot alloc %zu bytes for parse state\n", size);
-        return NULL;
+    if (debug) fprintf(stderr, "got field '%s'\n", (char *)field);
+    struct groupby *groupby = groupby_;
+
+    struct row_conf const *conf = groupby->conf;
+    if (groupby->field_no >= conf->max_fields) {
+        if (! groupby->error) fprintf(stderr, "More than %u fields (see -m)\n", conf->max_fields);
+        groupby->error = true;
+        return;
     }
+    if (0 != values_reserve(groupby)) return;
 
-    state->conf = conf;
-    state->input = input;
-    state->output = output;
-    state->delimiter = delimiter;
-    state->field_no = state->record_no = 0;
-    if (0 != groups_ctor(&state->groups)) {
-        free(state);
-        return NULL;
+    groupby->values[groupby->field_no] = field;
+    if (groupby->field_no >= conf->nb_fields) goto next;
+
+    // Check predicates right away, so that the rest of the record can be skipped
+    struct field_conf const *fc = conf->fields + groupby->field_no;
+    for (unsigned p = fc->first_pred; p < fc->first_pred + fc->nb_preds; p++) {
+        if (! pred_eval(conf->preds + p, field, field_len)) {
+            groupby->filtered = true;
+            groupby->csv.skip_record = true;
+            break;
+        }
     }
+next:
+    groupby->field_no ++;
+}
 
-    return state;
+static void int_cb(long long value, void *groupby_)
+{
+    struct groupby *groupby = groupby_;
+    struct row_conf const *conf = groupby->conf;
+    unsigned const f = groupby->field_no;
+    if (0 != values_reserve(groupby)) return;
+
+    // The sort engine and the shared table only fold text
+    if (f < conf->nb_fields && conf->fields[f].integers && groupby->opts.engine == ENGINE_HASH && ! groupby->shared) {
+        groupby->values[f] = NULL;
+        groupby->ints[f] = value;
+        groupby->field_no ++;
+        return;
+    }
+    int const len = snprintf(groupby->int_strs[f], AGGR_STR_SIZE, "%lld", value);
+    field_cb(groupby->int_strs[f], len, groupby);
 }
 
-static void state_del(struct state *state)
+static struct key_str *build_key(struct groupby *groupby)
 {
-    groups_ctor(&state->groups);
-    free(state);
+    struct key_str *key = &groupby->key;
+    key->len = 0;
+
+    STATS_START(STATS_KEY);
+    for (unsigned f = 0; f < groupby->field_no; f++) {
+        if (! row_conf_grouped(groupby->conf, f)) continue;
+        if (0 != key_str_append(key, groupby->values[f])) {
+            key = NULL;
+            break;
+        }
+    }
+    STATS_STOP(STATS_KEY);
+    return key;
 }
 
-static void field_cb(void *field, size_t field_len, void *state_)
+// Whether the grouped fields of the current record are the key of that group
+static bool mru_match(struct groupby const *groupby, struct group const *group)
 {
-    if (debug) fprintf(stderr, "got field '%s'\n", (char *)field);
-    (void)field_len;
-    struct state *state = state_;
+    struct row_conf const *conf = groupby->conf;
+    char const *k = group_key_str(group, conf);
+    char const *const end = k + group_key_len(group);
+    for (unsigned f = 0; f < groupby->field_no; f++) {
+        if (! row_conf_grouped(conf, f)) continue;
+        size_t const len = strlen(groupby->values[f]) + 1;
+        if ((size_t)(end - k) < len || 0 != memcmp(k, groupby->values[f], len)) return false;
+        k += len;
+    }
+    return k == end;
+}
 
-    if (state->field_no >= state->conf->nb_fields) {
-        fprintf(stderr, "More than %u records\n", state->conf->nb_fields);
-        exit(EXIT_FAILURE);
+// Count a row that hit the last groups or not, and decide again at the end of each window
+static void mru_count(struct mru *mru, bool hit)
+{
+    mru->hits += hit;
+    if (++ mru->lookups < MRU_WINDOW) return;
+    bool const on = mru->hits >= MRU_MIN_HITS;
+    if (debug && on != mru->on) {
+        fprintf(stderr, "%"PRIu64" rows of %u hit the last groups, %s\n", mru->hits, MRU_WINDOW,
+                on ? "comparing the next ones to them first" : "looking up the next ones");
+    }
+    mru->on = on;
+    mru->lookups = mru->hits = 0;
+}
+
+static struct group *mru_find(struct groupby *groupby)
+{
+    struct mru *mru = &groupby->mru;
+    STATS_ADD(mru_lookups, 1);
+    for (unsigned i = 0; i < mru->nb_groups; i++) {
+        struct group *group = mru->groups[i];
+        if (! mru_match(groupby, group)) continue;
+        // Move it first
+        for (; i > 0; i--) mru->groups[i] = mru->groups[i-1];
+        mru->groups[0] = group;
+        STATS_ADD(mru_hits, 1);
+        mru_count(mru, true);
+        return group;
     }
+    mru_count(mru, false);
+    return NULL;
+}
 
-    state->values[state->field_no] = field;
+// Make that group, found in the table, the first; count the row if mru_find did not
+static void mru_add(struct mru *mru, struct group *group, bool count)
+{
+    unsigned i = 0;
+    while (i < mru->nb_groups && mru->groups[i] != group) i++;
+    if (count) mru_count(mru, i < mru->nb_groups);
+    if (i == mru->nb_groups && mru->nb_groups < MRU_SIZE) mru->nb_groups ++;
+    if (i == MRU_SIZE) i --;
+    for (; i > 0; i--) mru->groups[i] = mru->groups[i-1];
+    mru->groups[0] = group;
+}
 
-    state->field_no ++;
+// Once all rows are in, fold what the batches accumulated
+static void groupby_end_dense(struct groupby *groupby)
+{
+    if (! groupby->dense) return;
+    STATS_START(STATS_FOLD);
+    dense_flush(groupby->dense);
+    STATS_STOP(STATS_FOLD);
+    dense_del(groupby->dense);
+    groupby->dense = NULL;
 }
 
-static void record_cb(void *state_)
+static void record_cb(void *groupby_)
 {
-    struct state *state = state_;
+    struct groupby *groupby = groupby_;
+    if (groupby->error) goto next;
+    if (groupby->filtered || groupby->field_no < groupby->conf->nb_pred_fields) {
+        STATS_ADD(filtered, 1);
+        goto next;
+    }
+
+    bool const use_mru = groupby->opts.engine == ENGINE_HASH && ! groupby->dense && ! groupby->shared;
+    bool const mru_on = use_mru && groupby->mru.on;
+    if (mru_on) {
+        STATS_START(STATS_LOOKUP);
+        struct group *group = mru_find(groupby);
+        STATS_STOP(STATS_LOOKUP);
+        if (group) {
+            groupby->groups.nb_lookups ++;  // as far as the bypass is concerned
+            STATS_START(STATS_FOLD);
+            if (0 != group_fold(group, groupby->conf, groupby->values, groupby->ints, groupby->field_no)) groupby->error = true;
+            STATS_STOP(STATS_FOLD);
+            goto next;
+        }
+    }
+
+    struct key_str *key = build_key(groupby);
+    if (! key) {
+        groupby->error = true;
+        goto next;
+    }
+
+    if (groupby->opts.engine == ENGINE_SORT) {
+        // Groups will be built once all rows are in
+        if (0 != sorter_add(&groupby->sorter, key, groupby->values, groupby->field_no, groupby->conf)) {
+            groupby->error = true;
+        }
+        goto next;
+    }
 
-    static char key_buf[MAX_RECORD_LENGTH];
-    struct key_str key = { .str = key_buf, .len = 0 };
+    if (groupby->shared) {
+        // Keys that do not fit in the shared table go to our own
+        STATS_START(STATS_LOOKUP);
+        int const ret = shared_fold(groupby->shared, key, groupby->conf, groupby->values, groupby->field_no);
+        STATS_STOP(STATS_LOOKUP);
+        if (ret < 0) groupby->error = true;
+        if (ret != 0) goto next;
+    }
+
+    if (groupby->dense) {
+        STATS_START(STATS_FOLD);
+        int const ret = dense_fold(groupby->dense, key, groupby->values, groupby->ints, groupby->field_no);
+        STATS_STOP(STATS_FOLD);
+        if (ret < 0) groupby->error = true;
+        if (ret <= 0) goto next;
+        // Too many groups: fold one by one from now on
+        dense_del(groupby->dense);
+        groupby->dense = NULL;
+    }
 
-    for (unsigned f = 0; f < state->field_no; f++) {
-        if (state->conf->fields[f]) continue;
-        key_str_append(&key, state->values[f]);
+    if (groupby->bypass) {
+        // Rows that our table would not reduce are merged only once
+        unsigned const length = groupby->groups.length;
+        STATS_START(STATS_LOOKUP);
+        int const ret = bypass_fold(groupby->bypass, key, groupby->conf, groupby->values, groupby->ints, groupby->field_no);
+        STATS_STOP(STATS_LOOKUP);
+        // Once it moved the groups of the table to the lists, later rows must not be folded into them
+        if (groupby->groups.length < length) groupby->mru.nb_groups = 0;
+        if (ret < 0) groupby->error = true;
+        if (ret <= 0) goto next;
     }
 
     // Look for this group in our hash (will create a new one if not found)
-    struct group *group = group_find_or_create(&state->groups, &key, state->conf);
+    STATS_START(STATS_LOOKUP);
+    struct group *group = group_find_or_create(&groupby->groups, key, groupby->conf, groupby->field_no);
+    STATS_STOP(STATS_LOOKUP);
 
     if (group) {
+        if (use_mru) mru_add(&groupby->mru, group, ! mru_on);
         // update the aggregate values in the group
-        assert(state->field_no <= state->conf->nb_fields);
-        for (unsigned f = 0; f < state->field_no; f++) {
-            if (!state->conf->fields[f]) continue;
-            // aggregate this value
-            state->conf->fields[f]->ops.fold(group->values + state->conf->aggr_cumul_size[f], state->values[f]);
+        STATS_START(STATS_FOLD);
+        if (0 != group_fold(group, groupby->conf, groupby->values, groupby->ints, groupby->field_no)) groupby->error = true;
+        STATS_STOP(STATS_FOLD);
+    } else {
+        groupby->error = true;
+    }
+next:
+    STATS_ADD(rows, 1);
+
+    groupby->filtered = false;
+    groupby->field_no = 0;
+    groupby->record_no ++;
+}
+
+int groupby_read(struct groupby *groupby, int fd)
+{
+    assert(! groupby->finished);
+    groupby->input = fd;
+    bool const csv = groupby->opts.input_format == FORMAT_CSV;
+    if (groupby->opts.nb_threads > 1 && ! csv && debug) fprintf(stderr, "Binary input is read by a single thread\n");
+    if (groupby->opts.nb_threads > 1 && csv && groupby->opts.engine == ENGINE_HASH && ! groupby->prefix) {
+        struct stat st;
+        if (0 == fstat(fd, &st) && S_ISREG(st.st_mode)) {
+            return parallel_read(groupby->conf, &groupby->opts, &groupby->estimate, fd, &groupby->parts, &groupby->nb_parts);
+        }
+        if (debug) fprintf(stderr, "Input is not a file, using a single thread\n");
+    }
+    if (groupby->opts.readahead) {
+        groupby->readahead = readahead_new(fd, groupby->opts.readahead, groupby->opts.direct);
+        if (! groupby->readahead) return -1;
+    }
+    if (! csv) {
+        groupby->ints = malloc(groupby->values_size * sizeof(*groupby->ints));
+        groupby->int_strs = malloc(groupby->values_size * sizeof(*groupby->int_strs));
+        if (! groupby->ints || ! groupby->int_strs) {
+            fprintf(stderr, "Cannot alloc %u integer values\n", groupby->values_size);
+            return -1;
         }
-        if (state->field_no > group->nb_fields) group->nb_fields = state->field_no;
     }
+    STATS_START(STATS_PARSE);
+    int const err = csv ?
+        csv_parse(&groupby->csv, field_cb, record_cb) :
+        binary_parse(groupby->opts.input_format, reader, groupby, field_cb, int_cb, record_cb);
+    STATS_STOP(STATS_PARSE);
+    groupby_end_dense(groupby);
+    int ra_err = 0;
+    if (groupby->readahead) {
+        ra_err = readahead_del(groupby->readahead);
+        groupby->readahead = NULL;
+    }
+    return err || ra_err || groupby->error ? -1 : 0;
+}
 
-    state->field_no = 0;
-    state->record_no ++;
+static uint64_t groupby_max_memory(struct groupby const *groupby)
+{
+    return groupby->opts.max_memory ? groupby->opts.max_memory : estimate_ram();
 }
 
-static bool must_quote(char const *str, char const delimiter)
+int groupby_estimate(struct groupby *groupby, int fd)
 {
-    for (; *str; str++) {
-        if (*str == '"' || *str == '\n' || *str == delimiter) return true;
+    size_t const sample_size = groupby->opts.sample_size;
+    // Binary inputs are not sampled
+    if (! sample_size || groupby->opts.engine != ENGINE_HASH || groupby->opts.input_format != FORMAT_CSV) return 0;
+    assert(! groupby->prefix);
+
+    STATS_START(STATS_ESTIMATE);
+    struct estimate *est = &groupby->estimate;
+    struct row_conf const *conf = groupby->conf;
+    char const delimiter = groupby->opts.delimiter;
+    struct stat st;
+    off_t const offset = lseek(fd, 0, SEEK_CUR);
+    void *map = MAP_FAILED;
+    if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+        // Sample files all over without reading them
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED && debug) perror("mmap");
+    }
+    bool const parallel = map != MAP_FAILED && groupby->opts.nb_threads > 1;
+    if (map != MAP_FAILED) {
+        size_t const len = st.st_size - offset;
+        (void)madvise(map, st.st_size, MADV_RANDOM);
+        estimate_groups(est, conf, delimiter, &groupby->groups.hasher, (char *)map + offset, len, len, sample_size);
+        munmap(map, st.st_size);
+    } else {
+        // Streams are sampled from their beginning, that is kept for groupby_read
+        groupby->prefix = malloc(sample_size);
+        if (! groupby->prefix) {
+            fprintf(stderr, "Cannot malloc %zu bytes to sample the input\n", sample_size);
+            return -1;
+        }
+        bool eof = false;
+        while (groupby->prefix_len < sample_size) {
+            ssize_t const r = read(fd, groupby->prefix + groupby->prefix_len, sample_size - groupby->prefix_len);
+            if (r < 0) {
+                perror("read");
+                return -1;
+            }
+            if (r == 0) {
+                eof = true;
+                break;
+            }
+            groupby->prefix_len += r;
+        }
+        estimate_groups(est, conf, delimiter, &groupby->groups.hasher, groupby->prefix, groupby->prefix_len, eof ? groupby->prefix_len : 0, sample_size);
+    }
+    STATS_STOP(STATS_ESTIMATE);
+    STATS_ADD(estimated_groups, est->nb_groups);
+    STATS_ADD(estimated_bytes, est->mem_size);
+
+    // do_groupby will partition the input if that does not fit, and parallel_read size its own tables
+    if (est->nb_groups && ! parallel && est->mem_size <= groupby_max_memory(groupby)) {
+        return groups_presize(&groupby->groups, est->nb_groups, est->group_size);
+    }
+    return 0;
+}
+
+int groupby_push(struct groupby *groupby, void const *buf, size_t len)
+{
+    assert(! groupby->finished);
+    STATS_START(STATS_PARSE);
+    int const err = csv_push(&groupby->csv, buf, len, field_cb, record_cb);
+    STATS_STOP(STATS_PARSE);
+    return err || groupby->error ? -1 : 0;
+}
+
+int groupby_push_record(struct groupby *groupby, char const *const fields[], size_t const lens[], unsigned nb_fields)
+{
+    assert(! groupby->finished);
+    // Fields must be nul terminated for the aggr functions
+    size_t size = 0;
+    for (unsigned f = 0; f < nb_fields; f++) size += lens[f] + 1;
+    if (size > groupby->record_buf_size) {
+        char *buf = realloc(groupby->record_buf, size);
+        if (! buf) {
+            fprintf(stderr, "Cannot alloc %zu bytes for a record\n", size);
+            return -1;
+        }
+        groupby->record_buf = buf;
+        groupby->record_buf_size = size;
+    }
+
+    char *dst = groupby->record_buf;
+    for (unsigned f = 0; f < nb_fields; f++) {
+        memcpy(dst, fields[f], lens[f]);
+        dst[lens[f]] = '\0';
+        field_cb(dst, lens[f], groupby);
+        if (groupby->filtered) break;
+        dst += lens[f] + 1;
     }
-    return false;
+    groupby->csv.skip_record = false;   // not parsing
+    record_cb(groupby);
+    return groupby->error ? -1 : 0;
+}
+
+static void collect_group(struct group *group, void *groups_)
+{
+    struct group ***groups = groups_;
+    *(*groups)++ = group;
 }
 
-static void dump_group(struct group *group, void *state_)
+int groupby_push_end(struct groupby *groupby)
 {
-    struct state *state = state_;
-    char delimiter[2] = { state->delimiter, '\0' };
-    FILE *output = fdopen(state->output, "w");
+    STATS_START(STATS_PARSE);
+    int const err = csv_push_end(&groupby->csv, field_cb, record_cb);
+    STATS_STOP(STATS_PARSE);
+    groupby_end_dense(groupby);
+    return err || groupby->error ? -1 : 0;
+}
+
+struct groups *groupby_groups(struct groupby *groupby)
+{
+    return &groupby->groups;
+}
 
-    // extract grouped values from key_str
-    char const *grouped_values[NB_MAX_FIELDS];
-    unsigned const nb_grouped_values = key_str_extract(&group->grouped_values, grouped_values);
+void groupby_share(struct groupby *groupby, struct shared_groups *shared)
+{
+    groupby->shared = shared;
+    // Groups go to the shared table first
+    if (groupby->dense) dense_del(groupby->dense);
+    groupby->dense = NULL;
+}
+
+void groupby_bypass(struct groupby *groupby, struct bypass *bypass)
+{
+    groupby->bypass = bypass;
+}
+
+int groupby_finish(struct groupby *groupby)
+{
+    assert(! groupby->finished);
+    if (groupby->input < 0 && 0 != groupby_push_end(groupby)) return -1;   // push mode
+    if (groupby->error) return -1;
+
+    struct output_order const *order = &groupby->opts.order;
+    if (groupby->opts.engine == ENGINE_SORT) {
+        STATS_START(STATS_FOLD);
+        int const err = sorter_finish(&groupby->sorter, groupby->conf, &groupby->results, &groupby->nb_results);
+        STATS_STOP(STATS_FOLD);
+        if (err) return -1;
+    } else {
+        if (stats.enabled) stats_groups(&groupby->groups);
+        groupby->nb_results = groupby->groups.length;
+        for (unsigned p = 0; p < groupby->nb_parts; p++) {
+            if (stats.enabled) stats_groups(groupby->parts + p);
+            groupby->nb_results += groupby->parts[p].length;
+        }
+        groupby->results = malloc(groupby->nb_results * sizeof(*groupby->results) + 1);
+        if (! groupby->results) {
+            fprintf(stderr, "Cannot malloc %zu group pointers\n", groupby->nb_results);
+            return -1;
+        }
+        struct group **g = groupby->results;
+        groups_foreach(&groupby->groups, collect_group, &g);
+        for (unsigned p = 0; p < groupby->nb_parts; p++) groups_foreach(groupby->parts + p, collect_group, &g);
+    }
+    if (stats.enabled && huge_pages) stats_huge_pages();
+
+    if (order->by == ORDER_FIELD) dict_freeze();
+    // The sort engine already outputs groups by key
+    if (order->by != ORDER_NONE && ! (groupby->opts.engine == ENGINE_SORT && order->by == ORDER_KEY && ! order->desc)) {
+        if (0 != groups_sort(groupby->results, groupby->nb_results, groupby->conf, order)) return -1;
+    }
+
+    groupby->finished = true;
+    return 0;
+}
+
+size_t groupby_nb_groups(struct groupby const *groupby)
+{
+    assert(groupby->finished);
+    return groupby->nb_results;
+}
+
+/*
+ * Results
+ */
+
+int groupby_iter_init(struct groupby_iter *iter, struct groupby *groupby)
+{
+    assert(groupby->finished);
+    struct row_conf const *conf = groupby->conf;
+    iter->groupby = groupby;
+    iter->next = 0;
+    iter->group = NULL;
+    iter->nb_values = 0;
+    iter->values = NULL;
+    iter->aggrs = NULL;
+    iter->grouped = NULL;
+    iter->max_fields = 0;
+    iter->scratch = malloc(conf->nb_aggrs * AGGR_STR_SIZE + 1);
+    if (! iter->scratch) {
+        fprintf(stderr, "Cannot alloc iterator for %u aggregates\n", conf->nb_aggrs);
+        return -1;
+    }
+    return 0;
+}
+
+void groupby_iter_fini(struct groupby_iter *iter)
+{
+    free(iter->values);
+    free(iter->aggrs);
+    free(iter->grouped);
+    free(iter->scratch);
+    iter->values = NULL;
+    iter->aggrs = NULL;
+    iter->grouped = NULL;
+    iter->scratch = NULL;
+}
+
+// Make room for the values of a group of that many fields
+static int iter_reserve(struct groupby_iter *iter, unsigned nb_fields)
+{
+    if (nb_fields <= iter->max_fields && iter->values) return 0;
+    struct row_conf const *conf = iter->groupby->conf;
+    unsigned const max_fields = nb_fields > conf->nb_fields ? nb_fields : conf->nb_fields;
+    char const **values = realloc(iter->values, (max_fields + conf->nb_aggrs + 1) * sizeof(*values));
+    if (values) iter->values = values;
+    unsigned *aggrs = realloc(iter->aggrs, (max_fields + conf->nb_aggrs + 1) * sizeof(*aggrs));
+    if (aggrs) iter->aggrs = aggrs;
+    char const **grouped = realloc(iter->grouped, (max_fields + 1) * sizeof(*grouped));
+    if (grouped) iter->grouped = grouped;
+    if (! values || ! aggrs || ! grouped) {
+        fprintf(stderr, "Cannot alloc iterator for %u values\n", max_fields + conf->nb_aggrs);
+        return -1;
+    }
+    iter->max_fields = max_fields;
+    return 0;
+}
+
+bool groupby_iter_next(struct groupby_iter *iter)
+{
+    struct groupby const *groupby = iter->groupby;
+    struct row_conf const *conf = groupby->conf;
+    if (iter->next >= groupby->nb_results) return false;
+    struct group *group = iter->group = groupby->results[iter->next++];
+    unsigned const nb_fields = group_nb_fields(group, conf);
+    if (0 != iter_reserve(iter, nb_fields)) return false;
+
+    // extract grouped values from key_str, and output fields in order
+    // (aggregates are finalized only once asked for, by groupby_iter_value)
+    char const **grouped_values = iter->grouped;
+    struct key_str const key = group_key(group, conf);
+    unsigned const nb_grouped_values = key_str_extract(&key, grouped_values);
     unsigned g = 0;
-    for (unsigned f = 0; f < group->nb_fields; f++) {
-        void const *src;
-        if (state->conf->fields[f]) {
-            src = state->conf->fields[f]->ops.finalize(group->values + state->conf->aggr_cumul_size[f]);
-        } else {
+    iter->nb_values = 0;
+    for (unsigned f = 0; f < nb_fields; f++) {
+        if (row_conf_grouped(conf, f)) {
             assert(g < nb_grouped_values);
-            src = grouped_values[g++];
+            iter->aggrs[iter->nb_values] = UINT_MAX;
+            iter->values[iter->nb_values++] = grouped_values[g++];
+            continue;
+        }
+        struct field_conf const *field = conf->fields + f;
+        for (unsigned a = field->first_aggr; a < field->first_aggr + field->nb_aggrs; a++) {
+            iter->aggrs[iter->nb_values] = a;
+            iter->values[iter->nb_values++] = NULL;
         }
-        char const *const quote = must_quote(src, state->delimiter) ? "\"":"";
-        fprintf(output, "%s%s%s%s", f > 0 ? delimiter:"", quote, (char *)src, quote);
     }
-    fprintf(output, "\n");
+    (void)nb_grouped_values;
+    return true;
 }
 
-static ssize_t reader(void *dst, size_t dst_size, void *state_)
+unsigned groupby_iter_nb_values(struct groupby_iter const *iter)
 {
-    struct state *state = state_;
-    ssize_t const r = read(state->input, dst, dst_size);
-    if (r < 0) perror("read");
-    return r;
+    return iter->nb_values;
+}
+
+char const *groupby_iter_value(struct groupby_iter const *iter, unsigned v)
+{
+    assert(v < iter->nb_values);
+    if (! iter->values[v]) {
+        struct row_conf const *conf = iter->groupby->conf;
+        unsigned const a = iter->aggrs[v];
+        iter->values[v] = conf->aggrs[a].func->ops.finalize(iter->group->values + conf->aggr_cumul_size[a], iter->scratch + a * AGGR_STR_SIZE);
+    }
+    return iter->values[v];
 }
 
-int do_groupby(struct row_conf const *row_conf, char delimiter, int input, int output)
+bool groupby_iter_integer(struct groupby_iter const *iter, unsigned v, long long *value)
 {
-    state = state_new(row_conf, input, output, delimiter);
-    if (! state) return -1;
+    assert(v < iter->nb_values);
+    unsigned const a = iter->aggrs[v];
+    if (a == UINT_MAX) return false;
+    struct row_conf const *conf = iter->groupby->conf;
+    struct aggr_ops const *ops = &conf->aggrs[a].func->ops;
+    if (! ops->finalize_ll) return false;
+    *value = ops->finalize_ll(iter->group->values + conf->aggr_cumul_size[a]);
+    return true;
+}
 
-    struct csv csv;
-    if (0 != csv_ctor(&csv, nb_max_fields*NB_MAX_FIELD_LENGTH, delimiter, reader, state)) {
-        assert(0);
+/* Values keep the doubled quotes of a quoted field, while quotes of an
+ * unquoted field are lone, and would not read back once quoted. */
+static bool must_quote(char const *str, char const delimiter)
+{
+    bool doubled = false, lone = false;
+    for (; *str; str++) {
+        if (*str == '\n' || *str == delimiter) return true;
+        if (*str != '"') continue;
+        if (str[1] == '"') {
+            doubled = true;
+            str ++;
+        } else {
+            lone = true;
+        }
+    }
+    return doubled && ! lone;
+}
+
+int groupby_write(struct groupby *groupby, int fd)
+{
+    if (groupby->opts.output_format != FORMAT_CSV) return output_write(groupby, groupby->opts.output_format, fd);
+
+    int const fd_copy = dup(fd);   // so that closing the stream leaves fd open
+    FILE *output = fd_copy < 0 ? NULL : fdopen(fd_copy, "w");
+    if (! output) {
+        perror("fdopen");
+        if (fd_copy >= 0) close(fd_copy);
+        return -1;
+    }
+
+    STATS_START(STATS_OUTPUT);
+    char delimiter[2] = { groupby->opts.delimiter, '\0' };
+    struct groupby_iter iter;
+    if (0 != groupby_iter_init(&iter, groupby)) {
+        fclose(output);
+        return -1;
+    }
+    while (groupby_iter_next(&iter)) {
+        unsigned const nb_values = groupby_iter_nb_values(&iter);
+        for (unsigned v = 0; v < nb_values; v++) {
+            char const *src = groupby_iter_value(&iter, v);
+            char const *const quote = must_quote(src, groupby->opts.delimiter) ? "\"":"";
+            fprintf(output, "%s%s%s%s", v > 0 ? delimiter:"", quote, src, quote);
+        }
+        fprintf(output, "\n");
+    }
+    groupby_iter_fini(&iter);
+    int const err = fclose(output);
+    STATS_STOP(STATS_OUTPUT);
+    if (0 != err) {
+        perror("fclose");
         return -1;
     }
-    int err = csv_parse(&csv, field_cb, record_cb);
-    csv_dtor(&csv);
+    return 0;
+}
 
-    if (err) return -1;
+/*
+ * Out of core
+ *
+ * When the groups are not expected to fit in memory, rows are first split on
+ * disk according to their key, then each partition is aggregated and output
+ * on its own.
+ */
 
-    groups_foreach(&state->groups, dump_group, state);
+#define SPILL_MAX_PARTS 256
+#define SPILL_SEED 0x9e3779b97f4a7c15ULL  // not the seed of the table, so that partitions still spread over buckets
 
-    state_del(state);
+struct spill {
+    unsigned nb_parts;
+    FILE *parts[];
+};
 
-    return 0;
+// Write the field so that the parser gives it back as is
+static void spill_field(FILE *part, char const *str, char const delimiter)
+{
+    bool const quote = str[0] == '"' || strchr(str, delimiter) || strchr(str, '\n');
+    if (quote) putc('"', part);
+    fputs(str, part);
+    if (quote) putc('"', part);
+}
+
+static void spill_record_cb(void *groupby_)
+{
+    struct groupby *groupby = groupby_;
+    if (groupby->error) goto next;
+    if (groupby->filtered || groupby->field_no < groupby->conf->nb_pred_fields) {
+        STATS_ADD(rows, 1);
+        STATS_ADD(filtered, 1);
+        goto next;
+    }
+
+    struct key_str const *key = build_key(groupby);
+    if (! key) {
+        groupby->error = true;
+        goto next;
+    }
+    uint64_t const hash = hash_fast(key->str, key->len, SPILL_SEED);
+    FILE *part = groupby->spill->parts[hash % groupby->spill->nb_parts];
+    for (unsigned f = 0; f < groupby->field_no; f++) {
+        if (f > 0) putc(groupby->opts.delimiter, part);
+        spill_field(part, groupby->values[f], groupby->opts.delimiter);
+    }
+    if (EOF == putc('\n', part)) {
+        perror("Cannot write partition");
+        groupby->error = true;
+    }
+next:
+    groupby->filtered = false;
+    groupby->field_no = 0;
+    groupby->record_no ++;
+}
+
+static int groupby_spill(struct groupby *groupby, int input, int output)
+{
+    struct estimate const *est = &groupby->estimate;
+    // Aim at partitions of half the available memory
+    uint64_t const max_memory = groupby_max_memory(groupby);
+    uint64_t nb_parts = (2 * est->mem_size + max_memory - 1) / max_memory;
+    if (nb_parts < 2) nb_parts = 2;
+    if (nb_parts > SPILL_MAX_PARTS) nb_parts = SPILL_MAX_PARTS;
+    if (debug) fprintf(stderr, "Partitioning the input in %"PRIu64" files\n", nb_parts);
+
+    struct spill *spill = malloc(sizeof(*spill) + nb_parts * sizeof(spill->parts[0]));
+    if (! spill) {
+        fprintf(stderr, "Cannot malloc %"PRIu64" partitions\n", nb_parts);
+        return -1;
+    }
+    int err = -1;
+    for (spill->nb_parts = 0; spill->nb_parts < nb_parts; spill->nb_parts++) {
+        spill->parts[spill->nb_parts] = tmpfile();
+        if (! spill->parts[spill->nb_parts]) {
+            perror("tmpfile");
+            goto quit;
+        }
+    }
+    STATS_ADD(spill_parts, nb_parts);
+
+    groupby->input = input;
+    groupby->spill = spill;
+    STATS_START(STATS_ESTIMATE);
+    err = csv_parse(&groupby->csv, field_cb, spill_record_cb) || groupby->error ? -1 : 0;
+    STATS_STOP(STATS_ESTIMATE);
+    groupby->spill = NULL;
+
+    struct groupby_options opts = groupby->opts;
+    opts.sample_size = 0;
+    for (unsigned p = 0; ! err && p < spill->nb_parts; p++) {
+        FILE *part = spill->parts[p];
+        STATS_ADD(spill_bytes, ftello(part));
+        if (0 != fflush(part) || 0 != fseeko(part, 0, SEEK_SET)) {
+            perror("Cannot rewind partition");
+            err = -1;
+            break;
+        }
+        struct groupby *sub = groupby_new(groupby->conf, &opts);
+        if (! sub) {
+            err = -1;
+            break;
+        }
+        err = groups_presize(&sub->groups, est->nb_groups / spill->nb_parts, est->group_size);
+        if (! err) err = groupby_read(sub, fileno(part));
+        if (! err) err = groupby_finish(sub);
+        if (! err && output >= 0) err = groupby_write(sub, output);
+        groupby_del(sub);
+    }
+quit:
+    while (spill->nb_parts > 0) fclose(spill->parts[--spill->nb_parts]);
+    free(spill);
+    return err;
+}
+
+int do_groupby(struct row_conf const *row_conf, struct groupby_options const *opts, int input, int output)
+{
+    struct groupby *groupby = groupby_new(row_conf, opts);
+    if (! groupby) return -1;
+
+    int err = groupby_estimate(groupby, input);
+    if (! err && groupby->estimate.mem_size > groupby_max_memory(groupby)) {
+        if (opts->order.by == ORDER_NONE) {
+            err = groupby_spill(groupby, input, output);
+            goto quit;
+        }
+        fprintf(stderr, "Groups may not fit in memory (%"PRIu64" bytes expected) but cannot be partitioned when the output is sorted\n", groupby->estimate.mem_size);
+    }
+
+    if (! err) err = groupby_read(groupby, input);
+    if (! err) err = groupby_finish(groupby);
+    if (! err && output >= 0) err = groupby_write(groupby, output);
+quit:
+    groupby_del(groupby);
+    return err;
 }
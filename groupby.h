@@ -3,89 +3,617 @@
 #ifndef GROUPBY_H_110404
 #define GROUPBY_H_110404
 #include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/queue.h>
+#include "libgroupby.h"
 
 #define SIZEOF_ARRAY(x) (sizeof(x)/sizeof(*(x)))
+// Default for -m, that only bounds the fields caught by an open or negated
+// field_spec with a function, such as -a 3-:sum
 #define NB_MAX_FIELDS 500
-#define NB_MAX_FIELD_LENGTH 60000
-#define MAX_RECORD_LENGTH (NB_MAX_FIELDS*(NB_MAX_FIELD_LENGTH+3))
 
 extern bool debug;
 extern unsigned nb_max_fields;
 
+#define AGGR_STR_SIZE 32
+
 extern struct aggr_func {
     struct aggr_ops {
         // return the size of the internal object to be allocated
         size_t (* size)(void);
         // construct a new object to be given to fold
         void (* ctor)(void *);   // given pointer points to a space of AGGR_OBJ_SIZE bytes
-        // update the object previously returned by new with a new value
-        void (*fold)(void *old, char const *current);
-        // get the final value of the object (as a string)
-        char const *(*finalize)(void *v);
+        // update the object previously returned by new with a new value (-1 on error, already reported)
+        int (*fold)(void *old, char const *current);
+        // same as fold, for a value already converted to an integer (NULL for non numeric aggregates)
+        void (*fold_ll)(void *old, long long current);
+        // get the final value of the object (as a string, possibly written in buf)
+        char const *(*finalize)(void *v, char buf[AGGR_STR_SIZE]);
+        // same as finalize, for aggregates whose final value is an integer (NULL for others)
+        long long (*finalize_ll)(void const *v);
+        // compare two objects in the order of their final values (NULL if not comparable)
+        int (*cmp)(void const *, void const *);
+        // fold into the first object another one, built from rows that came after (-1 on error)
+        int (*merge)(void *, void const *);
+        // same as fold_ll, with other threads folding into the same object (NULL if that needs a lock)
+        void (*fold_atomic)(void *, long long current);
+        // same as fold, for aggregates that do not look at the value at all (NULL for others)
+        void (*fold_row)(void *);
+        // free what the object allocated (NULL if it allocates nothing)
+        void (*dtor)(void *);
     } const ops;
     char const *name;
 } aggr_funcs[];
 
 extern unsigned nb_aggr_funcs;
 
+// How numeric aggregates read their input
+static inline long long ll_of_str(char const *str)
+{
+    // Fast path for plain decimal numbers short enough not to overflow
+    char const *c = str + (*str == '-');
+    if (*c >= '1' && *c <= '9') {
+        unsigned long long v = 0;
+        unsigned n = 0;
+        for (; *c >= '0' && *c <= '9' && n < 18; c++, n++) v = v*10 + (*c - '0');
+        if (n < 18 || ! (*c >= '0' && *c <= '9')) return *str == '-' ? -(long long)v : (long long)v;
+    }
+    return strtoll(str, NULL, 0);   // TODO: error check?
+}
+
+// Field f of a record as an integer: binary inputs give integers as they are,
+// leaving their value NULL
+static inline long long field_ll(char const *const *values, long long const *ints, unsigned f)
+{
+    return values[f] ? ll_of_str(values[f]) : ints[f];
+}
+
+/* Updates of the numeric aggregates, inlined in the fold kernels */
+
+struct avg_value {
+    unsigned nb_values;
+    long long sum;
+};
+
+static inline void aggr_sum_ll(void *v_, long long current)
+{
+    long long *v = v_;
+    *v += current;
+}
+
+static inline void aggr_min_ll(void *v_, long long current)
+{
+    long long *v = v_;
+    if (current < *v) *v = current;
+}
+
+static inline void aggr_max_ll(void *v_, long long current)
+{
+    long long *v = v_;
+    if (current > *v) *v = current;
+}
+
+static inline void aggr_avg_ll(void *v_, long long current)
+{
+    struct avg_value *v = v_;
+    v->nb_values ++;
+    v->sum += current;
+}
+
+static inline void aggr_count(void *v_)
+{
+    long long *v = v_;
+    (*v) ++;
+}
+
+// One aggregate to compute (there can be several per field)
+struct row_aggr {
+    struct aggr_func const *func;
+    unsigned field;
+    unsigned option;    // which option asked for it
+};
+
+// A condition on a field for the row to be aggregated (--where)
+struct row_pred {
+    unsigned field;
+    enum pred_op { PRED_EQ, PRED_NE, PRED_PREFIX, PRED_LT, PRED_LE, PRED_GT, PRED_GE } op;
+    long long num;      // for the numeric comparisons
+    unsigned nb_values; // for the others, any of these values
+    struct pred_value {
+        char const *str;
+        size_t len;
+    } *values;
+};
+
+// Tells whether this field value (nul terminated) satisfies the predicate
+bool pred_eval(struct row_pred const *, char const *, size_t);
+
+/* Fold kernels: specialized folds for common layouts of numeric aggregates,
+ * with no indirect call per aggregate nor test per field. */
+
+#define KERNEL_MAX_INPUTS 4
+#define KERNEL_MAX_AGGRS 4
+
+struct fold_kernel {
+    char const *name;   // NULL when there is no kernel for this layout
+    void (*fold)(struct fold_kernel const *, char *values, char const *const *fields, long long const *ints);
+    unsigned nb_fields; // rows with fewer fields go through the generic fold
+    unsigned field[KERNEL_MAX_INPUTS];  // fields to convert, in order of first use
+    size_t offset[KERNEL_MAX_AGGRS];    // where are the values of each aggregate
+};
+
+struct row_conf;
+// Pick a kernel for this row_conf, if any
+void fold_kernel_select(struct fold_kernel *, struct row_conf const *);
+
+/* Dense folding: rows of the first few groups are given a small index and
+ * folded a batch at a time, column after column (see dense.c). */
+
+struct dense;
+struct groups;
+struct key_str;
+// NULL if the aggregates of this row_conf cannot be folded that way
+struct dense *dense_new(struct row_conf const *, struct groups *);
+void dense_del(struct dense *);
+// Return 0 once the row is folded, 1 if there are too many groups to go on
+// (the row is not folded then), -1 on error
+int dense_fold(struct dense *, struct key_str *, char const *const *values, long long const *ints, unsigned nb_values);
+// Fold what was accumulated into the groups
+void dense_flush(struct dense *);
+
 struct row_conf {
-    unsigned nb_fields;
-    unsigned nb_aggr_fields;    // how many of which have an aggr function
-    size_t aggr_cumul_size[NB_MAX_FIELDS];  // size of all values before this field
+    unsigned nb_fields;         // how many fields are configured below
+    unsigned max_fields;        // records with more fields are an error (UINT_MAX when further fields are grouped)
+    unsigned fields_size;       // room in fields
+    unsigned nb_aggr_fields;    // how many of which have aggr functions
+    unsigned nb_options;        // how many -a/-g options were applied so far
+    unsigned nb_aggrs, max_aggrs;
+    struct row_aggr *aggrs;     // once finalized, ordered by field
+    size_t *aggr_cumul_size;    // size of all values before this aggregate
     size_t aggr_tot_size;
-    struct aggr_func const *fields[]; // If NULL then group by this field
+    bool aggr_dtors;            // some aggregate has a dtor, that groups_dtor must call
+    unsigned nb_preds, max_preds;
+    struct row_pred *preds;     // once finalized, ordered by field
+    unsigned nb_pred_fields;    // rows with fewer fields than this are filtered out
+    unsigned nb_grouped_fields; // how many of the nb_fields are grouped
+    struct fold_kernel kernel;
+    struct field_conf {
+        unsigned option;        // last option that configured this field
+        unsigned first_aggr;    // index of its first aggregate in aggrs
+        unsigned nb_aggrs;      // If 0 then group by this field
+        unsigned first_pred, nb_preds;  // predicates on this field
+        bool integers;          // aggregated only by functions that fold integers, and with no predicate
+    } *fields;                  // fields past nb_fields are grouped
+    unsigned tail_option;       // last option that configured all fields past nb_fields
 };
 
-// Return an empty row_conf
-struct row_conf *row_conf_new(unsigned nb_fields_max);
+// Make sure fields up to nb_fields are configured, like the ones past them were
+int row_conf_grow(struct row_conf *, unsigned nb_fields);
 
-void row_conf_finalize(unsigned nb_max_fields, struct row_conf *);
-
-int do_groupby(struct row_conf const *, char delimiter, int ifile, int ofile);
+static inline bool row_conf_grouped(struct row_conf const *conf, unsigned f)
+{
+    return f >= conf->nb_fields || ! conf->fields[f].nb_aggrs;
+}
 
 struct key_str {
     char *str;
     unsigned len;
+    unsigned size;  // of str, when it is a buffer where keys are built
 };
 
-void key_str_append(struct key_str *, char const *);
+// Return -1 if the key buffer cannot be enlarged
+int key_str_append(struct key_str *, char const *);
 bool key_str_eq(struct key_str const *, struct key_str const *);
-unsigned key_str_extract(struct key_str const *, char const *res[NB_MAX_FIELDS]);
+// Return how many values were written in res, that must have room for all of them
+unsigned key_str_extract(struct key_str const *, char const **res);
+
+/*
+ * Hashing of group keys
+ */
+
+struct hasher {
+    char const *name;
+    uint64_t (*fn)(void const *, size_t, uint64_t seed);
+    uint64_t seed;
+};
+
+void hasher_ctor(struct hasher *, enum groupby_hash);
+
+static inline uint64_t hasher_hash(struct hasher const *hasher, void const *key, size_t len)
+{
+    return hasher->fn(key, len, hasher->seed);
+}
+
+uint64_t hash_fast(void const *, size_t, uint64_t seed);
+
+/*
+ * HyperLogLog, to count distinct hashes in bounded memory
+ */
+
+#define HLL_BITS 12
+#define HLL_SIZE (1U << HLL_BITS)
+
+struct hll {
+    uint8_t reg[HLL_SIZE];
+};
+
+void hll_add(struct hll *, uint64_t hash);
+void hll_merge(struct hll *, struct hll const *);
+double hll_count(struct hll const *);
+
+/*
+ * Arena: many small allocations freed all at once
+ */
+
+struct arena {
+    struct arena_chunk *chunks;
+    size_t chunk_size;
+};
+
+void arena_ctor(struct arena *, size_t chunk_size);
+void arena_dtor(struct arena *);
+// Returns 8 bytes aligned memory, or NULL
+void *arena_alloc(struct arena *, size_t);
+void arena_foreach_chunk(struct arena const *, void (*cb)(void const *, size_t, void *), void *);
 
+// Set by --huge-pages, for the allocations below
+extern bool huge_pages;
+// The size big_alloc would actually allocate for that many bytes
+size_t big_size(size_t);
+// Allocations of bucket arrays, arena chunks and parse buffers, from huge
+// pages if huge_pages is set. They must be freed with the size they were
+// allocated with.
+void *big_alloc(size_t);
+void *big_realloc(void *, size_t old_size, size_t size);
+void big_free(void *, size_t);
+
+/*
+ * Groups
+ */
+
+/* A group is a 16 bytes header, its aggregates (conf->aggr_tot_size bytes)
+ * then its key, all in one allocation from an arena rounded to 8 bytes; a
+ * group of 2 sums with a key of 16 bytes takes 48 bytes, plus 8 to 16 for its
+ * bucket and 8 in the results once finished. Before, the header also had the
+ * key as a key_str (pointer, length and size) and the number of fields, for
+ * 32 bytes: that same group took 64 bytes.
+ * Rows with all the configured fields give groups as many fields as the
+ * configured ones plus the grouped ones past them, that are in the key. So
+ * only groups created by a shorter row keep their number of fields, in a
+ * width slot between their aggregates and their key (see group_nb_fields). */
 struct group {
     SLIST_ENTRY(group) entry;
-    struct key_str grouped_values;
-    unsigned nb_fields;    // how many fields were observed, at max
-    char values[];  // size given by conf->aggr_tot_size
+    uint32_t tag;       // high bits of the key hash, compared before the key
+    uint32_t key_len;   // length of the key, ORed with GROUP_WIDTH if there is a width slot
+#   define GROUP_WIDTH (1U << 31)
+    char values[] __attribute__((aligned(8)));
 };
 
+static inline unsigned group_key_len(struct group const *group)
+{
+    return group->key_len & ~GROUP_WIDTH;
+}
+
+// The width slot of a group created by a row shorter than configured, NULL for others
+static inline uint32_t *group_width(struct group const *group, struct row_conf const *conf)
+{
+    return group->key_len & GROUP_WIDTH ? (uint32_t *)(group->values + conf->aggr_tot_size) : NULL;
+}
+
+static inline char *group_key_str(struct group const *group, struct row_conf const *conf)
+{
+    return (char *)group->values + conf->aggr_tot_size + (group->key_len & GROUP_WIDTH ? sizeof(uint32_t) : 0);
+}
+
+// The key of a group, not to be appended to
+static inline struct key_str group_key(struct group const *group, struct row_conf const *conf)
+{
+    return (struct key_str){ .str = group_key_str(group, conf), .len = group_key_len(group), .size = 0 };
+}
+
+static inline bool group_key_eq(struct group const *group, struct key_str const *key, struct row_conf const *conf)
+{
+    return group_key_len(group) == key->len && 0 == memcmp(group_key_str(group, conf), key->str, key->len);
+}
+
+// Account for a row of nb_values folded into the group
+static inline void group_widen(struct group *group, struct row_conf const *conf, unsigned nb_values)
+{
+    uint32_t *width = group_width(group, conf);
+    if (width && nb_values > *width) *width = nb_values;
+}
+
 struct groups {
-#   define GROUP_HASH_SIZE (0x10000)
-    SLIST_HEAD(group_lists, group) hash[GROUP_HASH_SIZE];
+    struct hasher hasher;
+#   define GROUP_HASH_SIZE (0x10000)  // initial number of buckets, a power of 2
+    SLIST_HEAD(group_list, group) *hash;
+    unsigned nb_buckets;    // a power of 2, doubled when there are more groups
     unsigned length;
+    uint64_t nb_lookups;    // by group_find_or_create (or the groups of the last rows), length of which created a group
+    struct arena mem;   // the groups and their keys
 };
 
-int groups_ctor(struct groups *);
-void groups_dtor(struct groups *);
-struct group *group_find_or_create(struct groups *, struct key_str *, struct row_conf const *);
+int groups_ctor(struct groups *, enum groupby_hash);
+void groups_dtor(struct groups *, struct row_conf const *);
+// Size the table and the arena chunks for that many groups of that size, before any insertion
+int groups_presize(struct groups *, uint64_t nb_groups, size_t group_size);
+// Allocate a group with a copy of the key and initialized aggregates, for a
+// row of nb_values, but do not index it
+struct group *group_alloc(struct arena *, struct key_str const *, struct row_conf const *, unsigned nb_values);
+// Free what its aggregates allocated (the group itself stays in its arena)
+void group_dtor(struct group *, struct row_conf const *);
+// How many fields the rows of this group had, at most
+unsigned group_nb_fields(struct group const *, struct row_conf const *);
+// Fold these field values (as many as nb_values) into the group aggregates;
+// values that are NULL are integers given in ints (see field_ll). -1 if an
+// aggregate failed (and reported it).
+int group_fold(struct group *, struct row_conf const *, char const *const *values, long long const *ints, unsigned nb_values);
+// Same, with other threads folding into the same group; lock guards the aggregates with no atomic fold
+int group_fold_shared(struct group *, struct row_conf const *, char const *const *values, unsigned nb_values, pthread_mutex_t *lock);
+// The group of this key, created for a row of nb_values if needed
+struct group *group_find_or_create(struct groups *, struct key_str const *, struct row_conf const *, unsigned nb_values);
+// The group of this key, or NULL if there is none yet (not counted in nb_lookups)
+struct group *group_find(struct groups *, struct key_str const *, struct row_conf const *);
+// Index a group that was allocated elsewhere, and whose key is not in the table yet
+void groups_insert(struct groups *, struct group *, struct row_conf const *);
+// Fold into a group another group of the same key, built from later rows (-1 on error)
+int group_merge(struct group *, struct group const *, struct row_conf const *);
 void groups_foreach(struct groups *, void (*cb)(struct group *, void *), void *);
 
+/*
+ * Estimation of the number of groups (--estimate)
+ */
+
+struct estimate {
+    uint64_t sampled_rows;
+    uint64_t nb_rows;       // projected over the whole input
+    uint64_t nb_groups;     // projected
+    size_t group_size;      // bytes per group, key and bucket included
+    uint64_t mem_size;      // nb_groups * group_size
+};
+
+/* Estimate the groups from samples of this buffer, len bytes long out of
+ * input_size bytes of input (or 0 if unknown). Sampled records are parsed
+ * and filtered but not aggregated. */
+void estimate_groups(struct estimate *, struct row_conf const *, char delimiter, struct hasher const *, char const *buf, size_t len, uint64_t input_size, size_t sample_size);
+// Physical memory, in bytes
+uint64_t estimate_ram(void);
+
+/*
+ * Parallel aggregation (-j)
+ */
+
+// The groups of a groupby that was given its input with groupby_push
+struct groups *groupby_groups(struct groupby *);
+// Terminate the last record of the input given to groupby_push
+int groupby_push_end(struct groupby *);
+// Fold the rows first into that shared table (see parallel.c)
+struct shared_groups;
+void groupby_share(struct groupby *, struct shared_groups *);
+/* Fold these values into the group of that key in the shared table, creating
+ * it if there is room. Return 1 if folded, 0 if it could not, for the caller
+ * to use a table of its own, or -1 on error. */
+int shared_fold(struct shared_groups *, struct key_str const *, struct row_conf const *, char const *const *values, unsigned nb_values);
+// Send the rows straight to the thread merging their key once our table does not reduce them
+struct bypass;
+void groupby_bypass(struct groupby *, struct bypass *);
+/* Fold these values into a group of their own for the thread merging that
+ * key, if the table of that thread has stopped reducing its rows and does not
+ * have that key (it is folded into its group then). Return 1 if the row is
+ * to be folded into the table, 0 if it was folded, or -1 on error. When it
+ * stops using the table, it empties it into the lists of the partitions. */
+int bypass_fold(struct bypass *, struct key_str const *, struct row_conf const *, char const *const *values, long long const *ints, unsigned nb_values);
+/* Aggregate that file with opts->nb_threads threads into one struct groups
+ * per thread, each with the groups of a distinct partition of the keys. */
+int parallel_read(struct row_conf const *, struct groupby_options const *, struct estimate const *, int fd, struct groups **, unsigned *nb_groups);
+
+/*
+ * Read-ahead of the input (see readahead.c)
+ */
+
+struct readahead;
+// Start reading fd ahead into nb_bufs buffers, with O_DIRECT if possible when direct
+struct readahead *readahead_new(int fd, unsigned nb_bufs, bool direct);
+// -1 if reads in flight could not be waited for: their buffers are then leaked
+int readahead_del(struct readahead *);
+// Like read(2), from the buffers read so far
+ssize_t readahead_read(struct readahead *, void *, size_t);
+
+/*
+ * Binary formats (see output.c for their layout, and input.c)
+ */
+
+#define ROWS_INTEGER UINT32_MAX     // length given to int64 values in FORMAT_ROWS
+#define COLUMNS_MAGIC "GBYC"        // first bytes of each batch of FORMAT_COLUMNS
+enum column_type { COLUMN_STRING, COLUMN_INTEGER };
+
+// Write the results of a finished groupby in that format (not FORMAT_CSV)
+int output_write(struct groupby *, enum groupby_format, int fd);
+/* Parse everything the reader gives in that format (not FORMAT_CSV), giving
+ * strings (nul terminated) to field_cb and integers to int_cb, then calling
+ * record_cb once per record */
+int binary_parse(enum groupby_format, ssize_t (*reader)(void *, size_t, void *), void *user_data,
+                 void (*field_cb)(void *, size_t, void *), void (*int_cb)(long long, void *), void (*record_cb)(void *));
+
+/*
+ * Dictionary of interned strings, for string aggregates (thread safe)
+ * Id 0 stands for no string.
+ */
+
+#define DICT_NONE 0
+
+// Every user holds a reference; the strings are freed along the last one
+void dict_ref(void);
+void dict_unref(void);
+// The id of that string, or DICT_NONE on error (reported)
+uint32_t dict_intern(char const *);
+// The id of that string if it is interned already, or DICT_NONE (without locking)
+uint32_t dict_lookup(char const *);
+char const *dict_str(uint32_t id);
+// Rank all strings interned so far, so that dict_cmp compares them as integers
+void dict_freeze(void);
+int dict_cmp(uint32_t, uint32_t);
+
+/*
+ * Sort engine
+ */
+
+struct sort_entry {
+    uint64_t prefix;    // first 8 bytes of the key, big endian
+    char const *key;
+    unsigned key_len;
+    void *data;
+};
+
+uint64_t sort_key_prefix(char const *key, unsigned len);
+// Compare keys, knowing that the first depth bytes are equal
+int sort_entry_cmp(struct sort_entry const *, struct sort_entry const *, unsigned depth);
+// Stable radix sort on the key bytes, using tmp as scratch space for nb entries
+void sort_entries(struct sort_entry *, struct sort_entry *tmp, size_t nb, unsigned depth);
+
+struct sorter {
+    struct arena rows;
+    struct sort_entry *entries;
+    size_t nb_entries, max_entries;
+};
+
+int sorter_ctor(struct sorter *);
+void sorter_dtor(struct sorter *);
+int sorter_add(struct sorter *, struct key_str const *, char const *const *values, unsigned nb_values, struct row_conf const *);
+// Sort the rows and build one group per key, returned in key order (to be freed)
+int sorter_finish(struct sorter *, struct row_conf const *, struct group ***, size_t *);
+
+// Sort these groups in place, using several threads when there are many
+int groups_sort(struct group **, size_t nb, struct row_conf const *, struct output_order const *);
+
+// The parse buffer starts that large and doubles only for longer records
+#define CSV_BLOCK_SIZE (1U << 20)
+
+// Where the scan of the tokenizer's quoting rules is in the current field.
+// A quote opens a field only at its start, and is literal anywhere else.
+enum scan_state { SCAN_FIELD_START, SCAN_UNQUOTED, SCAN_QUOTED, SCAN_QUOTE_IN_QUOTED };
+#define SCAN_NB_STATES (SCAN_QUOTE_IN_QUOTED + 1)
+
 struct csv {
     size_t buf_size;
-    size_t max_row_size;
-    unsigned datalen;
-    unsigned upto;
-    unsigned cursor;
+    size_t datalen;
+    size_t upto;    // end of the last parsed record
+    size_t cursor;
+    unsigned lineno;
+    size_t scanned, complete;   // how far we scanned, and the end of the last complete record
+    enum scan_state scan_state;
     ssize_t (*reader)(void *, size_t, void *);
     bool eof;
     char *buffer;
     void *user_data;
     char delimiter;
+    bool skip_record;   // set by field_cb to skip the rest of the current record
+    bool quiet;         // do not report malformed records (when sampling)
 };
 
-int csv_ctor(struct csv *csv, size_t max_row_size, char delimiter, ssize_t (*reader)(void *, size_t, void *), void *);
+int csv_ctor(struct csv *csv, char delimiter, ssize_t (*reader)(void *, size_t, void *), void *);
 void csv_dtor(struct csv *);
+// Push mode: forget the bytes of a partial record, to go on from the start of another one
+void csv_reset(struct csv *);
+// Pull mode: parse everything the reader gives, even a last record without its final newline
 int csv_parse(struct csv *, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *));
+// Push mode (no reader): parse all complete records once these bytes are appended
+int csv_push(struct csv *, void const *, size_t, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *));
+// Push mode: parse the last record even if it lacks its final newline
+int csv_push_end(struct csv *, void (*field_cb)(void *, size_t, void *), void (*record_cb)(void *));
+// The scan state after these bytes, from that state (SCAN_FIELD_START at a record start)
+enum scan_state csv_scan_state(enum scan_state, char const *, size_t, char delimiter);
+// How many of these bytes, from that state, go up to the end of the first
+// record ending in them, or 0 if none does
+size_t csv_record_end(enum scan_state, char const *, size_t, char delimiter);
+// How many of these bytes, from anywhere in a record, go up to the start of
+// the next one: the first record end that all states agree on, or else the
+// first one outside of quotes; 0 if none
+size_t csv_resync(char const *, size_t, char delimiter);
+
+/*
+ * Statistics (--stats)
+ *
+ * Timers count cycles (TSC where available, nanoseconds otherwise) and are
+ * converted to seconds when printed. Everything is guarded by stats.enabled
+ * so that a run without --stats pays only for a predictable branch.
+ * Each thread has its own stats, added to those of the thread that started
+ * it when done: timers then add up the time spent in all threads.
+ */
+
+enum stats_timer {
+    STATS_PARSE,    // the whole csv_parse, which includes the following four
+    STATS_READ,     // reader callback in csv_feed
+    STATS_KEY,      // building the key with key_str_append
+    STATS_LOOKUP,   // group_find_or_create
+    STATS_FOLD,     // aggr fold functions
+    STATS_OUTPUT,   // dump_group
+    STATS_ESTIMATE, // sampling the input (--estimate) and partitioning it
+    STATS_MERGE,    // merging the groups of several threads
+    NB_STATS_TIMERS
+};
+
+extern __thread struct stats {
+    bool enabled;
+    bool json;
+    bool numa;  // count local and remote pages of the groups
+    uint64_t cycles[NB_STATS_TIMERS];
+    uint64_t start_cycles;
+    struct timespec start_time;
+    uint64_t bytes_read;
+    uint64_t rows;
+    uint64_t filtered;
+    uint64_t groups;
+    uint64_t refills;
+    uint64_t memmoves, memmove_bytes;
+    uint64_t alloc_bytes;
+    uint64_t nb_buckets, used_buckets, max_chain;
+    uint64_t rehashes;
+    uint64_t estimated_groups, estimated_bytes;
+    uint64_t spill_parts, spill_bytes;
+    uint64_t threads;
+    uint64_t numa_local_pages, numa_remote_pages;
+    uint64_t shared_slots, shared_groups;   // of the table shared by all threads
+    uint64_t readahead_bufs, readahead_waits;   // times the parser had to wait for a read
+    uint64_t dense_rows;    // folded in batches
+    uint64_t short_rows;    // whose short key was looked up without hashing
+    uint64_t bypassed_rows; // sent to the thread merging their key without folding them first
+    uint64_t mru_lookups, mru_hits; // rows compared to the groups of the last rows, that found theirs there
+    uint64_t hugetlb_pages; // reserved huge pages mapped (--huge-pages)
+    uint64_t thp_pages;     // or transparent huge pages backing the process once groups are complete
+} stats;
+
+static inline uint64_t stats_cycles(void)
+{
+#   if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#   else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#   endif
+}
+
+#define STATS_START(t)                                                        \
+    uint64_t const stats_start_##t = stats.enabled ? stats_cycles() : 0
+#define STATS_STOP(t) do {                                                    \
+    if (stats.enabled) stats.cycles[t] += stats_cycles() - stats_start_##t;   \
+} while (0)
+#define STATS_ADD(counter, n) do {                                            \
+    if (stats.enabled) stats.counter += (n);                                  \
+} while (0)
+
+void stats_begin(void);
+void stats_thread_begin(struct stats const *parent);
+void stats_thread_end(struct stats *parent);
+void stats_groups(struct groups const *);
+// Sample how many transparent huge pages back the process (--huge-pages)
+void stats_huge_pages(void);
+void stats_print(FILE *);
 
 #endif
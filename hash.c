@@ -0,0 +1,302 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* 64 bits hashes of the group keys.
+ * - fast: multiply-mix hash in the style of wyhash, reading 8 bytes at a time
+ *   (16 bytes per round, 48 for long keys);
+ * - seeded: the same with a seed drawn at random when the table is built, so
+ *   that colliding keys cannot be crafted in advance;
+ * - crc32c: two CRC32C lanes using the SSE 4.2 instruction when the CPU has
+ *   it (checked at run time), the fast hash otherwise;
+ * - lookup3: the former hashlittle2, for comparison.
+ * The high 32 bits are meant for tags while the low bits select buckets. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "groupby.h"
+#include "jhash.h"
+
+static uint64_t const secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static inline uint64_t mum(uint64_t a, uint64_t b)
+{
+    __uint128_t const r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read8(uint8_t const *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read4(uint8_t const *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 1 to 3 bytes
+static inline uint64_t read3(uint8_t const *p, size_t len)
+{
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+}
+
+uint64_t hash_fast(void const *key, size_t len, uint64_t seed)
+{
+    uint8_t const *p = key;
+    uint64_t a, b;
+    seed ^= mum(seed ^ secret[0], secret[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t const shift = (len >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + shift);
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - shift);
+        } else if (len > 0) {
+            a = read3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mum(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+                see1 = mum(read8(p + 16) ^ secret[2], read8(p + 24) ^ see1);
+                see2 = mum(read8(p + 32) ^ secret[3], read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mum(read8(p) ^ secret[1], read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+
+    __uint128_t const r = (__uint128_t)(a ^ secret[1]) * (b ^ seed);
+    return mum((uint64_t)r ^ secret[0] ^ len, (uint64_t)(r >> 64) ^ secret[1]);
+}
+
+static uint64_t hash_lookup3(void const *key, size_t len, uint64_t seed)
+{
+    uint32_t c = seed, b = seed >> 32;
+    hashlittle2(key, len, &c, &b);
+    return ((uint64_t)b << 32) | c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint64_t hash_crc32c(void const *key, size_t len, uint64_t seed)
+{
+    uint8_t const *p = key;
+    size_t const total = len;
+    uint64_t h1 = seed ^ secret[0], h2 = seed ^ secret[1];
+    for (; len >= 16; p += 16, len -= 16) {
+        h1 = __builtin_ia32_crc32di(h1, read8(p));
+        h2 = __builtin_ia32_crc32di(h2, read8(p + 8));
+    }
+    if (len >= 8) {
+        h1 = __builtin_ia32_crc32di(h1, read8(p));
+        p += 8;
+        len -= 8;
+    }
+    uint64_t tail;
+    if (len >= 4) {
+        tail = (read4(p) << 32) | read4(p + len - 4);
+    } else if (len > 0) {
+        tail = read3(p, len);
+    } else {
+        tail = 0;
+    }
+    h2 = __builtin_ia32_crc32di(h2, tail ^ ((uint64_t)total << 56));
+    // CRCs are linear: mix both lanes so that all bits are spread
+    return mum(h1 ^ secret[2], h2 ^ secret[3]);
+}
+#endif
+
+static bool have_crc32c(void)
+{
+#   if defined(__x86_64__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#   else
+    return false;
+#   endif
+}
+
+static uint64_t random_seed(void)
+{
+    uint64_t seed;
+    if (sizeof(seed) != getrandom(&seed, sizeof(seed), 0)) {
+        // Not as good but still unknown to whoever wrote the input
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = mum(ts.tv_sec ^ secret[2], ts.tv_nsec ^ getpid());
+    }
+    return seed;
+}
+
+void hasher_ctor(struct hasher *hasher, enum groupby_hash hash)
+{
+    hasher->seed = 0x12345678;
+    switch (hash) {
+        case HASH_FAST:
+            hasher->name = "fast";
+            hasher->fn = hash_fast;
+            break;
+        case HASH_SEEDED:
+            hasher->name = "seeded";
+            hasher->fn = hash_fast;
+            hasher->seed = random_seed();
+            break;
+        case HASH_CRC32C:
+#           if defined(__x86_64__)
+            if (have_crc32c()) {
+                hasher->name = "crc32c";
+                hasher->fn = hash_crc32c;
+                break;
+            }
+#           endif
+            if (debug) fprintf(stderr, "No CRC32C instruction, using the fast hash\n");
+            hasher->name = "fast";
+            hasher->fn = hash_fast;
+            break;
+        case HASH_LOOKUP3:
+            hasher->name = "lookup3";
+            hasher->fn = hash_lookup3;
+            break;
+    }
+}
+
+int hash_of_str(enum groupby_hash *hash, char const *str)
+{
+    static char const *const names[] = {
+        [HASH_FAST] = "fast", [HASH_SEEDED] = "seeded", [HASH_CRC32C] = "crc32c", [HASH_LOOKUP3] = "lookup3",
+    };
+    for (unsigned h = 0; h < SIZEOF_ARRAY(names); h++) {
+        if (0 == strcasecmp(str, names[h])) {
+            *hash = h;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown hash '%s' (fast, seeded, crc32c or lookup3)\n", str);
+    return -1;
+}
+
+#ifdef SELF_TEST
+#include <assert.h>
+
+#define MAXLEN 70
+
+/* check that every byte of the key changes the hash, for every length */
+static int driver1(struct hasher const *hasher)
+{
+    uint8_t buf[MAXLEN];
+    memset(buf, 'x', sizeof(buf));
+    for (size_t len = 1; len < MAXLEN; len++) {
+        uint64_t const ref = hasher->fn(buf, len, hasher->seed);
+        for (size_t i = 0; i < len; i++) {
+            for (unsigned bit = 0; bit < 8; bit++) {
+                buf[i] ^= 1U << bit;
+                uint64_t const h = hasher->fn(buf, len, hasher->seed);
+                buf[i] ^= 1U << bit;
+                if (h == ref) {
+                    printf("%s: flipping bit %u of byte %zu of %zu did not change the hash\n", hasher->name, bit, i, len);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* check that nothing but the key is hashed: neither alignment nor what follows */
+static int driver2(struct hasher const *hasher)
+{
+    uint8_t a[MAXLEN+8], b[MAXLEN+8];
+    for (size_t len = 0; len < MAXLEN; len++) {
+        for (size_t align = 0; align < 8; align++) {
+            memset(a, 'x', sizeof(a));
+            memset(b, 'y', sizeof(b));
+            memset(b + align, 'x', len);
+            if (hasher->fn(a, len, hasher->seed) != hasher->fn(b + align, len, hasher->seed)) {
+                printf("%s: hash of %zu bytes depends on alignment %zu or following bytes\n", hasher->name, len, align);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* check that keys of different lengths, and different seeds, give different hashes */
+static int driver3(struct hasher const *hasher)
+{
+    uint8_t const zeros[MAXLEN] = { 0 };
+    uint64_t prev[MAXLEN];
+    for (size_t len = 0; len < MAXLEN; len++) {
+        prev[len] = hasher->fn(zeros, len, hasher->seed);
+        for (size_t j = 0; j < len; j++) {
+            if (prev[j] == prev[len]) {
+                printf("%s: %zu and %zu null bytes hash the same\n", hasher->name, j, len);
+                return -1;
+            }
+        }
+        if (hasher->fn(zeros, len, hasher->seed + 1) == prev[len]) {
+            printf("%s: seed is ignored for %zu bytes\n", hasher->name, len);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* check that the low 16 bits spread sequential keys evenly enough */
+static int driver4(struct hasher const *hasher)
+{
+    enum { NB_BUCKETS = 1 << 16, NB_KEYS = 1 << 18 };
+    static unsigned buckets[NB_BUCKETS];
+    memset(buckets, 0, sizeof(buckets));
+    unsigned max = 0;
+    for (unsigned k = 0; k < NB_KEYS; k++) {
+        char key[16];
+        int const len = snprintf(key, sizeof(key), "%010u", k);
+        unsigned const b = hasher->fn(key, len, hasher->seed) & (NB_BUCKETS - 1);
+        if (++buckets[b] > max) max = buckets[b];
+    }
+    // 4 keys per bucket on average
+    if (max > 20) {
+        printf("%s: %u keys in the same bucket\n", hasher->name, max);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    for (enum groupby_hash h = HASH_FAST; h <= HASH_LOOKUP3; h++) {
+        struct hasher hasher;
+        hasher_ctor(&hasher, h);
+        printf("Testing %s\n", hasher.name);
+        assert(0 == driver1(&hasher));
+        assert(0 == driver2(&hasher));
+        assert(0 == driver3(&hasher));
+        assert(0 == driver4(&hasher));
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif  /* SELF_TEST */
@@ -0,0 +1,199 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Binary input formats (--input-format), the ones groupby writes (see
+ * output.c). Records are handed to the same callbacks as the CSV parser's,
+ * except that int64 values go to int_cb as they are, so that numeric
+ * aggregates fold them without converting them to text and back. Strings
+ * are given in place, since the writer ends them with a nul. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "groupby.h"
+
+struct binput {
+    ssize_t (*reader)(void *, size_t, void *);
+    void *user_data;
+    char *buf;
+    size_t size, len, pos;  // buf has len bytes, parsed up to pos
+    uint64_t offset;        // of buf in the input
+    bool eof;
+};
+
+/* Make sure that at least need bytes are available from pos, reading more
+ * if needed. Return how many are, fewer than need only at the end of input,
+ * or -1 on error. */
+static ssize_t binput_fill(struct binput *in, size_t need)
+{
+    if (in->len - in->pos >= need) return in->len - in->pos;
+    // Move what's left to the front, and enlarge the buffer for larger records
+    memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+    in->offset += in->pos;
+    in->len -= in->pos;
+    in->pos = 0;
+    if (need > in->size) {
+        size_t size = in->size;
+        while (size < need) {
+            if (size > SIZE_MAX / 2) {
+                fprintf(stderr, "Cannot grow input buffer to %zu bytes\n", need);
+                return -1;
+            }
+            size *= 2;
+        }
+        char *buf = big_realloc(in->buf, in->size, size);
+        if (! buf) {
+            fprintf(stderr, "Cannot realloc input buffer to %zu bytes\n", size);
+            return -1;
+        }
+        in->buf = buf;
+        in->size = size;
+    }
+    while (in->len < need && ! in->eof) {
+        STATS_START(STATS_READ);
+        ssize_t const r = in->reader(in->buf + in->len, in->size - in->len, in->user_data);
+        STATS_STOP(STATS_READ);
+        STATS_ADD(refills, 1);
+        if (r < 0) return -1;
+        if (r == 0) in->eof = true;
+        in->len += r;
+        STATS_ADD(bytes_read, r);
+    }
+    return in->len;
+}
+
+static int parse_rows(struct binput *in, void (*field_cb)(void *, size_t, void *), void (*int_cb)(long long, void *), void (*record_cb)(void *))
+{
+    while (true) {
+        ssize_t avail = binput_fill(in, 2 * sizeof(uint32_t));
+        if (avail <= 0) return avail;
+        uint32_t header[2];
+        if ((size_t)avail < sizeof(header)) goto truncated;
+        memcpy(header, in->buf + in->pos, sizeof(header));
+        size_t const size = header[0];
+        unsigned const nb_values = header[1];
+        size_t const lens_size = (nb_values * sizeof(uint32_t) + 7) & ~(size_t)7;
+        if (size % 8 || size < sizeof(header) + lens_size) goto invalid;
+        avail = binput_fill(in, size);
+        if (avail < 0) return -1;
+        if ((size_t)avail < size) goto truncated;
+
+        char *const rec = in->buf + in->pos;
+        uint32_t const *lens = (uint32_t const *)(rec + sizeof(header));
+        size_t off = sizeof(header) + lens_size;
+        for (unsigned v = 0; v < nb_values; v++) {
+            if (lens[v] == ROWS_INTEGER) {
+                if (off + sizeof(int64_t) > size) goto invalid;
+                int64_t i;
+                memcpy(&i, rec + off, sizeof(i));
+                int_cb(i, in->user_data);
+                off += sizeof(int64_t);
+            } else {
+                if (off + lens[v] >= size || rec[off + lens[v]] != '\0') goto invalid;
+                field_cb(rec + off, lens[v], in->user_data);
+                off += (lens[v] + 1 + 7) & ~(size_t)7;
+            }
+        }
+        record_cb(in->user_data);
+        in->pos += size;
+    }
+truncated:
+    fprintf(stderr, "Input ends within a record\n");
+    return -1;
+invalid:
+    fprintf(stderr, "Invalid record at input byte %"PRIu64"\n", in->offset + in->pos);
+    return -1;
+}
+
+static int parse_columns(struct binput *in, void (*field_cb)(void *, size_t, void *), void (*int_cb)(long long, void *), void (*record_cb)(void *))
+{
+    size_t const header_size = 4 + sizeof(uint32_t) + sizeof(uint64_t);
+    size_t const column_header_size = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    while (true) {
+        ssize_t avail = binput_fill(in, header_size);
+        if (avail <= 0) return avail;
+        if ((size_t)avail < header_size) goto truncated;
+        char const *batch = in->buf + in->pos;
+        if (0 != memcmp(batch, COLUMNS_MAGIC, 4)) goto invalid;
+        uint32_t nb_columns;
+        uint64_t nb_rows;
+        memcpy(&nb_columns, batch + 4, sizeof(nb_columns));
+        memcpy(&nb_rows, batch + 8, sizeof(nb_rows));
+        // Rows of no column would not be in the batch
+        if (nb_columns == 0 && nb_rows > 0) goto invalid;
+        size_t size = header_size + nb_columns * column_header_size;
+        avail = binput_fill(in, size);
+        if (avail < 0) return -1;
+        if ((size_t)avail < size) goto truncated;
+        batch = in->buf + in->pos;
+        for (unsigned c = 0; c < nb_columns; c++) {
+            uint64_t col_size;
+            memcpy(&col_size, batch + header_size + c * column_header_size + 8, sizeof(col_size));
+            if (col_size % 8 || __builtin_add_overflow(size, col_size, &size)) goto invalid;
+        }
+        avail = binput_fill(in, size);
+        if (avail < 0) return -1;
+        if ((size_t)avail < size) goto truncated;
+
+        // Check all columns first, then give the rows
+        char *const rec = in->buf + in->pos;
+        uint32_t const *headers = (uint32_t const *)(rec + header_size);
+        char *data = rec + header_size + nb_columns * column_header_size;
+        for (unsigned c = 0; c < nb_columns; c++) {
+            uint32_t const type = headers[4*c];
+            uint64_t const col_size = *(uint64_t const *)(headers + 4*c + 2);
+            // Every column has at least 8 bytes per row, which bounds nb_rows
+            if (type == COLUMN_INTEGER) {
+                if (col_size / sizeof(int64_t) != nb_rows) goto invalid;
+            } else if (type == COLUMN_STRING) {
+                if (col_size / sizeof(uint64_t) <= nb_rows) goto invalid;
+                uint64_t const *offsets = (uint64_t const *)data;
+                char const *bytes = (char const *)(offsets + nb_rows + 1);
+                uint64_t const bytes_size = col_size - (nb_rows + 1) * sizeof(uint64_t);
+                for (uint64_t r = 0; r < nb_rows; r++) {
+                    if (offsets[r+1] <= offsets[r] || offsets[r+1] > bytes_size || bytes[offsets[r+1] - 1] != '\0') goto invalid;
+                }
+            } else {
+                goto invalid;
+            }
+            data += col_size;
+        }
+        for (uint64_t r = 0; r < nb_rows; r++) {
+            data = rec + header_size + nb_columns * column_header_size;
+            for (unsigned c = 0; c < nb_columns; c++) {
+                uint64_t const col_size = *(uint64_t const *)(headers + 4*c + 2);
+                if (headers[4*c] == COLUMN_INTEGER) {
+                    int_cb(((int64_t const *)data)[r], in->user_data);
+                } else {
+                    uint64_t const *offsets = (uint64_t const *)data;
+                    char *bytes = (char *)(offsets + nb_rows + 1);
+                    field_cb(bytes + offsets[r], offsets[r+1] - offsets[r] - 1, in->user_data);
+                }
+                data += col_size;
+            }
+            record_cb(in->user_data);
+        }
+        in->pos += size;
+    }
+truncated:
+    fprintf(stderr, "Input ends within a batch\n");
+    return -1;
+invalid:
+    fprintf(stderr, "Invalid batch at input byte %"PRIu64"\n", in->offset + in->pos);
+    return -1;
+}
+
+int binary_parse(enum groupby_format format, ssize_t (*reader)(void *, size_t, void *), void *user_data,
+                 void (*field_cb)(void *, size_t, void *), void (*int_cb)(long long, void *), void (*record_cb)(void *))
+{
+    struct binput in = { .reader = reader, .user_data = user_data, .size = big_size(CSV_BLOCK_SIZE) };
+    in.buf = big_alloc(in.size);
+    if (! in.buf) {
+        fprintf(stderr, "Cannot malloc input buffer\n");
+        return -1;
+    }
+    int const err = format == FORMAT_ROWS ?
+        parse_rows(&in, field_cb, int_cb, record_cb) :
+        parse_columns(&in, field_cb, int_cb, record_cb);
+    big_free(in.buf, in.size);
+    return err;
+}
@@ -974,24 +974,33 @@ int driver4(void)
 int driver5(void)
 {
   uint32_t b,c;
+  int err = 0;
   b=0, c=0, hashlittle2("", 0, &c, &b);
   printf("hash is %"PRIx32" %"PRIx32"\n", c, b);   /* deadbeef deadbeef */
+  if (c != 0xdeadbeef || b != 0xdeadbeef) err = -1;
   b=0xdeadbeef, c=0, hashlittle2("", 0, &c, &b);
   printf("hash is %"PRIx32" %"PRIx32"\n", c, b);   /* bd5b7dde deadbeef */
+  if (c != 0xbd5b7dde || b != 0xdeadbeef) err = -1;
   b=0xdeadbeef, c=0xdeadbeef, hashlittle2("", 0, &c, &b);
   printf("hash is %"PRIx32" %"PRIx32"\n", c, b);   /* 9c093ccd bd5b7dde */
+  if (c != 0x9c093ccd || b != 0xbd5b7dde) err = -1;
   b=0, c=0, hashlittle2("Four score and seven years ago", 30, &c, &b);
   printf("hash is %"PRIx32" %"PRIx32"\n", c, b);   /* 17770551 ce7226e6 */
+  if (c != 0x17770551 || b != 0xce7226e6) err = -1;
   b=1, c=0, hashlittle2("Four score and seven years ago", 30, &c, &b);
   printf("hash is %"PRIx32" %"PRIx32"\n", c, b);   /* e3607cae bd371de4 */
+  if (c != 0xe3607cae || b != 0xbd371de4) err = -1;
   b=0, c=1, hashlittle2("Four score and seven years ago", 30, &c, &b);
   printf("hash is %"PRIx32" %"PRIx32"\n", c, b);   /* cd628161 6cbea4b3 */
+  if (c != 0xcd628161 || b != 0x6cbea4b3) err = -1;
   c = hashlittle("Four score and seven years ago", 30, 0);
   printf("hash is %"PRIx32"\n", c);   /* 17770551 */
+  if (c != 0x17770551) err = -1;
   c = hashlittle("Four score and seven years ago", 30, 1);
   printf("hash is %"PRIx32"\n", c);   /* cd628161 */
+  if (c != 0xcd628161) err = -1;
 
-  return 0;	// TODO
+  return err;
 }
 
 
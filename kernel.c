@@ -0,0 +1,104 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Fold kernels.
+ * A layout is named after its numeric aggregates in field order, each
+ * followed by the rank of its input field: -a 3:sum -a 7:sum is "sum0,sum1"
+ * while -a 5:min,5:max,5:avg is "min0,max0,avg0". Aggregates that do not
+ * read their field, such as count, have no rank. Layouts with a kernel below
+ * are folded with straight line code; others use the generic loop of
+ * group_fold. */
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "groupby.h"
+
+#define IN(i) long long const in##i = field_ll(fields, ints, k->field[i])
+#define SUM(a, i) aggr_sum_ll(values + k->offset[a], in##i)
+#define MIN(a, i) aggr_min_ll(values + k->offset[a], in##i)
+#define MAX(a, i) aggr_max_ll(values + k->offset[a], in##i)
+#define AVG(a, i) aggr_avg_ll(values + k->offset[a], in##i)
+#define COUNT(a) aggr_count(values + k->offset[a])
+
+#define KERNEL(name, ...)                                                     \
+static void fold_##name(struct fold_kernel const *k, char *values, char const *const *fields, long long const *ints) \
+{                                                                             \
+    __VA_ARGS__;                                                              \
+}
+
+KERNEL(sum0, IN(0); SUM(0, 0))
+KERNEL(sum0_sum1, IN(0); IN(1); SUM(0, 0); SUM(1, 1))
+KERNEL(sum0_sum1_sum2, IN(0); IN(1); IN(2); SUM(0, 0); SUM(1, 1); SUM(2, 2))
+KERNEL(sum0_sum1_sum2_sum3, IN(0); IN(1); IN(2); IN(3); SUM(0, 0); SUM(1, 1); SUM(2, 2); SUM(3, 3))
+KERNEL(min0, IN(0); MIN(0, 0))
+KERNEL(max0, IN(0); MAX(0, 0))
+KERNEL(avg0, IN(0); AVG(0, 0))
+KERNEL(avg0_avg1, IN(0); IN(1); AVG(0, 0); AVG(1, 1))
+KERNEL(min0_max0, IN(0); MIN(0, 0); MAX(1, 0))
+KERNEL(min0_max0_avg0, IN(0); MIN(0, 0); MAX(1, 0); AVG(2, 0))
+KERNEL(min0_max0_sum0, IN(0); MIN(0, 0); MAX(1, 0); SUM(2, 0))
+KERNEL(count, (void)fields; (void)ints; COUNT(0))
+KERNEL(count_sum0, IN(0); COUNT(0); SUM(1, 0))
+KERNEL(sum0_count, IN(0); SUM(0, 0); COUNT(1))
+KERNEL(count_sum0_sum1, IN(0); IN(1); COUNT(0); SUM(1, 0); SUM(2, 1))
+KERNEL(sum0_sum1_count, IN(0); IN(1); SUM(0, 0); SUM(1, 1); COUNT(2))
+
+static struct {
+    char const *name;
+    void (*fold)(struct fold_kernel const *, char *, char const *const *, long long const *);
+} const kernels[] = {
+    { "sum0", fold_sum0 },
+    { "sum0,sum1", fold_sum0_sum1 },
+    { "sum0,sum1,sum2", fold_sum0_sum1_sum2 },
+    { "sum0,sum1,sum2,sum3", fold_sum0_sum1_sum2_sum3 },
+    { "min0", fold_min0 },
+    { "max0", fold_max0 },
+    { "avg0", fold_avg0 },
+    { "avg0,avg1", fold_avg0_avg1 },
+    { "min0,max0", fold_min0_max0 },
+    { "min0,max0,avg0", fold_min0_max0_avg0 },
+    { "min0,max0,sum0", fold_min0_max0_sum0 },
+    { "count", fold_count },
+    { "count,sum0", fold_count_sum0 },
+    { "sum0,count", fold_sum0_count },
+    { "count,sum0,sum1", fold_count_sum0_sum1 },
+    { "sum0,sum1,count", fold_sum0_sum1_count },
+};
+
+void fold_kernel_select(struct fold_kernel *k, struct row_conf const *conf)
+{
+    k->name = NULL;
+    k->nb_fields = 0;
+
+    char layout[KERNEL_MAX_AGGRS * 16] = "";
+    size_t len = 0;
+    unsigned nb_inputs = 0, nb_aggrs = 0;
+    unsigned last_field = UINT_MAX;
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        struct aggr_func const *func = conf->aggrs[a].func;
+        unsigned const field = conf->aggrs[a].field;
+        if (0 == strcmp(func->name, "rem")) continue;   // nothing to fold
+        if (! func->ops.fold_ll || nb_aggrs >= KERNEL_MAX_AGGRS) return;
+        k->nb_fields = field + 1;
+        if (func->ops.fold_row) {
+            k->offset[nb_aggrs++] = conf->aggr_cumul_size[a];
+            len += snprintf(layout + len, sizeof(layout) - len, "%s%s", len ? ",":"", func->name);
+            continue;
+        }
+        if (field != last_field) {  // aggrs are ordered by field
+            if (nb_inputs >= KERNEL_MAX_INPUTS) return;
+            k->field[nb_inputs++] = last_field = field;
+        }
+        k->offset[nb_aggrs++] = conf->aggr_cumul_size[a];
+        len += snprintf(layout + len, sizeof(layout) - len, "%s%s%u", len ? ",":"", func->name, nb_inputs-1);
+    }
+
+    for (unsigned i = 0; i < SIZEOF_ARRAY(kernels); i++) {
+        if (0 == strcmp(layout, kernels[i].name)) {
+            k->name = kernels[i].name;
+            k->fold = kernels[i].fold;
+            if (debug) fprintf(stderr, "Using fold kernel %s\n", k->name);
+            return;
+        }
+    }
+    if (debug) fprintf(stderr, "No fold kernel for layout '%s'\n", layout);
+}
@@ -0,0 +1,190 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef LIBGROUPBY_H_110404
+#define LIBGROUPBY_H_110404
+/* Public interface of libgroupby.
+ *
+ * A struct groupby holds all the state of one aggregation, so any number of
+ * them can run in the same process, each from its own thread. What is not
+ * per groupby:
+ * - the string dictionary, shared by all of them and thread safe;
+ * - debug and huge_pages, plain globals meant for the command line, to be
+ *   set before creating any groupby and left alone while some run;
+ * - the --stats counters (struct stats), one per thread, that are only
+ *   counted once stats.enabled is set in that thread (the threads of -j
+ *   add theirs to those of the thread that started them).
+ *
+ * Typical use:
+ *   struct row_conf *conf = row_conf_new(100);
+ *   row_conf_aggr(conf, "5:sum");
+ *   row_conf_finalize(100, conf);
+ *   struct groupby *gb = groupby_new(conf, &(struct groupby_options){ .delimiter = ',' });
+ *   while (...) groupby_push(gb, buf, len);
+ *   groupby_finish(gb);
+ *   struct groupby_iter it;
+ *   groupby_iter_init(&it, gb);
+ *   while (groupby_iter_next(&it)) { ... groupby_iter_value(&it, f) ... }
+ *   groupby_iter_fini(&it);
+ *   groupby_del(gb);
+ *   row_conf_del(conf);
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Row configuration: what to do with each field
+ */
+
+struct row_conf;
+
+// Return an empty row_conf, with room for that many fields (it grows as
+// options name further fields)
+struct row_conf *row_conf_new(unsigned nb_fields_hint);
+void row_conf_del(struct row_conf *);
+
+// Apply a -a (field_spec[:func],...) or -g (field_spec) option to the conf
+int row_conf_aggr(struct row_conf *, char const *);
+int row_conf_group(struct row_conf *, char const *);
+// Only aggregate the rows satisfying this --where predicate (field followed by
+// one of = != ^= < <= > >= then a value, or values separated by '|' for the
+// string comparisons = != and ^=)
+int row_conf_where(struct row_conf *, char const *);
+
+// Must be called once all fields are configured, before groupby_new.
+// nb_max_fields only bounds the fields given a function by an open field_spec
+// (such as 3-:sum); fields past the named ones are grouped otherwise.
+// -1 if it cannot allocate them (already reported).
+int row_conf_finalize(unsigned nb_max_fields, struct row_conf *);
+
+/*
+ * Options
+ */
+
+enum groupby_engine {
+    ENGINE_HASH,    // groups are looked up in a hash table for each row
+    ENGINE_SORT,    // rows are buffered, sorted by key then folded
+};
+
+struct output_order {
+    enum { ORDER_NONE, ORDER_KEY, ORDER_FIELD } by;
+    unsigned aggr;      // when by == ORDER_FIELD: which aggregate (from 0, in output order)
+    bool desc;
+};
+
+// Parse a --sort-by option (key|column[:desc])
+int output_order_parse(struct output_order *, char const *, struct row_conf const *);
+
+// How group keys are hashed (ENGINE_HASH)
+enum groupby_hash {
+    HASH_FAST,      // 64 bits multiply-mix hash (the default)
+    HASH_SEEDED,    // same, with a random seed so that collisions cannot be planned
+    HASH_CRC32C,    // using the CRC32C instruction if available
+    HASH_LOOKUP3,   // Bob Jenkins' lookup3
+};
+
+// Parse a --hash option
+int hash_of_str(enum groupby_hash *, char const *);
+
+// How threads share the groups (see nb_threads)
+enum groupby_parallel {
+    PARALLEL_PARTITIONED,   // each thread has its own groups, merged by partitions of the keys at the end
+    PARALLEL_SHARED,        // all threads fold into the same table, with atomic updates
+};
+
+// Parse a --parallel option
+int parallel_of_str(enum groupby_parallel *, char const *);
+
+// Formats of the input and of the output (see output.c for the binary ones)
+enum groupby_format {
+    FORMAT_CSV,     // one line per row or group, values as text
+    FORMAT_ROWS,    // one length-prefixed binary record per row or group
+    FORMAT_COLUMNS, // batches of rows or groups stored column by column, integers as int64
+};
+
+// Parse an --input-format or --output-format option
+int format_of_str(enum groupby_format *, char const *);
+
+struct groupby_options {
+    enum groupby_engine engine;
+    struct output_order order;
+    char delimiter;
+    enum groupby_hash hash;
+    // Bytes of input to sample first to estimate the number of groups, 0 for none
+    size_t sample_size;
+    // Above that many bytes of groups do_groupby partitions the input on
+    // disk, 0 for the physical memory
+    unsigned long long max_memory;
+    // Threads aggregating a file given to groupby_read, 0 or 1 for none
+    unsigned nb_threads;
+    // CPUs to pin these threads to, as in "0-3,8", NULL for all allowed CPUs in order
+    char const *affinity;
+    enum groupby_parallel parallel;
+    // Buffers of 1MB that groupby_read keeps reading ahead, 0 for none
+    unsigned readahead;
+    // Read files with O_DIRECT when reading ahead
+    bool direct;
+    // Fold rows one at a time even while there are few groups (ENGINE_HASH)
+    bool no_dense;
+    // Format of what groupby_read reads (groupby_push only takes CSV)
+    enum groupby_format input_format;
+    enum groupby_format output_format;
+};
+
+/*
+ * Aggregation context
+ */
+
+struct groupby;
+
+// The conf must outlive the groupby
+struct groupby *groupby_new(struct row_conf const *, struct groupby_options const *);
+void groupby_del(struct groupby *);
+
+// Feed CSV text, cut anywhere; records are aggregated as soon as they are complete
+int groupby_push(struct groupby *, void const *buf, size_t len);
+// Feed one already split record (fields need not be nul terminated)
+int groupby_push_record(struct groupby *, char const *const fields[], size_t const lens[], unsigned nb_fields);
+// Read and aggregate this file descriptor up to EOF, in opts->input_format (do not mix with groupby_push)
+int groupby_read(struct groupby *, int fd);
+// Sample this file descriptor to size the groups before groupby_read (see sample_size)
+int groupby_estimate(struct groupby *, int fd);
+// Once all input is in: aggregate what's left and order the results
+int groupby_finish(struct groupby *);
+
+// Number of groups, once finished
+size_t groupby_nb_groups(struct groupby const *);
+// Write the results in opts->output_format (CSV by default), once finished
+int groupby_write(struct groupby *, int fd);
+
+/*
+ * Iterating over the results, once finished
+ */
+
+struct groupby_iter {
+    struct groupby *groupby;
+    size_t next;
+    struct group *group;
+    char const **values;    // output values of the current group (NULL until finalized)
+    unsigned *aggrs;        // the aggregate each of them comes from (UINT_MAX for grouped values)
+    unsigned nb_values;
+    char const **grouped;   // values of its key
+    unsigned max_fields;    // room for that many fields in values and grouped
+    char *scratch;  // where aggregate values are written
+};
+
+int groupby_iter_init(struct groupby_iter *, struct groupby *);
+void groupby_iter_fini(struct groupby_iter *);
+// Move to the next group; false once all groups were seen
+bool groupby_iter_next(struct groupby_iter *);
+// How many values the current group has (grouped fields and aggregates)
+unsigned groupby_iter_nb_values(struct groupby_iter const *);
+// Value number v of the current group, valid until the next call to groupby_iter_next
+char const *groupby_iter_value(struct groupby_iter const *, unsigned v);
+// If value number v is an integer (sum, min, max, avg), set *value to it
+// without converting it to a string and return true
+bool groupby_iter_integer(struct groupby_iter const *, unsigned v, long long *value);
+
+// Convenience for the command line: aggregate ifile into ofile (if ofile is negative then groups are built but not output)
+int do_groupby(struct row_conf const *, struct groupby_options const *, int ifile, int ofile);
+
+#endif
@@ -11,126 +11,41 @@
 #include "groupby.h"
 #include "config.h"
 
-bool debug = false;
-unsigned nb_max_fields = NB_MAX_FIELDS;
-
-static int aggr_of_str(char const *str, struct aggr_func const **aggr)
-{
-    for (unsigned f = 0; f < nb_aggr_funcs; f++) {
-        if (strcasecmp(str, aggr_funcs[f].name) == 0) {
-            *aggr = aggr_funcs+f;
-            return 0;
-        }
-    }
-    fprintf(stderr, "Unknown function '%s'\n", str);
-    return -1;
-}
-
-static void set_range(struct row_conf *row_conf, unsigned first, unsigned last, struct aggr_func const *aggr, bool inv)
-{
-    if (last < first) {
-        unsigned tmp = first;
-        first = last; last = tmp;
-    }
-
-    for (unsigned f = 0; f < row_conf->nb_fields; f++) {
-        bool const in_between = f >= first && f <= last;
-        if ((!inv && in_between) || (inv && !in_between)) {
-            assert(f < row_conf->nb_fields);
-            row_conf->fields[f] = aggr;
-            if (aggr) {
-                if (debug) fprintf(stderr, "field %u uses aggr function %s\n", f, aggr->name);
-            } else {
-                if (debug) fprintf(stderr, "field %u is groupped\n", f);
-            }
-        }
-    }
-}
-
-static int set_fieldspec_conf(struct row_conf *row_conf, char const *start, char const *stop, struct aggr_func const *aggr, bool inv)
-{
-    char const *const spec = start;
-    int const spec_len = stop - start;
-    if (start >= stop) return 0;
-    if (*start == '!') return set_fieldspec_conf(row_conf, start+1, stop, aggr, inv);
-
-    unsigned first = 0, last = 0;   // invalid field numbers
-    char *eoi;
-    // read first
-    first = strtoul(start, &eoi, 0);
-    if (eoi == start) {
-        first = 1;
-    } else {
-        start = eoi;
-    }
-
-    if (*start == '-') {
-        start ++;
-        last = strtoul(start, &eoi, 0);
-        if (eoi == start) {
-            last = NB_MAX_FIELDS+1;
-        } else {
-            start = eoi;
-        }
-    } else {
-        last = first;
-    }
-
-    if (start < stop && *start != ',') {
-        fprintf(stderr, "Bad field spec: '%.*s'\n", spec_len, spec);
-        return -1;
-    }
-
-    if (first == 0 || last == 0) {
-        fprintf(stderr, "Fields are numbered from 1\n");
-        return -1;
-    }
-
-    set_range(row_conf, first-1, last-1, aggr, inv);
-
-    if (start >= stop) return 0;
-
-    return set_fieldspec_conf(row_conf, start+1, stop, aggr, inv);
-}
-
-static int aggr_conf(struct row_conf *row_conf, char const *opt)
-{
-    // First look for the function to set
-    struct aggr_func const *aggr = NULL;
-    char const *colon = strchr(opt, ':');
-    if (colon) {
-        if (0 != aggr_of_str(colon+1, &aggr)) {
-            return -1;
-        }
-    } else {
-        colon = rawmemchr(opt, '\0');
-        aggr_of_str("rem", &aggr);
-    }
-
-    // Now set this aggr function for each specified field
-    return set_fieldspec_conf(row_conf, opt, colon, aggr, false);
-}
-
-static int group_conf(struct row_conf *row_conf, char const *opt)
-{
-    return set_fieldspec_conf(row_conf, opt, opt + strlen(opt), NULL, false);
-}
+#define DEFAULT_SAMPLE_MB 4
+#define DEFAULT_READAHEAD 8
 
 static void syntax(void)
 {
-    printf("groupby [-h | -a field_spec:function ... | -g field_spec] [-d char] [-i input] [-o output] [-v] [-m max-fields]\n"
+    printf("groupby [-h | -a field_spec:function,... ... | -g field_spec] [-d char] [-i input] [-o output] [-v] [-m max-fields] [--engine=hash|sort] [--hash=fast|seeded|crc32c|lookup3] [--where predicate ...] [--sort-by key|column[:desc]] [--estimate[=MB]] [--max-memory=MB] [-j threads] [--affinity=cpus] [--parallel=partitioned|shared] [--readahead[=N]] [--direct] [--no-dense] [--huge-pages] [--input-format=csv|rows|columns] [--output-format=csv|rows|columns] [--stats[=human|json]] [--numa]\n"
            "\n"
            "where :\n"
            "  field_spec : n | n-m | -n | n- | field_spec,field_spec | !field_spec\n"
-           "  n/m : field numbers (first field is 1)\n");
+           "  n/m : field numbers (first field is 1)\n"
+           "  -a 5:min,5:max : several aggregates of the same field, output in consecutive columns\n"
+           "  -m : how many fields an open field_spec with a function (such as -a 3-:sum) may cover (default %u); other fields are not limited\n"
+           "  predicate : n=v | n!=v | n^=prefix | n<i | n<=i | n>i | n>=i, with v1|v2|... to match any of several values\n"
+           "  --sort-by : output groups by key or by the aggregate in an output column, ascending unless :desc\n"
+           "  --estimate : sample that many MB of input (default %u) to size the groups beforehand\n"
+           "  --max-memory : with --estimate, partition the input on disk if the groups would need more (default: physical memory)\n"
+           "  -j : aggregate an input file with that many threads, pinned to the CPUs listed in --affinity (such as 0-3,8)\n"
+           "  --parallel : whether these threads fold into tables of their own merged at the end (the default) or into a shared one\n"
+           "  --readahead : keep reading that many 1MB buffers of input ahead of the parser (default %u)\n"
+           "  --direct : with --readahead, read files with O_DIRECT, bypassing the page cache\n"
+           "  --no-dense : fold rows one by one even while there are few groups, instead of by batches\n"
+           "  --huge-pages : allocate the hash tables, groups and parse buffers from 2MB pages\n"
+           "  --input-format : read CSV (the default), or the binary rows or columns that --output-format writes\n"
+           "  --output-format : output CSV (the default), or binary length-prefixed rows or batches of columns (see README)\n"
+           "  --numa : add to the stats how many pages of groups are local to the thread using them\n",
+           NB_MAX_FIELDS, DEFAULT_SAMPLE_MB, DEFAULT_READAHEAD);
 }
 
 int main(int nb_args, char **args)
 {
-    struct row_conf *row_conf = row_conf_new(NB_MAX_FIELDS); // as a first version
-    char delimiter = ',';
+    struct row_conf *row_conf = row_conf_new(0);
+    struct groupby_options opts = { .engine = ENGINE_HASH, .order = { .by = ORDER_NONE }, .delimiter = ',', .hash = HASH_FAST };
     int input = 0;
     int output = 1;
+    char const *sort_by = NULL;
 
     for (int a = 1; a < nb_args; a++) {
         if (strcasecmp(args[a], "-h") == 0 || strcasecmp(args[a], "--help") == 0) {
@@ -138,20 +53,66 @@ int main(int nb_args, char **args)
             return EXIT_SUCCESS;
         } else if (strcasecmp(args[a], "-v") == 0 || strcasecmp(args[a], "--verbose") == 0) {
             debug = true;
+        } else if (strcasecmp(args[a], "--engine=hash") == 0) {
+            opts.engine = ENGINE_HASH;
+        } else if (strcasecmp(args[a], "--engine=sort") == 0) {
+            opts.engine = ENGINE_SORT;
+        } else if (strncasecmp(args[a], "--hash=", 7) == 0) {
+            if (0 != hash_of_str(&opts.hash, args[a]+7)) return EXIT_FAILURE;
+        } else if (strcasecmp(args[a], "--estimate") == 0) {
+            opts.sample_size = DEFAULT_SAMPLE_MB << 20;
+        } else if (strncasecmp(args[a], "--estimate=", 11) == 0) {
+            opts.sample_size = strtoul(args[a]+11, NULL, 0) << 20;
+        } else if (strncasecmp(args[a], "--max-memory=", 13) == 0) {
+            opts.max_memory = strtoull(args[a]+13, NULL, 0) << 20;
+        } else if ((strcmp(args[a], "-j") == 0 || strcasecmp(args[a], "--threads") == 0) && a < nb_args-1) {
+            opts.nb_threads = strtoul(args[++a], NULL, 0);
+        } else if (strncasecmp(args[a], "--affinity=", 11) == 0) {
+            opts.affinity = args[a]+11;
+        } else if (strncasecmp(args[a], "--parallel=", 11) == 0) {
+            if (0 != parallel_of_str(&opts.parallel, args[a]+11)) return EXIT_FAILURE;
+        } else if (strcasecmp(args[a], "--readahead") == 0) {
+            opts.readahead = DEFAULT_READAHEAD;
+        } else if (strncasecmp(args[a], "--readahead=", 12) == 0) {
+            opts.readahead = strtoul(args[a]+12, NULL, 0);
+        } else if (strcasecmp(args[a], "--direct") == 0) {
+            opts.direct = true;
+        } else if (strcasecmp(args[a], "--no-dense") == 0) {
+            opts.no_dense = true;
+        } else if (strcasecmp(args[a], "--huge-pages") == 0) {
+            huge_pages = true;
+        } else if (strncasecmp(args[a], "--input-format=", 15) == 0) {
+            if (0 != format_of_str(&opts.input_format, args[a]+15)) return EXIT_FAILURE;
+        } else if (strncasecmp(args[a], "--output-format=", 16) == 0) {
+            if (0 != format_of_str(&opts.output_format, args[a]+16)) return EXIT_FAILURE;
+        } else if (strcasecmp(args[a], "--numa") == 0) {
+            stats.enabled = stats.numa = true;
+        } else if (strcasecmp(args[a], "--sort-by") == 0 && a < nb_args-1) {
+            sort_by = args[++a];
+        } else if (strcasecmp(args[a], "--stats") == 0 || strcasecmp(args[a], "--stats=human") == 0) {
+            stats.enabled = true;
+        } else if (strcasecmp(args[a], "--stats=json") == 0) {
+            stats.enabled = stats.json = true;
         } else if (strcasecmp(args[a], "-a") == 0 && a < nb_args-1) {
-            if (0 != aggr_conf(row_conf, args[a+1])) {
+            if (0 != row_conf_aggr(row_conf, args[a+1])) {
+                fprintf(stderr, "Try --help");
+                return EXIT_FAILURE;
+            }
+            a ++;
+        } else if (strcasecmp(args[a], "--where") == 0 && a < nb_args-1) {
+            if (0 != row_conf_where(row_conf, args[a+1])) {
                 fprintf(stderr, "Try --help");
                 return EXIT_FAILURE;
             }
             a ++;
         } else if (strcasecmp(args[a], "-g") == 0 && a < nb_args-1) {
-            if (0 != group_conf(row_conf, args[a+1])) {
+            if (0 != row_conf_group(row_conf, args[a+1])) {
                 fprintf(stderr, "Try --help");
                 return EXIT_FAILURE;
             }
             a ++;
         } else if (strcasecmp(args[a], "-m") == 0 || strcasecmp(args[a], "--max-fields") == 0) {
-            nb_max_fields = strtoul(args[a+1], NULL, 0);    // FIXME
+            nb_max_fields = strtoul(args[a+1], NULL, 0);
             if (debug) fprintf(stderr, "Setting max number of fields to %u\n", nb_max_fields);
             a ++;
         } else if (strcasecmp(args[a], "-d") == 0 && a < nb_args-1) {
@@ -159,8 +120,8 @@ int main(int nb_args, char **args)
                 fprintf(stderr, "Delimiter must be a single char\n");
                 return EXIT_FAILURE;
             }
-            delimiter = args[a+1][0];
-            if (debug) fprintf(stderr, "Delimiter is now '%c'\n", delimiter);
+            opts.delimiter = args[a+1][0];
+            if (debug) fprintf(stderr, "Delimiter is now '%c'\n", opts.delimiter);
             a ++;
         } else if ((strcasecmp(args[a], "-i") == 0 || strcasecmp(args[a], "--input") == 0) && a < nb_args-1) {
             input = open(args[a+1], O_RDONLY);
@@ -183,11 +144,19 @@ int main(int nb_args, char **args)
         }
     }
 
-    row_conf_finalize(nb_max_fields, row_conf);
+    if (0 != row_conf_finalize(nb_max_fields, row_conf)) return EXIT_FAILURE;
 
-    if (0 != do_groupby(row_conf, delimiter, input, output)) {
+    if (sort_by && 0 != output_order_parse(&opts.order, sort_by, row_conf)) {
         return EXIT_FAILURE;
     }
 
+    if (stats.enabled) stats_begin();
+
+    if (0 != do_groupby(row_conf, &opts, input, output)) {
+        return EXIT_FAILURE;
+    }
+
+    if (stats.enabled) stats_print(stderr);
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,332 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Binary output formats (--output-format), for tools that would rather mmap
+ * the results than parse CSV, and that groupby reads back (see input.c).
+ * Strings are followed by a nul byte, so that they can be used in place.
+ * Integers are int64 and lengths unsigned, all in
+ * the byte order of the host. Everything is padded to 8 bytes, so that once
+ * the file is mapped every int64 is aligned. Output goes through an aligned
+ * buffer of 1MB, written whole.
+ *
+ * rows: one record per group, in output order:
+ *   uint32 size of the record (header included), uint32 number of values,
+ *   uint32 length of each value (UINT32_MAX for an int64), padded to 8 bytes,
+ *   then each value (the int64 or the string and its nul) padded to 8 bytes.
+ *
+ * columns: batches of up to COLUMNS_BATCH groups:
+ *   "GBYC", uint32 number of columns, uint64 number of rows,
+ *   for each column: uint32 type (0 for strings, 1 for int64), uint32 0,
+ *   uint64 size of its data,
+ *   then the data of each column: the int64 of each row, or the nb_rows+1
+ *   uint64 offsets of each string in the bytes that follow them (offset
+ *   r+1 is past the nul ending string r), padded to 8 bytes.
+ * Groups may have fewer values than others when the number of fields varies;
+ * their missing values are 0 or empty. Integers (sum, min, max, avg) are taken
+ * from the aggregates as they are, without ever going through a string. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include "groupby.h"
+
+#define OUTPUT_BUF_SIZE (1U << 20)
+#define OUTPUT_ALIGN 4096
+#define COLUMNS_BATCH 4096
+
+int format_of_str(enum groupby_format *format, char const *str)
+{
+    if (0 == strcasecmp(str, "csv")) {
+        *format = FORMAT_CSV;
+    } else if (0 == strcasecmp(str, "rows")) {
+        *format = FORMAT_ROWS;
+    } else if (0 == strcasecmp(str, "columns")) {
+        *format = FORMAT_COLUMNS;
+    } else {
+        fprintf(stderr, "Unknown output format '%s' (csv, rows or columns)\n", str);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Output buffer
+ */
+
+struct output {
+    int fd;
+    size_t len;
+    char *buf;
+};
+
+static int output_flush(struct output *out)
+{
+    for (size_t done = 0; done < out->len; ) {
+        ssize_t const w = write(out->fd, out->buf + done, out->len - done);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            return -1;
+        }
+        done += w;
+    }
+    out->len = 0;
+    return 0;
+}
+
+static int output_append(struct output *out, void const *src_, size_t len)
+{
+    char const *src = src_;
+    while (len > 0) {
+        size_t n = OUTPUT_BUF_SIZE - out->len;
+        if (n > len) n = len;
+        memcpy(out->buf + out->len, src, n);
+        out->len += n;
+        src += n;
+        len -= n;
+        if (out->len == OUTPUT_BUF_SIZE && 0 != output_flush(out)) return -1;
+    }
+    return 0;
+}
+
+static size_t pad8(size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+static int output_pad(struct output *out, size_t len)
+{
+    static char const zeros[8];
+    return output_append(out, zeros, pad8(len) - len);
+}
+
+/*
+ * rows
+ */
+
+static int write_rows(struct groupby_iter *iter, struct output *out)
+{
+    uint32_t *lens = NULL;
+    unsigned lens_size = 0;
+    int err = 0;
+    while (! err && groupby_iter_next(iter)) {
+        unsigned const nb_values = groupby_iter_nb_values(iter);
+        if (nb_values > lens_size) {
+            uint32_t *l = realloc(lens, nb_values * sizeof(*lens));
+            if (! l) {
+                fprintf(stderr, "Cannot alloc lengths of %u values\n", nb_values);
+                err = -1;
+                break;
+            }
+            lens = l;
+            lens_size = nb_values;
+        }
+        uint64_t size = 2 * sizeof(uint32_t) + pad8(nb_values * sizeof(uint32_t));
+        for (unsigned v = 0; v < nb_values; v++) {
+            long long ll;
+            if (groupby_iter_integer(iter, v, &ll)) {
+                lens[v] = ROWS_INTEGER;
+                size += sizeof(int64_t);
+            } else {
+                size_t const len = strlen(groupby_iter_value(iter, v));
+                lens[v] = len < ROWS_INTEGER ? len : ROWS_INTEGER;
+                size += pad8(len + 1);
+            }
+        }
+        if (size > UINT32_MAX) {
+            fprintf(stderr, "Group of %"PRIu64" bytes too large for the rows format\n", size);
+            err = -1;
+            break;
+        }
+        uint32_t const header[2] = { size, nb_values };
+        err = output_append(out, header, sizeof(header)) ||
+              output_append(out, lens, nb_values * sizeof(*lens)) ||
+              output_pad(out, nb_values * sizeof(*lens));
+        for (unsigned v = 0; ! err && v < nb_values; v++) {
+            if (lens[v] == ROWS_INTEGER) {
+                long long ll;
+                groupby_iter_integer(iter, v, &ll);
+                int64_t const i = ll;
+                err = output_append(out, &i, sizeof(i));
+            } else {
+                err = output_append(out, groupby_iter_value(iter, v), lens[v] + 1) ||
+                      output_pad(out, lens[v] + 1);
+            }
+        }
+    }
+    free(lens);
+    return err ? -1 : 0;
+}
+
+/*
+ * columns
+ */
+
+struct column {
+    enum column_type type;
+    union {
+        int64_t *ints;      // COLUMNS_BATCH of them
+        uint64_t *offsets;  // COLUMNS_BATCH+1 of them
+    } u;
+    char *bytes;
+    size_t bytes_len, bytes_size;
+};
+
+struct batch {
+    unsigned nb_rows;
+    unsigned nb_columns, columns_size;
+    struct column *columns;
+};
+
+static void batch_dtor(struct batch *batch)
+{
+    for (unsigned c = 0; c < batch->nb_columns; c++) {
+        free(batch->columns[c].u.ints);
+        free(batch->columns[c].bytes);
+    }
+    free(batch->columns);
+}
+
+static int column_append_str(struct column *col, unsigned r, char const *str)
+{
+    size_t const len = strlen(str) + 1;
+    if (col->bytes_len + len > col->bytes_size) {
+        size_t size = col->bytes_size ? col->bytes_size : 4096;
+        while (size < col->bytes_len + len) size *= 2;
+        char *bytes = realloc(col->bytes, size);
+        if (! bytes) {
+            fprintf(stderr, "Cannot alloc %zu bytes of strings\n", size);
+            return -1;
+        }
+        col->bytes = bytes;
+        col->bytes_size = size;
+    }
+    memcpy(col->bytes + col->bytes_len, str, len);
+    col->bytes_len += len;
+    col->u.offsets[r+1] = col->bytes_len;
+    return 0;
+}
+
+// Row r of this column has no value
+static int column_skip(struct column *col, unsigned r)
+{
+    if (col->type == COLUMN_STRING) return column_append_str(col, r, "");
+    col->u.ints[r] = 0;
+    return 0;
+}
+
+// Add a column of that type, empty for the rows of the batch so far
+static struct column *batch_add_column(struct batch *batch, enum column_type type)
+{
+    if (batch->nb_columns >= batch->columns_size) {
+        unsigned const size = batch->columns_size ? 2 * batch->columns_size : 16;
+        struct column *columns = realloc(batch->columns, size * sizeof(*columns));
+        if (! columns) goto err;
+        batch->columns = columns;
+        batch->columns_size = size;
+    }
+    struct column *col = batch->columns + batch->nb_columns;
+    memset(col, 0, sizeof(*col));
+    col->type = type;
+    col->u.ints = malloc((COLUMNS_BATCH + 1) * sizeof(int64_t));
+    if (! col->u.ints) goto err;
+    batch->nb_columns ++;
+    if (type == COLUMN_STRING) col->u.offsets[0] = 0;
+    for (unsigned r = 0; r < batch->nb_rows; r++) {
+        if (0 != column_skip(col, r)) return NULL;
+    }
+    return col;
+err:
+    fprintf(stderr, "Cannot alloc column %u of a batch\n", batch->nb_columns);
+    return NULL;
+}
+
+static size_t column_size(struct column const *col, unsigned nb_rows)
+{
+    if (col->type == COLUMN_INTEGER) return nb_rows * sizeof(int64_t);
+    return (nb_rows + 1) * sizeof(uint64_t) + pad8(col->bytes_len);
+}
+
+static int batch_write(struct batch *batch, struct output *out)
+{
+    if (! batch->nb_rows) return 0;
+    uint32_t const nb_columns = batch->nb_columns;
+    uint64_t const nb_rows = batch->nb_rows;
+    if (0 != output_append(out, COLUMNS_MAGIC, 4) ||
+        0 != output_append(out, &nb_columns, sizeof(nb_columns)) ||
+        0 != output_append(out, &nb_rows, sizeof(nb_rows))) return -1;
+    for (unsigned c = 0; c < batch->nb_columns; c++) {
+        struct column const *col = batch->columns + c;
+        uint32_t const type[2] = { col->type, 0 };
+        uint64_t const size = column_size(col, batch->nb_rows);
+        if (0 != output_append(out, type, sizeof(type)) ||
+            0 != output_append(out, &size, sizeof(size))) return -1;
+    }
+    for (unsigned c = 0; c < batch->nb_columns; c++) {
+        struct column *col = batch->columns + c;
+        if (col->type == COLUMN_INTEGER) {
+            if (0 != output_append(out, col->u.ints, batch->nb_rows * sizeof(int64_t))) return -1;
+        } else {
+            if (0 != output_append(out, col->u.offsets, (batch->nb_rows + 1) * sizeof(uint64_t)) ||
+                0 != output_append(out, col->bytes, col->bytes_len) ||
+                0 != output_pad(out, col->bytes_len)) return -1;
+            col->bytes_len = 0;
+        }
+    }
+    batch->nb_rows = 0;
+    return 0;
+}
+
+static int write_columns(struct groupby_iter *iter, struct output *out)
+{
+    struct batch batch = { .nb_rows = 0 };
+    int err = 0;
+    while (! err && groupby_iter_next(iter)) {
+        unsigned const nb_values = groupby_iter_nb_values(iter);
+        unsigned const r = batch.nb_rows;
+        for (unsigned v = 0; ! err && v < nb_values; v++) {
+            long long ll;
+            bool const is_int = groupby_iter_integer(iter, v, &ll);
+            struct column *col = v < batch.nb_columns ? batch.columns + v :
+                batch_add_column(&batch, is_int ? COLUMN_INTEGER : COLUMN_STRING);
+            if (! col) {
+                err = -1;
+            } else if (is_int != (col->type == COLUMN_INTEGER)) {
+                fprintf(stderr, "Value %u of a group is not of the type of its column\n", v);
+                err = -1;
+            } else if (is_int) {
+                col->u.ints[r] = ll;
+            } else {
+                err = column_append_str(col, r, groupby_iter_value(iter, v));
+            }
+        }
+        for (unsigned c = nb_values; ! err && c < batch.nb_columns; c++) err = column_skip(batch.columns + c, r);
+        if (++batch.nb_rows == COLUMNS_BATCH && ! err) err = batch_write(&batch, out);
+    }
+    if (! err) err = batch_write(&batch, out);
+    batch_dtor(&batch);
+    return err;
+}
+
+int output_write(struct groupby *groupby, enum groupby_format format, int fd)
+{
+    struct output out = { .fd = fd, .len = 0 };
+    if (0 != posix_memalign((void **)&out.buf, OUTPUT_ALIGN, OUTPUT_BUF_SIZE)) {
+        fprintf(stderr, "Cannot malloc output buffer\n");
+        return -1;
+    }
+
+    STATS_START(STATS_OUTPUT);
+    struct groupby_iter iter;
+    int err = groupby_iter_init(&iter, groupby);
+    if (! err) {
+        err = format == FORMAT_ROWS ? write_rows(&iter, &out) : write_columns(&iter, &out);
+        groupby_iter_fini(&iter);
+    }
+    if (! err) err = output_flush(&out);
+    STATS_STOP(STATS_OUTPUT);
+    free(out.buf);
+    return err;
+}
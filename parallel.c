@@ -0,0 +1,765 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Parallel aggregation (-j).
+ * The file is cut in one chunk per thread. Cuts are moved to the next record
+ * boundary, knowing whether they fall within quotes from the scans of the
+ * chunks before them, that each thread first does on its own chunk.
+ * Each thread is pinned to a CPU of the affinity map and asks for memory from
+ * its local node before it allocates anything, so that its input buffer,
+ * parser and groups are local to it. It then aggregates its chunk with a
+ * groupby of its own.
+ * Groups are then merged by partitions of their key hash: thread p merges the
+ * groups of partition p from all threads into a table of its own, so that
+ * the merged groups are also local to the thread that built them.
+ * When keys are mostly unique, the own table of a thread only costs a lookup
+ * and an insert per row that the merge will do again. So each thread looks at
+ * how many of the last BYPASS_WINDOW lookups into its table created a group,
+ * and once there are more than BYPASS_INSERTS_PER_HIT of them for each one
+ * that found its group, it moves the groups of its table to the lists of
+ * their partitions, and from then on folds each row whose key is not in the
+ * table into a group of its own, appended to the list of its partition, and
+ * aggregated only by the merge. One in BYPASS_SAMPLE of these rows still goes
+ * to the table, so that keys that come back are found there, and once a
+ * window of rows mostly finds them the table is used as before. The lists
+ * are merged before the table, which only has rows that came after them, so
+ * that the input order is kept for first and last.
+ * With --parallel=shared, threads rather fold into a single table, so that
+ * keys seen by all threads are stored once and need no merge. The table is
+ * an open addressing array of group pointers, each set once with a CAS and
+ * never moved. Numeric aggregates are updated with atomic operations, others
+ * under one of a few locks picked by key hash. The table cannot grow, so a
+ * key is only looked for within SHARED_MAX_PROBES slots of its home slot;
+ * when they are all taken by other keys then the key goes to the own table
+ * of the thread, and those tables are merged by partitions as above. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "groupby.h"
+
+#define PARALLEL_MAX_THREADS 256
+#define PARALLEL_MIN_CHUNK (1U<<16) // fewer threads for smaller files
+#define READ_BLOCK_SIZE (1U<<20)
+#define PARTITION_SEED 0x2545f4914f6cdd1dULL
+#define SHARED_MAX_PROBES 64
+#define SHARED_MIN_SLOTS (1U<<16)
+#define SHARED_DEFAULT_SLOTS (1U<<20)   // with no estimate
+#define SHARED_MAX_SLOTS (1U<<30)
+#define SHARED_NB_LOCKS 256
+#define BYPASS_WINDOW (1U<<16)      // lookups between two looks at the reduction
+#define BYPASS_INSERTS_PER_HIT 8
+#define BYPASS_SAMPLE 16            // one in that many rows not found goes to the table anyway
+#ifndef MPOL_LOCAL
+#   define MPOL_LOCAL 4
+#endif
+
+struct shared_table {
+    struct hasher hasher;
+    size_t nb_slots;        // a power of 2
+    struct group **slots;   // NULL until set
+    pthread_mutex_t locks[SHARED_NB_LOCKS]; // for aggregates with no atomic fold
+};
+
+// What a thread needs to fold into the shared table
+struct shared_groups {
+    struct shared_table *table;
+    struct arena *mem;  // where it allocates the groups it adds
+};
+
+// What a thread needs to send rows to their partition unaggregated
+struct bypass {
+    struct groups *groups;  // its own table, that mostly takes the rows of its keys while on
+    bool on;
+    uint64_t next_check;    // number of lookups into groups
+    unsigned length;        // of groups at the last check
+    unsigned lookups, misses;   // rows looked up in the table since on or since the last check
+    unsigned nb_parts;
+    struct group_list *parts;   // groups of a single row, in input order
+    struct group ***tails;      // where to append to each list
+    unsigned *part_lengths;
+};
+
+struct worker {
+    struct parallel *parallel;
+    unsigned rank;
+    int cpu;            // pinned to, or -1
+    enum scan_state chunk_end[SCAN_NB_STATES];  // after its nominal chunk, from each state at its start
+    struct groupby *groupby;
+    struct shared_groups shared;
+    struct bypass bypass;
+    int err;
+    // Its groups, relinked by partition once aggregated
+    struct group_list *parts;
+    unsigned *part_lengths;
+    bool shared_merged;     // its share of the shared table is now in its merged table
+};
+
+struct parallel {
+    struct row_conf const *conf;
+    struct groupby_options opts;    // for the workers
+    struct estimate const *estimate;
+    int fd;
+    char const *map;    // the whole file, to look for quotes and record boundaries
+    off_t start, stop;  // what to aggregate
+    unsigned nb_threads;
+    pthread_barrier_t barrier;
+    // Threads wait for all others to be started before they use the barrier
+    pthread_mutex_t start_lock;
+    pthread_cond_t start_cond;
+    enum { START_WAIT, START_GO, START_ABORT } starting;
+    struct stats *stats;    // of the calling thread
+    struct groups *merged;  // one per thread
+    struct shared_table *shared;    // or NULL
+    struct worker workers[];
+};
+
+/*
+ * CPUs and memory nodes
+ */
+
+// Parse a list of CPUs such as "0-3,8", return how many or -1
+static int cpus_of_str(int *cpus, unsigned max, char const *const list)
+{
+    char const *str = list;
+    unsigned nb = 0;
+    while (*str) {
+        char *end;
+        long const first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0) goto err;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) goto err;
+        }
+        for (long c = first; c <= last && nb < max; c++) cpus[nb++] = c;
+        if (*end == ',') end ++;
+        else if (*end != '\0') goto err;
+        str = end;
+    }
+    if (nb > 0) return nb;
+err:
+    fprintf(stderr, "Bad CPU list '%s'\n", list);
+    return -1;
+}
+
+// The CPUs we are allowed to run on, in order
+static int allowed_cpus(int *cpus, unsigned max)
+{
+    cpu_set_t set;
+    if (0 != sched_getaffinity(0, sizeof(set), &set)) return 0;
+    unsigned nb = 0;
+    for (int c = 0; c < CPU_SETSIZE && nb < max; c++) {
+        if (CPU_ISSET(c, &set)) cpus[nb++] = c;
+    }
+    return nb;
+}
+
+static void pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int const err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) fprintf(stderr, "Cannot pin thread to CPU %d: %s\n", cpu, strerror(err));
+
+#   ifdef SYS_set_mempolicy
+    // Allocate from the node we run on, whatever the process policy
+    if (0 != syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0UL) && debug) perror("set_mempolicy");
+#   endif
+}
+
+static int current_node(void)
+{
+    unsigned cpu, node;
+    if (0 != syscall(SYS_getcpu, &cpu, &node, NULL)) return -1;
+    return node;
+}
+
+// Count the pages of that memory that are on the current node and elsewhere
+static void count_pages(void const *start, size_t size, void *node_)
+{
+#   ifdef SYS_move_pages
+    int const node = *(int const *)node_;
+    uintptr_t const page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t addr = (uintptr_t)start & ~(page_size - 1);
+    uintptr_t const end = (uintptr_t)start + size;
+    while (addr < end) {
+        void *pages[512];
+        int status[512];
+        unsigned nb = 0;
+        for (; nb < SIZEOF_ARRAY(pages) && addr < end; addr += page_size) pages[nb++] = (void *)addr;
+        // With no target nodes, move_pages only tells where the pages are
+        if (0 != syscall(SYS_move_pages, 0, (unsigned long)nb, pages, NULL, status, 0)) return;
+        for (unsigned p = 0; p < nb; p++) {
+            if (status[p] < 0) continue;    // not allocated yet
+            if (status[p] == node) stats.numa_local_pages ++;
+            else stats.numa_remote_pages ++;
+        }
+    }
+#   else
+    (void)start; (void)size; (void)node_;
+#   endif
+}
+
+static void count_groups_pages(struct groups const *groups)
+{
+    if (! stats.enabled || ! stats.numa) return;
+    int node = current_node();
+    if (node < 0) return;
+    arena_foreach_chunk(&groups->mem, count_pages, &node);
+    count_pages(groups->hash, groups->nb_buckets * sizeof(*groups->hash), &node);
+}
+
+/*
+ * Shared table
+ */
+
+int parallel_of_str(enum groupby_parallel *parallel, char const *str)
+{
+    if (0 == strcasecmp(str, "partitioned")) {
+        *parallel = PARALLEL_PARTITIONED;
+    } else if (0 == strcasecmp(str, "shared")) {
+        *parallel = PARALLEL_SHARED;
+    } else {
+        fprintf(stderr, "Unknown parallel mode '%s' (partitioned or shared)\n", str);
+        return -1;
+    }
+    return 0;
+}
+
+// First and last depend on the order rows are folded in, that threads do not keep
+static bool shared_allowed(struct row_conf const *conf)
+{
+    for (unsigned a = 0; a < conf->nb_aggrs; a++) {
+        char const *name = conf->aggrs[a].func->name;
+        if (0 == strcmp(name, "first") || 0 == strcmp(name, "last")) return false;
+    }
+    return true;
+}
+
+static struct shared_table *shared_table_new(struct groupby_options const *opts, struct estimate const *est)
+{
+    size_t nb_slots = SHARED_MIN_SLOTS;
+    uint64_t const wanted = est->nb_groups ? 2 * est->nb_groups : SHARED_DEFAULT_SLOTS;
+    while (nb_slots < wanted && nb_slots < SHARED_MAX_SLOTS) nb_slots *= 2;
+
+    struct shared_table *table = malloc(sizeof(*table));
+    struct group **slots = calloc(nb_slots, sizeof(*slots));
+    if (! table || ! slots) {
+        fprintf(stderr, "Cannot malloc a shared table of %zu slots\n", nb_slots);
+        free(table);
+        free(slots);
+        return NULL;
+    }
+    STATS_ADD(alloc_bytes, nb_slots * sizeof(*slots));
+    STATS_ADD(shared_slots, nb_slots);
+    hasher_ctor(&table->hasher, opts->hash);
+    table->nb_slots = nb_slots;
+    table->slots = slots;
+    for (unsigned l = 0; l < SHARED_NB_LOCKS; l++) pthread_mutex_init(table->locks + l, NULL);
+    if (debug) fprintf(stderr, "Sharing a table of %zu slots\n", nb_slots);
+    return table;
+}
+
+static void shared_table_del(struct shared_table *table)
+{
+    for (unsigned l = 0; l < SHARED_NB_LOCKS; l++) pthread_mutex_destroy(table->locks + l);
+    free(table->slots);
+    free(table);
+}
+
+int shared_fold(struct shared_groups *shared, struct key_str const *key, struct row_conf const *conf, char const *const *values, unsigned nb_values)
+{
+    struct shared_table *table = shared->table;
+    uint64_t const hash = hasher_hash(&table->hasher, key->str, key->len);
+    uint32_t const tag = hash >> 32;
+    struct group *new = NULL;   // allocated on the first empty slot
+    struct group *group = NULL;
+
+    for (unsigned probe = 0; probe < SHARED_MAX_PROBES && ! group; probe++) {
+        struct group **slot = table->slots + ((hash + probe) & (table->nb_slots - 1));
+        struct group *other = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (! other) {
+            if (! new) {
+                new = group_alloc(shared->mem, key, conf, nb_values);
+                if (! new) return 0;
+                new->tag = tag;
+            }
+            if (__atomic_compare_exchange_n(slot, &other, new, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                STATS_ADD(shared_groups, 1);
+                group = new;
+                new = NULL;
+                break;
+            }
+            // Another thread took that slot meanwhile, maybe for the same key
+        }
+        if (other->tag == tag && group_key_eq(other, key, conf)) group = other;
+    }
+    // If we lost the race for this key then our group is left unused in the arena
+    if (new) STATS_ADD(groups, -1);
+    if (! group) return 0;
+
+    if (0 != group_fold_shared(group, conf, values, nb_values, table->locks + tag % SHARED_NB_LOCKS)) return -1;
+    return 1;
+}
+
+/*
+ * Bypass
+ */
+
+static int bypass_ctor(struct bypass *bypass, struct groups *groups, unsigned nb_parts)
+{
+    bypass->groups = groups;
+    bypass->on = false;
+    bypass->lookups = bypass->misses = 0;
+    bypass->next_check = BYPASS_WINDOW;
+    bypass->length = 0;
+    bypass->nb_parts = nb_parts;
+    bypass->parts = malloc(nb_parts * sizeof(*bypass->parts));
+    bypass->tails = malloc(nb_parts * sizeof(*bypass->tails));
+    bypass->part_lengths = calloc(nb_parts, sizeof(*bypass->part_lengths));
+    if (! bypass->parts || ! bypass->tails || ! bypass->part_lengths) {
+        fprintf(stderr, "Cannot malloc %u partitions\n", nb_parts);
+        free(bypass->parts);
+        bypass->parts = NULL;   // no list to merge or drop
+        return -1;
+    }
+    for (unsigned p = 0; p < nb_parts; p++) {
+        SLIST_INIT(bypass->parts + p);
+        bypass->tails[p] = &SLIST_FIRST(bypass->parts + p);
+    }
+    return 0;
+}
+
+static void bypass_dtor(struct bypass *bypass)
+{
+    free(bypass->parts);
+    free(bypass->tails);
+    free(bypass->part_lengths);
+}
+
+// Whether the last lookups into our table mostly created groups
+static bool bypass_check(struct bypass *bypass)
+{
+    struct groups const *groups = bypass->groups;
+    uint64_t const lookups = groups->nb_lookups - (bypass->next_check - BYPASS_WINDOW);
+    uint64_t const inserts = groups->length - bypass->length;
+    uint64_t const hits = lookups - inserts;
+    bypass->next_check = groups->nb_lookups + BYPASS_WINDOW;
+    bypass->length = groups->length;
+    if (inserts <= BYPASS_INSERTS_PER_HIT * hits) return false;
+    if (debug) fprintf(stderr, "%"PRIu64" groups created for %"PRIu64" rows, sending the next ones to their partition\n", inserts, lookups);
+    return true;
+}
+
+// Whether a window of rows looked up while bypassing mostly found their group
+static bool bypass_uncheck(struct bypass *bypass)
+{
+    unsigned const hits = bypass->lookups - bypass->misses;
+    bool const off = bypass->misses <= BYPASS_INSERTS_PER_HIT * hits;
+    if (off) {
+        if (debug) fprintf(stderr, "%u rows of %u found their group, using the table again\n", hits, bypass->lookups);
+        bypass->next_check = bypass->groups->nb_lookups + BYPASS_WINDOW;
+        bypass->length = bypass->groups->length;
+    }
+    bypass->lookups = bypass->misses = 0;
+    return off;
+}
+
+static void bypass_append(struct bypass *bypass, struct group *group, struct row_conf const *conf)
+{
+    unsigned const p = hash_fast(group_key_str(group, conf), group_key_len(group), PARTITION_SEED) % bypass->nb_parts;
+    SLIST_NEXT(group, entry) = NULL;
+    *bypass->tails[p] = group;
+    bypass->tails[p] = &SLIST_NEXT(group, entry);
+    bypass->part_lengths[p] ++;
+}
+
+// Move the groups of the table to the lists, before the rows that follow
+static void bypass_flush(struct bypass *bypass, struct row_conf const *conf)
+{
+    struct groups *groups = bypass->groups;
+    for (unsigned h = 0; h < groups->nb_buckets; h++) {
+        struct group *group;
+        while (NULL != (group = SLIST_FIRST(groups->hash + h))) {
+            SLIST_REMOVE_HEAD(groups->hash + h, entry);
+            bypass_append(bypass, group, conf);
+        }
+    }
+    groups->length = 0;
+}
+
+int bypass_fold(struct bypass *bypass, struct key_str const *key, struct row_conf const *conf, char const *const *values, long long const *ints, unsigned nb_values)
+{
+    if (! bypass->on) {
+        if (bypass->groups->nb_lookups < bypass->next_check) return 1;
+        bypass->on = bypass_check(bypass);
+        if (! bypass->on) return 1;
+        bypass_flush(bypass, conf);
+    }
+
+    // Rows of the keys the table got since still go there
+    struct group *group = group_find(bypass->groups, key, conf);
+    bool const sampled = ! group && ++ bypass->misses % BYPASS_SAMPLE == 0;
+    if (++ bypass->lookups == BYPASS_WINDOW) bypass->on = ! bypass_uncheck(bypass);
+    if (group) return group_fold(group, conf, values, ints, nb_values);
+    if (sampled) return 1;
+
+    // Allocated along the groups of the table, that live until merged
+    group = group_alloc(&bypass->groups->mem, key, conf, nb_values);
+    if (! group) return -1;
+    int const err = group_fold(group, conf, values, ints, nb_values);
+    bypass_append(bypass, group, conf);
+    STATS_ADD(bypassed_rows, 1);
+    return err;
+}
+
+/*
+ * Chunks
+ */
+
+static off_t nominal_cut(struct parallel const *parallel, unsigned rank)
+{
+    return parallel->start + (parallel->stop - parallel->start) * rank / parallel->nb_threads;
+}
+
+/* Whether a chunk starts within quotes depends on all the previous ones, so
+ * each thread first scans its nominal chunk from every state, and the states
+ * are then chained from the start of the input. */
+static void scan_chunk(struct worker *worker)
+{
+    struct parallel const *parallel = worker->parallel;
+    off_t const start = nominal_cut(parallel, worker->rank);
+    size_t const len = nominal_cut(parallel, worker->rank + 1) - start;
+    for (unsigned s = 0; s < SCAN_NB_STATES; s++) {
+        worker->chunk_end[s] = csv_scan_state(s, parallel->map + start, len, parallel->opts.delimiter);
+    }
+}
+
+// Where the records of that rank start (once all chunks are scanned)
+static off_t record_cut(struct parallel const *parallel, unsigned rank)
+{
+    if (rank == 0) return parallel->start;
+    if (rank >= parallel->nb_threads) return parallel->stop;
+
+    enum scan_state state = SCAN_FIELD_START;
+    for (unsigned r = 0; r < rank; r++) state = parallel->workers[r].chunk_end[state];
+    off_t const cut = nominal_cut(parallel, rank);
+    size_t const len = csv_record_end(state, parallel->map + cut, parallel->stop - cut, parallel->opts.delimiter);
+    return len ? cut + (off_t)len : parallel->stop;
+}
+
+static int aggregate_chunk(struct worker *worker, off_t start, off_t stop)
+{
+    struct parallel const *parallel = worker->parallel;
+    worker->groupby = groupby_new(parallel->conf, &parallel->opts);
+    if (! worker->groupby) return -1;
+
+    struct estimate const *est = parallel->estimate;
+    if (parallel->shared) {
+        worker->shared.table = parallel->shared;
+        worker->shared.mem = &parallel->merged[worker->rank].mem;
+        groupby_share(worker->groupby, &worker->shared);
+    } else {
+        // Any thread could see most groups
+        if (est->nb_groups && 0 != groups_presize(groupby_groups(worker->groupby), est->nb_groups, est->group_size)) return -1;
+        if (parallel->nb_threads > 1) {
+            if (0 != bypass_ctor(&worker->bypass, groupby_groups(worker->groupby), parallel->nb_threads)) return -1;
+            groupby_bypass(worker->groupby, &worker->bypass);
+        }
+    }
+
+    char *buf = malloc(READ_BLOCK_SIZE);
+    if (! buf) {
+        fprintf(stderr, "Cannot malloc read buffer\n");
+        return -1;
+    }
+    int err = 0;
+    while (! err && start < stop) {
+        size_t const size = stop - start < READ_BLOCK_SIZE ? (size_t)(stop - start) : READ_BLOCK_SIZE;
+        STATS_START(STATS_READ);
+        ssize_t const r = pread(parallel->fd, buf, size, start);
+        STATS_STOP(STATS_READ);
+        if (r <= 0) {
+            if (r < 0) perror("pread");
+            else fprintf(stderr, "Input file shrunk while reading it\n");
+            err = -1;
+            break;
+        }
+        start += r;
+        err = groupby_push(worker->groupby, buf, r);
+    }
+    free(buf);
+    if (! err) err = groupby_push_end(worker->groupby);
+    return err;
+}
+
+/*
+ * Merge
+ */
+
+// Relink our groups into one list per partition (the table is not used any more)
+static int partition_groups(struct worker *worker)
+{
+    unsigned const nb_parts = worker->parallel->nb_threads;
+    struct row_conf const *conf = worker->parallel->conf;
+    worker->parts = malloc(nb_parts * sizeof(*worker->parts));
+    worker->part_lengths = calloc(nb_parts, sizeof(*worker->part_lengths));
+    if (! worker->parts || ! worker->part_lengths) {
+        fprintf(stderr, "Cannot malloc %u partitions\n", nb_parts);
+        free(worker->parts);
+        worker->parts = NULL;   // no list to merge or drop
+        return -1;
+    }
+    for (unsigned p = 0; p < nb_parts; p++) SLIST_INIT(worker->parts + p);
+
+    struct groups *groups = groupby_groups(worker->groupby);
+    count_groups_pages(groups);
+    for (unsigned h = 0; h < groups->nb_buckets; h++) {
+        struct group *group;
+        while (NULL != (group = SLIST_FIRST(groups->hash + h))) {
+            SLIST_REMOVE_HEAD(groups->hash + h, entry);
+            unsigned const p = hash_fast(group_key_str(group, conf), group_key_len(group), PARTITION_SEED) % nb_parts;
+            SLIST_INSERT_HEAD(worker->parts + p, group, entry);
+            worker->part_lengths[p] ++;
+        }
+    }
+    // These groups are counted once merged
+    stats.groups -= groups->length;
+    if (worker->bypass.part_lengths) {
+        for (unsigned p = 0; p < nb_parts; p++) stats.groups -= worker->bypass.part_lengths[p];
+    }
+    return 0;
+}
+
+// Free what the aggregates of the groups of that list allocated, and empty it
+static void drop_list(struct group_list *list, struct row_conf const *conf)
+{
+    struct group *group;
+    while (NULL != (group = SLIST_FIRST(list))) {
+        SLIST_REMOVE_HEAD(list, entry);
+        group_dtor(group, conf);
+    }
+}
+
+// Empties the list, as its groups are copied into merged
+static int merge_list(struct groups *merged, struct group_list *list, struct row_conf const *conf)
+{
+    struct group *group;
+    while (NULL != (group = SLIST_FIRST(list))) {
+        SLIST_REMOVE_HEAD(list, entry);
+        struct key_str const key = group_key(group, conf);
+        struct group *dst = group_find_or_create(merged, &key, conf, group_nb_fields(group, conf));
+        int const err = ! dst || 0 != group_merge(dst, group, conf) ? -1 : 0;
+        group_dtor(group, conf);
+        if (err) return -1;
+    }
+    return 0;
+}
+
+static int merge_partition(struct worker *worker)
+{
+    struct parallel const *parallel = worker->parallel;
+    unsigned const p = worker->rank;
+    struct groups *merged = parallel->merged + p;
+
+    // Our share of the shared table, that has no key in common with the partitions
+    struct shared_table const *table = parallel->shared;
+    size_t const shared_start = table ? table->nb_slots * p / parallel->nb_threads : 0;
+    size_t const shared_stop = table ? table->nb_slots * (p + 1) / parallel->nb_threads : 0;
+    uint64_t nb_groups = 0;
+    for (size_t s = shared_start; s < shared_stop; s++) nb_groups += !! table->slots[s];
+    for (unsigned w = 0; w < parallel->nb_threads; w++) {
+        struct worker const *other = parallel->workers + w;
+        if (other->part_lengths) nb_groups += other->part_lengths[p];
+        if (other->bypass.part_lengths) nb_groups += other->bypass.part_lengths[p];
+    }
+    if (0 != groups_presize(merged, nb_groups, parallel->estimate->group_size)) return -1;
+
+    STATS_START(STATS_MERGE);
+    for (size_t s = shared_start; s < shared_stop; s++) {
+        if (table->slots[s]) groups_insert(merged, table->slots[s], parallel->conf);
+    }
+    worker->shared_merged = true;
+    // In input order, for first and last: the table of a thread only has rows that came after its lists
+    for (unsigned w = 0; w < parallel->nb_threads; w++) {
+        struct worker const *other = parallel->workers + w;
+        if (! other->parts) continue;
+        if (other->bypass.parts && 0 != merge_list(merged, other->bypass.parts + p, parallel->conf)) return -1;
+        if (0 != merge_list(merged, other->parts + p, parallel->conf)) return -1;
+    }
+    STATS_STOP(STATS_MERGE);
+    count_groups_pages(merged);
+    return 0;
+}
+
+// Free what the aggregates of a share of the shared table allocated, when no merged table got it
+static void drop_shared(struct parallel const *parallel, unsigned p)
+{
+    struct shared_table const *table = parallel->shared;
+    size_t const shared_start = table->nb_slots * p / parallel->nb_threads;
+    size_t const shared_stop = table->nb_slots * (p + 1) / parallel->nb_threads;
+    for (size_t s = shared_start; s < shared_stop; s++) {
+        if (table->slots[s]) group_dtor(table->slots[s], parallel->conf);
+    }
+}
+
+static void *worker_run(void *worker_)
+{
+    struct worker *worker = worker_;
+    struct parallel *parallel = worker->parallel;
+    pthread_mutex_lock(&parallel->start_lock);
+    while (parallel->starting == START_WAIT) pthread_cond_wait(&parallel->start_cond, &parallel->start_lock);
+    bool const aborted = parallel->starting == START_ABORT;
+    pthread_mutex_unlock(&parallel->start_lock);
+    if (aborted) return NULL;
+
+    stats_thread_begin(parallel->stats);
+    if (worker->cpu >= 0) pin_thread(worker->cpu);
+    // Before aggregating, as the groups it adds to the shared table go there
+    worker->err = groups_ctor(parallel->merged + worker->rank, parallel->opts.hash);
+
+    if (parallel->nb_threads > 1) scan_chunk(worker);
+    pthread_barrier_wait(&parallel->barrier);
+
+    off_t const start = record_cut(parallel, worker->rank);
+    off_t const stop = record_cut(parallel, worker->rank + 1);
+    if (debug) fprintf(stderr, "Thread %u on CPU %d aggregates bytes %jd to %jd\n", worker->rank, worker->cpu, (intmax_t)start, (intmax_t)stop);
+    if (! worker->err) worker->err = aggregate_chunk(worker, start, stop);
+    if (! worker->err) worker->err = partition_groups(worker);
+    pthread_barrier_wait(&parallel->barrier);
+
+    if (! worker->err) worker->err = merge_partition(worker);
+
+    stats_thread_end(parallel->stats);
+    return NULL;
+}
+
+int parallel_read(struct row_conf const *conf, struct groupby_options const *opts, struct estimate const *estimate, int fd, struct groups **merged_, unsigned *nb_merged)
+{
+    struct stat st;
+    off_t const start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0 || 0 != fstat(fd, &st)) {
+        perror("Cannot stat input");
+        return -1;
+    }
+    off_t const stop = st.st_size > start ? st.st_size : start;
+
+    unsigned nb_threads = opts->nb_threads;
+    if (nb_threads > PARALLEL_MAX_THREADS) nb_threads = PARALLEL_MAX_THREADS;
+    while (nb_threads > 1 && (stop - start) / nb_threads < PARALLEL_MIN_CHUNK) nb_threads --;
+
+    int cpus[PARALLEL_MAX_THREADS];
+    int nb_cpus = opts->affinity ?
+        cpus_of_str(cpus, SIZEOF_ARRAY(cpus), opts->affinity) :
+        allowed_cpus(cpus, SIZEOF_ARRAY(cpus));
+    if (nb_cpus < 0) return -1;
+
+    struct parallel *parallel = calloc(1, sizeof(*parallel) + nb_threads * sizeof(parallel->workers[0]));
+    struct groups *merged = calloc(nb_threads, sizeof(*merged));
+    if (! parallel || ! merged) {
+        fprintf(stderr, "Cannot malloc %u threads\n", nb_threads);
+        free(parallel);
+        free(merged);
+        return -1;
+    }
+    parallel->conf = conf;
+    parallel->opts = *opts;
+    parallel->opts.nb_threads = 0;
+    parallel->opts.sample_size = 0;
+    parallel->estimate = estimate;
+    parallel->fd = fd;
+    parallel->start = start;
+    parallel->stop = stop;
+    parallel->nb_threads = nb_threads;
+    parallel->stats = &stats;
+    parallel->merged = merged;
+    parallel->map = MAP_FAILED;
+    if (nb_threads > 1) {
+        parallel->map = mmap(NULL, stop, PROT_READ, MAP_SHARED, fd, 0);
+        if (parallel->map == MAP_FAILED) {
+            perror("mmap");
+            goto err;
+        }
+    }
+    if (opts->parallel == PARALLEL_SHARED && nb_threads > 1) {
+        if (! shared_allowed(conf)) {
+            fprintf(stderr, "first and last need the input order, using partitioned tables\n");
+        } else if (NULL == (parallel->shared = shared_table_new(opts, estimate))) {
+            goto err;
+        }
+    }
+    if (debug) fprintf(stderr, "Aggregating with %u threads\n", nb_threads);
+
+    pthread_barrier_init(&parallel->barrier, NULL, nb_threads);
+    pthread_mutex_init(&parallel->start_lock, NULL);
+    pthread_cond_init(&parallel->start_cond, NULL);
+    parallel->starting = START_WAIT;
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    unsigned nb_started = 0;
+    for (; nb_started < nb_threads; nb_started++) {
+        struct worker *worker = parallel->workers + nb_started;
+        worker->parallel = parallel;
+        worker->rank = nb_started;
+        worker->cpu = nb_cpus > 0 ? cpus[nb_started % nb_cpus] : -1;
+        int const err = pthread_create(threads + nb_started, NULL, worker_run, worker);
+        if (err) {
+            fprintf(stderr, "Cannot start thread: %s\n", strerror(err));
+            break;
+        }
+    }
+    // Those already started would wait for the others forever at the barrier
+    bool const aborted = nb_started < nb_threads;
+    pthread_mutex_lock(&parallel->start_lock);
+    parallel->starting = aborted ? START_ABORT : START_GO;
+    pthread_cond_broadcast(&parallel->start_cond);
+    pthread_mutex_unlock(&parallel->start_lock);
+
+    int err = aborted ? -1 : 0;
+    for (unsigned t = 0; t < nb_started; t++) pthread_join(threads[t], NULL);
+    // Groups of each thread were merged by all the others, unless one failed
+    for (unsigned t = 0; t < nb_started; t++) {
+        struct worker *worker = parallel->workers + t;
+        if (worker->err) err = -1;
+        if (conf->aggr_dtors) {
+            for (unsigned p = 0; worker->parts && p < nb_threads; p++) drop_list(worker->parts + p, conf);
+            for (unsigned p = 0; worker->bypass.parts && p < nb_threads; p++) drop_list(worker->bypass.parts + p, conf);
+            if (parallel->shared && ! worker->shared_merged) drop_shared(parallel, t);
+        }
+        if (worker->groupby) groupby_del(worker->groupby);
+        free(worker->parts);
+        free(worker->part_lengths);
+        bypass_dtor(&worker->bypass);
+    }
+    pthread_barrier_destroy(&parallel->barrier);
+    pthread_cond_destroy(&parallel->start_cond);
+    pthread_mutex_destroy(&parallel->start_lock);
+    if (parallel->shared) shared_table_del(parallel->shared);
+    if (parallel->map != MAP_FAILED) munmap((void *)parallel->map, stop);
+    free(parallel);
+    if (aborted) {
+        // No thread built its merged table yet
+        free(merged);
+        return -1;
+    }
+    (void)lseek(fd, 0, SEEK_END);
+
+    *merged_ = merged;
+    *nb_merged = nb_threads;
+    return err;
+err:
+    if (parallel->map != MAP_FAILED) munmap((void *)parallel->map, stop);
+    free(parallel);
+    free(merged);
+    return -1;
+}
@@ -0,0 +1,502 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Read-ahead of the input of groupby_read (--readahead), so that the parser
+ * finds the next bytes already in memory rather than waiting for each read.
+ * The input is read into a ring of large buffers, with a read in flight for
+ * every buffer that is not being consumed. Buffers are consumed in order.
+ * Regular files are read at known offsets, with io_uring when the kernel
+ * lets us, or else by a few threads; other inputs are read in order by a
+ * single thread. With O_DIRECT (--direct) offsets are aligned and the page
+ * cache is bypassed. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "config.h"
+#include "groupby.h"
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#   include <linux/io_uring.h>
+#   define WITH_URING
+#endif
+
+#define READAHEAD_BUF_SIZE (1U<<20)
+#define READAHEAD_ALIGN 4096    // for O_DIRECT
+#define READAHEAD_MAX_THREADS 4
+
+/*
+ * io_uring, with no other library than the kernel headers
+ */
+
+#ifdef WITH_URING
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static void uring_dtor(struct uring *u)
+{
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+static int uring_ctor(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) {
+        if (debug) perror("io_uring_setup");
+        return -1;
+    }
+    u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    bool const single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) goto err;
+    u->cq_ring = single ? u->sq_ring :
+        mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) goto err;
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto err;
+
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+err:
+    if (debug) perror("mmap io_uring");
+    uring_dtor(u);
+    return -1;
+}
+
+static int uring_readv(struct uring *u, int fd, struct iovec const *iov, off_t pos, uint64_t user_data)
+{
+    unsigned const tail = *u->sq_tail; // only we submit
+    unsigned const idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = u->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = pos;
+    sqe->user_data = user_data;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (1 != syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0)) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        perror("io_uring_enter");
+        return -1;
+    }
+    return 0;
+}
+
+// Next completion, waiting for it if there is none yet and wait is set. Return 1 if there was one, 0 or -1.
+static int uring_reap(struct uring *u, bool wait, uint64_t *user_data, int *res)
+{
+    unsigned const head = *u->cq_head;
+    while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (! wait) return 0;
+        if (0 > syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) && errno != EINTR) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+    struct io_uring_cqe const *cqe = u->cqes + (head & *u->cq_mask);
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+#endif  /* WITH_URING */
+
+/*
+ * Ring of buffers
+ */
+
+struct ra_buf {
+    char *data;
+    enum ra_state { RA_FREE, RA_READING, RA_READY } state;
+    off_t pos;          // of data[0] in the file
+    size_t len;         // bytes read so far
+    size_t consumed;    // by readahead_read
+    int err;            // errno of a failed read, or 0
+    bool last;          // no more buffers are read after this one
+    bool eof;           // the input ends with this buffer
+    struct iovec iov;   // what is left to read, for io_uring
+};
+
+struct readahead {
+    int fd;
+    int fl;             // file status flags before we set O_DIRECT
+    bool seekable;      // read at offsets up to size, otherwise in order
+    bool direct;
+    bool eof_queued;    // the last buffer has been read (or is being read)
+    bool stop;
+    off_t size;
+    off_t next_pos;     // of the next read, if seekable
+    size_t skip;        // bytes before the start in the first buffer (O_DIRECT)
+    unsigned next_read;     // buffer to read into next
+    unsigned next_consume;  // buffer readahead_read takes bytes from
+#   ifdef WITH_URING
+    struct uring uring;
+    bool with_uring;
+    unsigned nb_reading;
+#   endif
+    pthread_mutex_t lock;   // for the threads
+    pthread_cond_t cond;
+    unsigned nb_threads;
+    pthread_t threads[READAHEAD_MAX_THREADS];
+    unsigned nb_bufs;
+    struct ra_buf bufs[];
+};
+
+// Take the next buffer to read into, if it is free (under the lock with threads)
+static struct ra_buf *claim_buf(struct readahead *ra)
+{
+    struct ra_buf *b = ra->bufs + ra->next_read;
+    if (ra->eof_queued || b->state != RA_FREE) return NULL;
+
+    b->state = RA_READING;
+    b->len = 0;
+    b->consumed = ra->skip;
+    b->err = 0;
+    b->eof = false;
+    b->last = false;
+    ra->skip = 0;
+    ra->next_read = (ra->next_read + 1) % ra->nb_bufs;
+    if (ra->seekable) {
+        b->pos = ra->next_pos;
+        ra->next_pos += READAHEAD_BUF_SIZE;
+        // Up to the size we were given, rounded up to a buffer
+        if (ra->next_pos >= ra->size) b->last = ra->eof_queued = true;
+    }
+    return b;
+}
+
+// Account for r bytes read into b; tell whether it is complete
+static bool buf_read(struct readahead *ra, struct ra_buf *b, ssize_t r)
+{
+    if (r < 0) {
+        b->err = -r;
+        b->eof = true;
+        return true;
+    }
+    if (r == 0) {
+        b->eof = true;
+        return true;
+    }
+    b->len += r;
+    if (b->len == READAHEAD_BUF_SIZE) {
+        b->eof = b->last;
+        return true;
+    }
+    // O_DIRECT reads are only short at the end
+    if (ra->direct) {
+        b->eof = true;
+        return true;
+    }
+    // Streams give what they have, files are read up to the end of the buffer
+    return ! ra->seekable;
+}
+
+/*
+ * Threads
+ */
+
+static void fill_buf(struct readahead *ra, struct ra_buf *b)
+{
+    bool complete = false;
+    int old;
+    // Only a read may be cancelled, not a wait that holds the lock
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+    while (! complete) {
+        ssize_t r = ra->seekable ?
+            pread(ra->fd, b->data + b->len, READAHEAD_BUF_SIZE - b->len, b->pos + b->len) :
+            read(ra->fd, b->data, READAHEAD_BUF_SIZE);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            r = -errno;
+        }
+        complete = buf_read(ra, b, r);
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+}
+
+static void *reader_run(void *ra_)
+{
+    struct readahead *ra = ra_;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&ra->lock);
+    while (! ra->stop) {
+        struct ra_buf *b = claim_buf(ra);
+        if (! b) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&ra->lock);
+        fill_buf(ra, b);
+        pthread_mutex_lock(&ra->lock);
+        if (b->eof) ra->eof_queued = true;
+        b->state = RA_READY;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/*
+ * io_uring
+ */
+
+#ifdef WITH_URING
+static int uring_submit(struct readahead *ra, struct ra_buf *b)
+{
+    b->iov.iov_base = b->data + b->len;
+    b->iov.iov_len = READAHEAD_BUF_SIZE - b->len;
+    if (0 != uring_readv(&ra->uring, ra->fd, &b->iov, b->pos + b->len, b - ra->bufs)) return -1;
+    ra->nb_reading ++;
+    return 0;
+}
+
+// Start reading into all free buffers
+static int uring_fill(struct readahead *ra)
+{
+    struct ra_buf *b;
+    while (NULL != (b = claim_buf(ra))) {
+        if (0 != uring_submit(ra, b)) return -1;
+    }
+    return 0;
+}
+
+// Account for a completed read, if any (or wait for one). Return 1 if there was one, 0 or -1.
+static int uring_complete(struct readahead *ra, bool wait)
+{
+    uint64_t idx;
+    int res;
+    int const r = uring_reap(&ra->uring, wait, &idx, &res);
+    if (r <= 0) return r;
+    ra->nb_reading --;
+    struct ra_buf *b = ra->bufs + idx;
+    if (res == -EINTR || res == -EAGAIN || ! buf_read(ra, b, res)) {
+        return 0 == uring_submit(ra, b) ? 1 : -1;
+    }
+    if (b->eof) ra->eof_queued = true;
+    b->state = RA_READY;
+    return 1;
+}
+#endif
+
+/*
+ * Interface
+ */
+
+struct readahead *readahead_new(int fd, unsigned nb_bufs, bool direct)
+{
+    if (nb_bufs < 2) nb_bufs = 2;
+    struct readahead *ra = calloc(1, sizeof(*ra) + nb_bufs * sizeof(ra->bufs[0]));
+    if (! ra) {
+        fprintf(stderr, "Cannot malloc read-ahead of %u buffers\n", nb_bufs);
+        return NULL;
+    }
+    ra->fd = fd;
+    ra->fl = -1;
+    ra->nb_bufs = nb_bufs;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    for (unsigned i = 0; i < nb_bufs; i++) {
+        if (0 != posix_memalign((void **)&ra->bufs[i].data, READAHEAD_ALIGN, READAHEAD_BUF_SIZE)) {
+            fprintf(stderr, "Cannot malloc read-ahead buffers\n");
+            readahead_del(ra);
+            return NULL;
+        }
+        STATS_ADD(alloc_bytes, READAHEAD_BUF_SIZE);
+    }
+
+    // Some regular files, as in /proc, do not know their size
+    struct stat st;
+    off_t const start = lseek(fd, 0, SEEK_CUR);
+    ra->seekable = start >= 0 && 0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0;
+    if (ra->seekable) {
+        ra->size = st.st_size;
+        ra->next_pos = start;
+        if (direct) {
+            ra->fl = fcntl(fd, F_GETFL);
+            ra->direct = ra->fl >= 0 && 0 == fcntl(fd, F_SETFL, ra->fl | O_DIRECT) &&
+                         0 <= pread(fd, ra->bufs[0].data, READAHEAD_ALIGN, start & ~(off_t)(READAHEAD_ALIGN-1));
+            if (ra->direct) {
+                ra->next_pos = start & ~(off_t)(READAHEAD_ALIGN-1);
+                ra->skip = start - ra->next_pos;
+            } else {
+                fprintf(stderr, "Cannot read input with O_DIRECT, using the page cache\n");
+                if (ra->fl >= 0) (void)fcntl(fd, F_SETFL, ra->fl);
+            }
+        }
+    } else if (direct) {
+        fprintf(stderr, "Input is not a file, ignoring --direct\n");
+    }
+    STATS_ADD(readahead_bufs, nb_bufs);
+
+#   ifdef WITH_URING
+    if (ra->seekable && 0 == uring_ctor(&ra->uring, nb_bufs)) {
+        ra->with_uring = true;
+        if (debug) fprintf(stderr, "Reading ahead %u buffers with io_uring\n", nb_bufs);
+        if (0 != uring_fill(ra)) {
+            readahead_del(ra);
+            return NULL;
+        }
+        return ra;
+    }
+#   endif
+
+    // Several reads of a stream would not come back in order
+    unsigned const nb_threads = ! ra->seekable ? 1 : nb_bufs < READAHEAD_MAX_THREADS ? nb_bufs : READAHEAD_MAX_THREADS;
+    if (debug) fprintf(stderr, "Reading ahead %u buffers with %u threads\n", nb_bufs, nb_threads);
+    for (; ra->nb_threads < nb_threads; ra->nb_threads++) {
+        int const err = pthread_create(ra->threads + ra->nb_threads, NULL, reader_run, ra);
+        if (err) {
+            fprintf(stderr, "Cannot start read-ahead thread: %s\n", strerror(err));
+            readahead_del(ra);
+            return NULL;
+        }
+    }
+    return ra;
+}
+
+int readahead_del(struct readahead *ra)
+{
+    int err = 0;
+#   ifdef WITH_URING
+    if (ra->with_uring) {
+        // The kernel may still write into our buffers
+        while (ra->nb_reading > 0) {
+            uint64_t idx;
+            int res;
+            if (1 != uring_reap(&ra->uring, true, &idx, &res)) break;
+            ra->nb_reading --;
+            ra->bufs[idx].state = RA_FREE;
+        }
+        if (ra->nb_reading > 0) {
+            // Leave the ring and the buffers still being read alone
+            fprintf(stderr, "Cannot wait for %u pending reads, leaking their buffers\n", ra->nb_reading);
+            err = -1;
+        } else {
+            uring_dtor(&ra->uring);
+        }
+    }
+#   endif
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    // A thread can wait for a stream that we no longer want
+    for (unsigned t = 0; t < ra->nb_threads; t++) pthread_cancel(ra->threads[t]);
+    for (unsigned t = 0; t < ra->nb_threads; t++) pthread_join(ra->threads[t], NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+
+    if (ra->direct) (void)fcntl(ra->fd, F_SETFL, ra->fl);
+    for (unsigned i = 0; i < ra->nb_bufs; i++) {
+        if (! err || ra->bufs[i].state != RA_READING) free(ra->bufs[i].data);
+    }
+    free(ra);
+    return err;
+}
+
+// Whether the next buffer is ready, waiting for it if wait is set (or -1)
+static int next_ready(struct readahead *ra, bool wait)
+{
+    struct ra_buf const *b = ra->bufs + ra->next_consume;
+#   ifdef WITH_URING
+    if (ra->with_uring) {
+        // Reads that completed meanwhile
+        int r;
+        while (0 < (r = uring_complete(ra, false))) ;
+        if (r < 0) return -1;
+        if (b->state == RA_READY) return 1;
+        if (! wait) return 0;
+        STATS_ADD(readahead_waits, 1);
+        while (b->state != RA_READY) {
+            if (0 > uring_complete(ra, true)) return -1;
+        }
+        return 1;
+    }
+#   endif
+    pthread_mutex_lock(&ra->lock);
+    if (b->state != RA_READY && wait) {
+        STATS_ADD(readahead_waits, 1);
+        while (b->state != RA_READY) pthread_cond_wait(&ra->cond, &ra->lock);
+    }
+    int const ready = b->state == RA_READY;
+    pthread_mutex_unlock(&ra->lock);
+    return ready;
+}
+
+// Done with that buffer: read into it again
+static int release_buf(struct readahead *ra, struct ra_buf *b)
+{
+    ra->next_consume = (ra->next_consume + 1) % ra->nb_bufs;
+#   ifdef WITH_URING
+    if (ra->with_uring) {
+        b->state = RA_FREE;
+        return uring_fill(ra);
+    }
+#   endif
+    pthread_mutex_lock(&ra->lock);
+    b->state = RA_FREE;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    return 0;
+}
+
+ssize_t readahead_read(struct readahead *ra, void *dst_, size_t size)
+{
+    char *dst = dst_;
+    size_t done = 0;
+    // Only wait for the first bytes, then take what is ready
+    while (done < size) {
+        int const ready = next_ready(ra, done == 0);
+        if (ready < 0) return done ? (ssize_t)done : -1;
+        if (! ready) break;
+
+        struct ra_buf *b = ra->bufs + ra->next_consume;
+        if (b->consumed >= b->len) {    // the end
+            if (b->err && ! done) {
+                fprintf(stderr, "Cannot read input: %s\n", strerror(b->err));
+                return -1;
+            }
+            break;
+        }
+        size_t const rem = b->len - b->consumed;
+        size_t const sz = rem < size - done ? rem : size - done;
+        memcpy(dst + done, b->data + b->consumed, sz);
+        b->consumed += sz;
+        done += sz;
+        if (b->consumed == b->len && ! b->eof && 0 != release_buf(ra, b)) return -1;
+    }
+    return done;
+}
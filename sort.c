@@ -0,0 +1,407 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Sort based aggregation: rows are packed in an arena as they come, then
+ * sorted on their key and folded run after run, so that groups come out in
+ * key order without any hash table. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "groupby.h"
+
+#define SORTER_CHUNK_SIZE (1U<<20)
+
+// What's stored in the arena for each row
+struct packed_row {
+    unsigned nb_fields;     // as observed in the input
+    char data[];    // the key then each aggregated value, all nul terminated
+};
+
+int sorter_ctor(struct sorter *sorter)
+{
+    arena_ctor(&sorter->rows, SORTER_CHUNK_SIZE);
+    sorter->entries = NULL;
+    sorter->nb_entries = sorter->max_entries = 0;
+    return 0;
+}
+
+void sorter_dtor(struct sorter *sorter)
+{
+    arena_dtor(&sorter->rows);
+    free(sorter->entries);
+    sorter->entries = NULL;
+}
+
+// The first 8 bytes of the key, big endian, so that the first radix passes do not touch the arena
+uint64_t sort_key_prefix(char const *key, unsigned len)
+{
+    uint64_t prefix = 0;
+    for (unsigned i = 0; i < 8; i++) {
+        prefix = (prefix << 8) | (i < len ? (unsigned char)key[i] : 0);
+    }
+    return prefix;
+}
+
+int sorter_add(struct sorter *sorter, struct key_str const *key, char const *const *values, unsigned nb_values, struct row_conf const *conf)
+{
+    size_t size = sizeof(struct packed_row) + key->len;
+    unsigned const nb_folded = nb_values < conf->nb_fields ? nb_values : conf->nb_fields;
+    size_t lens[nb_folded + 1];
+    for (unsigned f = 0; f < nb_folded; f++) {
+        if (! conf->fields[f].nb_aggrs) continue;
+        lens[f] = strlen(values[f]) + 1;
+        size += lens[f];
+    }
+
+    struct packed_row *row = arena_alloc(&sorter->rows, size);
+    if (! row) return -1;
+    row->nb_fields = nb_values;
+    memcpy(row->data, key->str, key->len);
+    char *dst = row->data + key->len;
+    for (unsigned f = 0; f < nb_folded; f++) {
+        if (! conf->fields[f].nb_aggrs) continue;
+        memcpy(dst, values[f], lens[f]);
+        dst += lens[f];
+    }
+
+    if (sorter->nb_entries >= sorter->max_entries) {
+        size_t const max = sorter->max_entries ? 2 * sorter->max_entries : 4096;
+        struct sort_entry *entries = realloc(sorter->entries, max * sizeof(*entries));
+        if (! entries) {
+            fprintf(stderr, "Cannot realloc %zu sort entries\n", max);
+            return -1;
+        }
+        STATS_ADD(alloc_bytes, (max - sorter->max_entries) * sizeof(*entries));
+        sorter->entries = entries;
+        sorter->max_entries = max;
+    }
+
+    struct sort_entry *e = sorter->entries + sorter->nb_entries++;
+    e->prefix = sort_key_prefix(key->str, key->len);
+    e->key = row->data;
+    e->key_len = key->len;
+    e->data = row;
+    return 0;
+}
+
+/*
+ * Radix sort of the entries on the key bytes (MSD, stable).
+ * Bucket 0 is for keys that end before this depth, so that a key sorts
+ * before all keys it is a prefix of.
+ */
+
+static unsigned entry_byte(struct sort_entry const *e, unsigned depth)
+{
+    if (depth >= e->key_len) return 0;
+    if (depth < 8) return 1 + ((e->prefix >> (56 - 8*depth)) & 0xff);
+    return 1 + (unsigned char)e->key[depth];
+}
+
+int sort_entry_cmp(struct sort_entry const *a, struct sort_entry const *b, unsigned depth)
+{
+    if (depth < 8) {
+        if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+        depth = 8;
+    }
+    unsigned const len = a->key_len < b->key_len ? a->key_len : b->key_len;
+    if (depth < len) {
+        int const c = memcmp(a->key + depth, b->key + depth, len - depth);
+        if (c) return c;
+    }
+    return a->key_len < b->key_len ? -1 : a->key_len > b->key_len;
+}
+
+static void insertion_sort(struct sort_entry *entries, size_t nb, unsigned depth)
+{
+    for (size_t i = 1; i < nb; i++) {
+        struct sort_entry const e = entries[i];
+        size_t j = i;
+        while (j > 0 && sort_entry_cmp(entries + j - 1, &e, depth) > 0) {
+            entries[j] = entries[j-1];
+            j --;
+        }
+        entries[j] = e;
+    }
+}
+
+/* Only the buckets but the largest are sorted by recursion, so that each
+ * level has at most half the entries of the previous one, and the counts
+ * are not needed past the scatter, so that all levels share them. */
+static void radix_sort(struct sort_entry *entries, struct sort_entry *tmp, size_t nb, unsigned depth, size_t count[257])
+{
+    while (nb >= 32) {
+        memset(count, 0, 257 * sizeof(*count));
+        for (size_t i = 0; i < nb; i++) count[entry_byte(entries + i, depth)] ++;
+
+        // Shortcut for when all keys share this byte, which is frequent for long keys
+        unsigned b;
+        for (b = 0; b < 257 && count[b] == 0; b++) ;
+        if (count[b] == nb) {
+            if (b == 0) return; // all keys are equal
+            depth ++;
+            continue;
+        }
+
+        unsigned largest = 1;
+        for (b = 2; b < 257; b++) {
+            if (count[b] > count[largest]) largest = b;
+        }
+        size_t const nb_ended = count[0], nb_largest = count[largest];
+        size_t pos = 0, largest_start = 0;
+        for (b = 0; b < 257; b++) {
+            size_t const c = count[b];
+            if (b == largest) largest_start = pos;
+            count[b] = pos;
+            pos += c;
+        }
+        for (size_t i = 0; i < nb; i++) tmp[count[entry_byte(entries + i, depth)]++] = entries[i];
+        memcpy(entries, tmp, nb * sizeof(*entries));
+
+        // Keys that ended at this depth are all equal and already in input order
+        for (pos = nb_ended; pos < nb; ) {
+            b = entry_byte(entries + pos, depth);
+            size_t end = pos + 1;
+            while (end < nb && entry_byte(entries + end, depth) == b) end ++;
+            if (b != largest && end - pos > 1) radix_sort(entries + pos, tmp, end - pos, depth + 1, count);
+            pos = end;
+        }
+        entries += largest_start;
+        nb = nb_largest;
+        depth ++;
+    }
+    insertion_sort(entries, nb, depth);
+}
+
+void sort_entries(struct sort_entry *entries, struct sort_entry *tmp, size_t nb, unsigned depth)
+{
+    size_t count[257];
+    radix_sort(entries, tmp, nb, depth, count);
+}
+
+int sorter_finish(struct sorter *sorter, struct row_conf const *conf, struct group ***groups_, size_t *nb_groups_)
+{
+    struct sort_entry *tmp = malloc(sorter->nb_entries * sizeof(*tmp) + 1);
+    if (! tmp) {
+        fprintf(stderr, "Cannot malloc %zu temporary sort entries\n", sorter->nb_entries);
+        return -1;
+    }
+    sort_entries(sorter->entries, tmp, sorter->nb_entries, 0);
+    free(tmp);
+
+    // Now fold each run of identical keys into a new group
+    struct group **groups = NULL;
+    size_t nb_groups = 0, max_groups = 0;
+    struct group *group = NULL;
+    char const **values = malloc((conf->nb_fields + 1) * sizeof(*values));
+    if (! values) {
+        fprintf(stderr, "Cannot malloc %u values\n", conf->nb_fields);
+        return -1;
+    }
+    for (size_t i = 0; i < sorter->nb_entries; i++) {
+        struct sort_entry const *e = sorter->entries + i;
+        struct packed_row const *row = e->data;
+        if (! group || 0 != sort_entry_cmp(e - 1, e, 0)) {
+            if (nb_groups >= max_groups) {
+                max_groups = max_groups ? 2 * max_groups : 1024;
+                struct group **g = realloc(groups, max_groups * sizeof(*g));
+                if (! g) {
+                    fprintf(stderr, "Cannot realloc %zu groups\n", max_groups);
+                    goto err;
+                }
+                groups = g;
+            }
+            struct key_str const key = { .str = (char *)e->key, .len = e->key_len };
+            group = group_alloc(&sorter->rows, &key, conf, row->nb_fields);
+            if (! group) goto err;
+            groups[nb_groups++] = group;
+        }
+
+        char const *v = row->data + e->key_len;
+        for (unsigned f = 0; f < row->nb_fields && f < conf->nb_fields; f++) {
+            if (! conf->fields[f].nb_aggrs) continue;
+            values[f] = v;
+            v += strlen(v) + 1;
+        }
+        if (0 != group_fold(group, conf, values, NULL, row->nb_fields)) goto err;
+    }
+    free(values);
+
+    *groups_ = groups;
+    *nb_groups_ = nb_groups;
+    return 0;
+err:
+    for (size_t g = 0; g < nb_groups; g++) group_dtor(groups[g], conf);
+    free(groups);
+    free(values);
+    return -1;
+}
+
+/*
+ * Sorting the groups before output
+ *
+ * The array is cut in one chunk per thread, each chunk is sorted (radix on
+ * the keys or merge sort on an aggregate), then chunks are merged pairwise,
+ * each merge of a round in its own thread.
+ */
+
+#define SORT_PARALLEL_MIN 100000    // below that many groups a single thread is used
+#define SORT_MAX_THREADS 16
+
+struct sort_job {
+    bool by_key;
+    struct sort_entry *entries, *entries_tmp;   // if by_key
+    struct group **groups, **groups_tmp;        // otherwise
+    struct aggr_func const *aggr;
+    size_t offset;  // of the aggregate in group->values
+    size_t start, mid, stop;
+};
+
+static int group_cmp(struct sort_job const *job, struct group const *a, struct group const *b)
+{
+    return job->aggr->ops.cmp(a->values + job->offset, b->values + job->offset);
+}
+
+static void merge_sort_groups(struct sort_job const *job, struct group **groups, struct group **tmp, size_t nb)
+{
+    if (nb < 2) return;
+    size_t const mid = nb/2;
+    merge_sort_groups(job, groups, tmp, mid);
+    merge_sort_groups(job, groups + mid, tmp + mid, nb - mid);
+    size_t i = 0, j = mid, o = 0;
+    while (i < mid && j < nb) tmp[o++] = group_cmp(job, groups[j], groups[i]) < 0 ? groups[j++] : groups[i++];
+    while (i < mid) tmp[o++] = groups[i++];
+    while (j < nb) tmp[o++] = groups[j++];
+    memcpy(groups, tmp, nb * sizeof(*groups));
+}
+
+static void *sort_chunk(void *job_)
+{
+    struct sort_job const *job = job_;
+    size_t const nb = job->stop - job->start;
+    if (job->by_key) {
+        sort_entries(job->entries + job->start, job->entries_tmp + job->start, nb, 0);
+    } else {
+        merge_sort_groups(job, job->groups + job->start, job->groups_tmp + job->start, nb);
+    }
+    return NULL;
+}
+
+static void *merge_chunks(void *job_)
+{
+    struct sort_job const *job = job_;
+    size_t i = job->start, j = job->mid, o = job->start;
+    if (job->by_key) {
+        struct sort_entry *e = job->entries, *tmp = job->entries_tmp;
+        while (i < job->mid && j < job->stop) tmp[o++] = sort_entry_cmp(e + j, e + i, 0) < 0 ? e[j++] : e[i++];
+        while (i < job->mid) tmp[o++] = e[i++];
+        while (j < job->stop) tmp[o++] = e[j++];
+        memcpy(e + job->start, tmp + job->start, (job->stop - job->start) * sizeof(*e));
+    } else {
+        struct group **g = job->groups, **tmp = job->groups_tmp;
+        while (i < job->mid && j < job->stop) tmp[o++] = group_cmp(job, g[j], g[i]) < 0 ? g[j++] : g[i++];
+        while (i < job->mid) tmp[o++] = g[i++];
+        while (j < job->stop) tmp[o++] = g[j++];
+        memcpy(g + job->start, tmp + job->start, (job->stop - job->start) * sizeof(*g));
+    }
+    return NULL;
+}
+
+// Run all these jobs in parallel (or inline if a thread cannot be created)
+static void run_jobs(struct sort_job *jobs, unsigned nb_jobs, void *(*fun)(void *))
+{
+    pthread_t threads[SORT_MAX_THREADS];
+    bool started[SORT_MAX_THREADS];
+    for (unsigned j = 0; j < nb_jobs; j++) {
+        started[j] = nb_jobs > 1 && 0 == pthread_create(threads + j, NULL, fun, jobs + j);
+        if (! started[j]) fun(jobs + j);
+    }
+    for (unsigned j = 0; j < nb_jobs; j++) {
+        if (started[j]) pthread_join(threads[j], NULL);
+    }
+}
+
+static unsigned sort_nb_threads(size_t nb)
+{
+    if (nb < SORT_PARALLEL_MIN) return 1;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > SORT_MAX_THREADS) n = SORT_MAX_THREADS;
+    if ((size_t)n > nb / (SORT_PARALLEL_MIN/4)) n = nb / (SORT_PARALLEL_MIN/4);
+    return n > 1 ? n : 1;
+}
+
+static void parallel_sort(struct sort_job const *proto, size_t nb)
+{
+    unsigned const nb_threads = sort_nb_threads(nb);
+    size_t bounds[SORT_MAX_THREADS+1];
+    struct sort_job jobs[SORT_MAX_THREADS];
+    for (unsigned t = 0; t <= nb_threads; t++) bounds[t] = nb * t / nb_threads;
+    if (debug) fprintf(stderr, "Sorting %zu groups with %u threads\n", nb, nb_threads);
+
+    for (unsigned t = 0; t < nb_threads; t++) {
+        jobs[t] = *proto;
+        jobs[t].start = bounds[t];
+        jobs[t].stop = bounds[t+1];
+    }
+    run_jobs(jobs, nb_threads, sort_chunk);
+
+    for (unsigned width = 1; width < nb_threads; width *= 2) {
+        unsigned nb_jobs = 0;
+        for (unsigned t = 0; t + width < nb_threads; t += 2*width) {
+            jobs[nb_jobs] = *proto;
+            jobs[nb_jobs].start = bounds[t];
+            jobs[nb_jobs].mid = bounds[t + width];
+            jobs[nb_jobs].stop = bounds[t + 2*width < nb_threads ? t + 2*width : nb_threads];
+            nb_jobs ++;
+        }
+        run_jobs(jobs, nb_jobs, merge_chunks);
+    }
+}
+
+int groups_sort(struct group **groups, size_t nb, struct row_conf const *conf, struct output_order const *order)
+{
+    struct sort_job job = { .by_key = order->by == ORDER_KEY };
+
+    if (job.by_key) {
+        job.entries = malloc(2 * nb * sizeof(*job.entries) + 1);
+        if (! job.entries) {
+            fprintf(stderr, "Cannot malloc %zu sort entries\n", 2 * nb);
+            return -1;
+        }
+        job.entries_tmp = job.entries + nb;
+        for (size_t g = 0; g < nb; g++) {
+            struct key_str const key = group_key(groups[g], conf);
+            job.entries[g].prefix = sort_key_prefix(key.str, key.len);
+            job.entries[g].key = key.str;
+            job.entries[g].key_len = key.len;
+            job.entries[g].data = groups[g];
+        }
+        parallel_sort(&job, nb);
+        for (size_t g = 0; g < nb; g++) groups[g] = job.entries[g].data;
+        free(job.entries);
+    } else {
+        assert(order->by == ORDER_FIELD);
+        assert(order->aggr < conf->nb_aggrs);
+        job.aggr = conf->aggrs[order->aggr].func;
+        job.offset = conf->aggr_cumul_size[order->aggr];
+        job.groups = groups;
+        job.groups_tmp = malloc(nb * sizeof(*job.groups_tmp) + 1);
+        if (! job.groups_tmp) {
+            fprintf(stderr, "Cannot malloc %zu group pointers\n", nb);
+            return -1;
+        }
+        parallel_sort(&job, nb);
+        free(job.groups_tmp);
+    }
+
+    if (order->desc) {
+        for (size_t i = 0, j = nb; i + 1 < j; i++, j--) {
+            struct group *tmp = groups[i];
+            groups[i] = groups[j-1];
+            groups[j-1] = tmp;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "groupby.h"
+
+__thread struct stats stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char const *const timer_names[NB_STATS_TIMERS] = {
+    [STATS_PARSE] = "parse",
+    [STATS_READ] = "read",
+    [STATS_KEY] = "key",
+    [STATS_LOOKUP] = "lookup",
+    [STATS_FOLD] = "fold",
+    [STATS_OUTPUT] = "output",
+    [STATS_ESTIMATE] = "estimate",
+    [STATS_MERGE] = "merge",
+};
+
+void stats_begin(void)
+{
+    stats.start_cycles = stats_cycles();
+    clock_gettime(CLOCK_MONOTONIC, &stats.start_time);
+}
+
+void stats_thread_begin(struct stats const *parent)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.enabled = parent->enabled;
+    stats.json = parent->json;
+    stats.numa = parent->numa;
+}
+
+void stats_thread_end(struct stats *parent)
+{
+    if (! stats.enabled) return;
+    pthread_mutex_lock(&stats_lock);
+    for (unsigned t = 0; t < NB_STATS_TIMERS; t++) parent->cycles[t] += stats.cycles[t];
+    parent->bytes_read += stats.bytes_read;
+    parent->rows += stats.rows;
+    parent->filtered += stats.filtered;
+    parent->groups += stats.groups;
+    parent->refills += stats.refills;
+    parent->memmoves += stats.memmoves;
+    parent->memmove_bytes += stats.memmove_bytes;
+    parent->alloc_bytes += stats.alloc_bytes;
+    parent->nb_buckets += stats.nb_buckets;
+    parent->used_buckets += stats.used_buckets;
+    if (stats.max_chain > parent->max_chain) parent->max_chain = stats.max_chain;
+    parent->rehashes += stats.rehashes;
+    parent->estimated_groups += stats.estimated_groups;
+    parent->estimated_bytes += stats.estimated_bytes;
+    parent->spill_parts += stats.spill_parts;
+    parent->spill_bytes += stats.spill_bytes;
+    parent->threads += 1 + stats.threads;
+    parent->numa_local_pages += stats.numa_local_pages;
+    parent->numa_remote_pages += stats.numa_remote_pages;
+    parent->shared_slots += stats.shared_slots;
+    parent->shared_groups += stats.shared_groups;
+    parent->readahead_bufs += stats.readahead_bufs;
+    parent->readahead_waits += stats.readahead_waits;
+    parent->dense_rows += stats.dense_rows;
+    parent->short_rows += stats.short_rows;
+    parent->bypassed_rows += stats.bypassed_rows;
+    parent->mru_lookups += stats.mru_lookups;
+    parent->mru_hits += stats.mru_hits;
+    parent->hugetlb_pages += stats.hugetlb_pages;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_groups(struct groups const *groups)
+{
+    // Added up over all the tables of a run
+    stats.nb_buckets += groups->nb_buckets;
+    for (unsigned h = 0; h < groups->nb_buckets; h++) {
+        uint64_t len = 0;
+        struct group *group;
+        SLIST_FOREACH(group, groups->hash + h, entry) len ++;
+        if (len == 0) continue;
+        stats.used_buckets ++;
+        if (len > stats.max_chain) stats.max_chain = len;
+    }
+}
+
+void stats_huge_pages(void)
+{
+    FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (! smaps) return;
+    char line[256];
+    uint64_t kb;
+    while (fgets(line, sizeof(line), smaps)) {
+        if (1 == sscanf(line, "AnonHugePages: %"SCNu64" kB", &kb)) {
+            // Keep the largest count over all the tables of a run
+            if (kb / 2048 > stats.thp_pages) stats.thp_pages = kb / 2048;
+            break;
+        }
+    }
+    fclose(smaps);
+}
+
+void stats_print(FILE *out)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t const cycles = stats_cycles() - stats.start_cycles;
+    double const seconds = (end.tv_sec - stats.start_time.tv_sec) + (end.tv_nsec - stats.start_time.tv_nsec) * 1e-9;
+    double const cycles_per_sec = seconds > 0. ? cycles / seconds : 1e9;
+
+    // Tokenizing is what's left of parse once the callbacks are accounted for
+    uint64_t const parse_other = stats.cycles[STATS_READ] + stats.cycles[STATS_KEY] + stats.cycles[STATS_LOOKUP] + stats.cycles[STATS_FOLD];
+    uint64_t const tokenize = stats.cycles[STATS_PARSE] > parse_other ? stats.cycles[STATS_PARSE] - parse_other : 0;
+    double const avg_chain = stats.used_buckets ? (double)stats.groups / stats.used_buckets : 0.;
+
+    if (stats.json) {
+        fprintf(out, "{\"seconds\":%.6f,\"cycles_per_second\":%.0f,\"timers\":{", seconds, cycles_per_sec);
+        for (unsigned t = 0; t < NB_STATS_TIMERS; t++) {
+            fprintf(out, "\"%s\":{\"cycles\":%"PRIu64",\"seconds\":%.6f},", timer_names[t], stats.cycles[t], stats.cycles[t] / cycles_per_sec);
+        }
+        fprintf(out, "\"tokenize\":{\"cycles\":%"PRIu64",\"seconds\":%.6f}},", tokenize, tokenize / cycles_per_sec);
+        fprintf(out, "\"bytes_read\":%"PRIu64",\"rows\":%"PRIu64",\"filtered\":%"PRIu64",\"groups\":%"PRIu64","
+                     "\"buckets\":%"PRIu64",\"used_buckets\":%"PRIu64",\"avg_chain\":%.3f,\"max_chain\":%"PRIu64","
+                     "\"rehashes\":%"PRIu64",\"estimated_groups\":%"PRIu64",\"estimated_bytes\":%"PRIu64","
+                     "\"spill_parts\":%"PRIu64",\"spill_bytes\":%"PRIu64",\"threads\":%"PRIu64","
+                     "\"numa_local_pages\":%"PRIu64",\"numa_remote_pages\":%"PRIu64","
+                     "\"shared_slots\":%"PRIu64",\"shared_groups\":%"PRIu64",\"bypassed_rows\":%"PRIu64","
+                     "\"readahead_bufs\":%"PRIu64",\"readahead_waits\":%"PRIu64",\"dense_rows\":%"PRIu64",\"short_rows\":%"PRIu64","
+                     "\"mru_lookups\":%"PRIu64",\"mru_hits\":%"PRIu64","
+                     "\"hugetlb_pages\":%"PRIu64",\"thp_pages\":%"PRIu64","
+                     "\"refills\":%"PRIu64",\"memmoves\":%"PRIu64",\"memmove_bytes\":%"PRIu64","
+                     "\"alloc_bytes\":%"PRIu64"}\n",
+                stats.bytes_read, stats.rows, stats.filtered, stats.groups,
+                stats.nb_buckets, stats.used_buckets, avg_chain, stats.max_chain,
+                stats.rehashes, stats.estimated_groups, stats.estimated_bytes,
+                stats.spill_parts, stats.spill_bytes, stats.threads,
+                stats.numa_local_pages, stats.numa_remote_pages,
+                stats.shared_slots, stats.shared_groups, stats.bypassed_rows,
+                stats.readahead_bufs, stats.readahead_waits, stats.dense_rows, stats.short_rows,
+                stats.mru_lookups, stats.mru_hits,
+                stats.hugetlb_pages, stats.thp_pages,
+                stats.refills, stats.memmoves, stats.memmove_bytes,
+                stats.alloc_bytes);
+        return;
+    }
+
+    fprintf(out, "total: %.3fs\n", seconds);
+    for (unsigned t = 0; t < NB_STATS_TIMERS; t++) {
+        fprintf(out, "  %-8s %12.3f Mcycles %9.3fs\n", timer_names[t], stats.cycles[t] / 1e6, stats.cycles[t] / cycles_per_sec);
+        if (t == STATS_PARSE) {
+            fprintf(out, "  %-8s %12.3f Mcycles %9.3fs\n", "tokenize", tokenize / 1e6, tokenize / cycles_per_sec);
+        }
+    }
+    fprintf(out, "bytes read: %"PRIu64" in %"PRIu64" refills (%"PRIu64" memmoves of %"PRIu64" bytes)\n",
+            stats.bytes_read, stats.refills, stats.memmoves, stats.memmove_bytes);
+    if (stats.readahead_bufs) {
+        fprintf(out, "read ahead: %"PRIu64" buffers, waited for %"PRIu64" of them\n", stats.readahead_bufs, stats.readahead_waits);
+    }
+    fprintf(out, "rows: %"PRIu64" (%"PRIu64" filtered out), groups: %"PRIu64"\n", stats.rows, stats.filtered, stats.groups);
+    fprintf(out, "buckets: %"PRIu64" used out of %"PRIu64", chain length avg %.3f max %"PRIu64"\n",
+            stats.used_buckets, stats.nb_buckets, avg_chain, stats.max_chain);
+    fprintf(out, "rehashes: %"PRIu64"\n", stats.rehashes);
+    if (stats.dense_rows) {
+        fprintf(out, "dense: %"PRIu64" rows folded in batches, %"PRIu64" short keys found unhashed\n", stats.dense_rows, stats.short_rows);
+    }
+    if (stats.mru_lookups) {
+        fprintf(out, "last groups: %"PRIu64" rows of %"PRIu64" found their group there (%.1f%%)\n",
+                stats.mru_hits, stats.mru_lookups, 100. * stats.mru_hits / stats.mru_lookups);
+    }
+    if (huge_pages) {
+        fprintf(out, "huge pages: %"PRIu64" reserved ones mapped, %"PRIu64" transparent ones once groups were complete\n",
+                stats.hugetlb_pages, stats.thp_pages);
+    }
+    if (stats.estimated_groups) {
+        fprintf(out, "estimated: %"PRIu64" groups in %"PRIu64" bytes\n", stats.estimated_groups, stats.estimated_bytes);
+    }
+    if (stats.threads) {
+        fprintf(out, "threads: %"PRIu64" (timers add up their time)\n", stats.threads);
+    }
+    if (stats.shared_slots) {
+        fprintf(out, "shared table: %"PRIu64" groups in %"PRIu64" slots, the others partitioned\n", stats.shared_groups, stats.shared_slots);
+    }
+    if (stats.bypassed_rows) {
+        fprintf(out, "bypassed: %"PRIu64" rows sent to their partition unaggregated\n", stats.bypassed_rows);
+    }
+    if (stats.numa) {
+        fprintf(out, "numa: %"PRIu64" local pages, %"PRIu64" remote pages of groups\n", stats.numa_local_pages, stats.numa_remote_pages);
+    }
+    if (stats.spill_parts) {
+        fprintf(out, "spilled: %"PRIu64" bytes in %"PRIu64" partitions\n", stats.spill_bytes, stats.spill_parts);
+    }
+    fprintf(out, "allocated: %"PRIu64" bytes\n", stats.alloc_bytes);
+}
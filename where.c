@@ -0,0 +1,139 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Row filtering (--where).
+ * Predicates are checked as soon as the parser hands over their field, on the
+ * field bytes as they are in the input buffer. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "groupby.h"
+
+static struct {
+    char const *name;
+    enum pred_op op;
+} const pred_ops[] = {
+    // Longest first
+    { "!=", PRED_NE }, { "^=", PRED_PREFIX }, { "<=", PRED_LE }, { ">=", PRED_GE },
+    { "=", PRED_EQ }, { "<", PRED_LT }, { ">", PRED_GT },
+};
+
+static bool pred_is_numeric(enum pred_op op)
+{
+    return op == PRED_LT || op == PRED_LE || op == PRED_GT || op == PRED_GE;
+}
+
+static int add_pred(struct row_conf *row_conf, struct row_pred const *pred)
+{
+    if (row_conf->nb_preds >= row_conf->max_preds) {
+        unsigned const max = row_conf->max_preds ? 2 * row_conf->max_preds : 8;
+        struct row_pred *preds = realloc(row_conf->preds, max * sizeof(*preds));
+        if (! preds) {
+            fprintf(stderr, "Cannot realloc %u predicates\n", max);
+            return -1;
+        }
+        row_conf->preds = preds;
+        row_conf->max_preds = max;
+    }
+    row_conf->preds[row_conf->nb_preds++] = *pred;
+    return 0;
+}
+
+// The list of alternatives separated by '|' (for the string comparisons)
+static int pred_set_values(struct row_pred *pred, char const *str)
+{
+    pred->nb_values = 1;
+    for (char const *c = str; *c; c++) if (*c == '|') pred->nb_values ++;
+
+    size_t const len = strlen(str);
+    pred->values = malloc(pred->nb_values * sizeof(*pred->values) + len + 1);
+    if (! pred->values) {
+        fprintf(stderr, "Cannot malloc predicate values\n");
+        return -1;
+    }
+    char *copy = (char *)(pred->values + pred->nb_values);
+    memcpy(copy, str, len+1);
+
+    for (unsigned v = 0; v < pred->nb_values; v++) {
+        char *const end = strchrnul(copy, '|');
+        pred->values[v].str = copy;
+        pred->values[v].len = end - copy;
+        copy = end + 1;
+    }
+    return 0;
+}
+
+int row_conf_where(struct row_conf *row_conf, char const *opt)
+{
+    char *eoi;
+    unsigned long const field = strtoul(opt, &eoi, 10);
+    if (eoi == opt || field == 0 || field > UINT_MAX) {
+        fprintf(stderr, "Bad predicate '%s' (field number expected first)\n", opt);
+        return -1;
+    }
+    if (0 != row_conf_grow(row_conf, field)) return -1;
+
+    struct row_pred pred = { .field = field-1, .values = NULL, .nb_values = 0 };
+    unsigned o;
+    for (o = 0; o < SIZEOF_ARRAY(pred_ops); o++) {
+        size_t const len = strlen(pred_ops[o].name);
+        if (0 == strncmp(eoi, pred_ops[o].name, len)) {
+            pred.op = pred_ops[o].op;
+            eoi += len;
+            break;
+        }
+    }
+    if (o >= SIZEOF_ARRAY(pred_ops)) {
+        fprintf(stderr, "Bad predicate '%s' (unknown operator)\n", opt);
+        return -1;
+    }
+
+    if (pred_is_numeric(pred.op)) {
+        char *end;
+        errno = 0;
+        pred.num = strtoll(eoi, &end, 0);
+        if (end == eoi || *end != '\0' || errno) {
+            fprintf(stderr, "Bad predicate '%s' (integer expected)\n", opt);
+            return -1;
+        }
+    } else if (0 != pred_set_values(&pred, eoi)) {
+        return -1;
+    }
+
+    if (0 != add_pred(row_conf, &pred)) {
+        free(pred.values);
+        return -1;
+    }
+    return 0;
+}
+
+bool pred_eval(struct row_pred const *pred, char const *field, size_t len)
+{
+    switch (pred->op) {
+        case PRED_EQ:
+        case PRED_NE:
+            for (unsigned v = 0; v < pred->nb_values; v++) {
+                if (len == pred->values[v].len && 0 == memcmp(field, pred->values[v].str, len)) {
+                    return pred->op == PRED_EQ;
+                }
+            }
+            return pred->op == PRED_NE;
+        case PRED_PREFIX:
+            for (unsigned v = 0; v < pred->nb_values; v++) {
+                if (len >= pred->values[v].len && 0 == memcmp(field, pred->values[v].str, pred->values[v].len)) {
+                    return true;
+                }
+            }
+            return false;
+        case PRED_LT:
+            return ll_of_str(field) < pred->num;
+        case PRED_LE:
+            return ll_of_str(field) <= pred->num;
+        case PRED_GT:
+            return ll_of_str(field) > pred->num;
+        case PRED_GE:
+            return ll_of_str(field) >= pred->num;
+    }
+    return false;
+}